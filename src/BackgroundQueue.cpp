@@ -0,0 +1,71 @@
+/*
+ * BackgroundQueue.cpp
+ *
+ *      Author: Jason Ferrara
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+#include "BackgroundQueue.h"
+
+BackgroundQueue::BackgroundQueue() : m_started(false), m_stopping(false)
+{
+}
+
+BackgroundQueue::~BackgroundQueue()
+{
+	stop();
+}
+
+bool BackgroundQueue::start()
+{
+	LockMutex lock(m_mutex);
+
+	if (m_started)
+		return true;
+	if (m_stopping)
+		return false;
+	if (pthread_create(&m_thread, 0, threadMain, this))
+		return false;
+	m_started = true;
+	return true;
+}
+
+void BackgroundQueue::stop()
+{
+	{
+		LockMutex lock(m_mutex);
+
+		m_stopping = true;
+		if (!m_started)
+			return;
+		m_started = false;
+		m_queueChanged.Signal();
+	}
+	pthread_join(m_thread, 0);
+}
+
+bool BackgroundQueue::stopping()
+{
+	LockMutex lock(m_mutex);
+
+	return m_stopping;
+}
+
+void* BackgroundQueue::threadMain(void* queue)
+{
+	((BackgroundQueue*) queue)->run();
+	return 0;
+}
@@ -0,0 +1,75 @@
+/*
+ * BackgroundQueue.h
+ *
+ *      Author: Jason Ferrara
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+
+#ifndef BACKGROUNDQUEUE_H_
+#define BACKGROUNDQUEUE_H_
+
+#include "Mutex.h"
+#include <pthread.h>
+
+/*
+ * The thread behind each of the queues that do work in the background. The
+ * thread is started when the first work is queued, so that it is created
+ * after fuse has forked into the background, and runs run() until that
+ * returns.
+ *
+ * Subclasses keep their queue protected by m_mutex, and signal
+ * m_queueChanged when they change it. Their destructors have to call stop()
+ * before anything run() uses goes away.
+ */
+class BackgroundQueue
+{
+public:
+	BackgroundQueue();
+	virtual ~BackgroundQueue();
+
+protected:
+	/*
+	 * Start the thread if it isn't running. Returns false if there is no
+	 * thread, because it couldn't be created or the queue is stopping.
+	 */
+	bool start();
+
+	/*
+	 * Tell run() to finish, and wait until it has.
+	 */
+	void stop();
+
+	bool stopping();
+
+	virtual void run() = 0;
+
+	RecursiveMutex		m_mutex;
+	ConditionVariable	m_queueChanged;
+
+private:
+	BackgroundQueue(const BackgroundQueue&);
+	BackgroundQueue& operator=(const BackgroundQueue&);
+
+	static void* threadMain(void* queue);
+
+	bool				m_started;
+	bool				m_stopping;
+	pthread_t			m_thread;
+};
+
+
+#endif /* BACKGROUNDQUEUE_H_ */
@@ -22,7 +22,11 @@
 #ifndef FUSEHEADER_H_
 #define FUSEHEADER_H_
 
+#ifdef HAVE_FUSE3
+#define FUSE_USE_VERSION 30
+#else
 #define FUSE_USE_VERSION 26
+#endif
 #include <fuse.h>
 #include <fuse_opt.h>
 
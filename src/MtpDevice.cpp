@@ -19,6 +19,7 @@
  * licensing@fsf.org
  */
 #include "MtpDevice.h"
+#include "MtpFolderContents.h"
 #include "MtpLibLock.h"
 #include "ConnectedMtpDevices.h"
 #include <sys/stat.h>
@@ -58,7 +59,11 @@ NewLIBMTPFile::operator LIBMTP_file_t*()
 	return m_fileInfo;
 }
 
-MtpDevice::MtpDevice(LIBMTP_raw_device_t& rawDevice)
+MtpDevice::MtpDevice(LIBMTP_raw_device_t& rawDevice) : m_storagesFetched(0), m_storageTimeout(30),
+	m_partialFileRate(0), m_disconnected(false), m_disconnectHandler(0), m_disconnectData(0)
+#ifdef HAVE_LIBMTP_READ_EVENT_ASYNC
+	, m_eventPending(false), m_eventReceived(0)
+#endif
 {
 MtpLibLock	lock;
 
@@ -73,6 +78,8 @@ MtpLibLock	lock;
 		throw std::runtime_error("Couldn't init magic");
 	if (magic_load(m_magicCookie, 0))
 		throw std::runtime_error(magic_error(m_magicCookie));
+	m_canGetPartialFile = LIBMTP_Check_Capability(m_mtpdevice, LIBMTP_DEVICECAP_GetPartialObject);
+	m_canEditFile = LIBMTP_Check_Capability(m_mtpdevice, LIBMTP_DEVICECAP_EditObjects);
 
 }
 
@@ -102,58 +109,123 @@ MtpLibLock	lock;
 }
 
 
-std::vector<MtpStorageInfo> MtpDevice::GetStorageDevices()
+std::string MtpDevice::Get_Serialnumber()
 {
 MtpLibLock	lock;
 
-	if (LIBMTP_Get_Storage(m_mtpdevice, LIBMTP_STORAGE_SORTBY_NOTSORTED))
+	char* serial = LIBMTP_Get_Serialnumber(m_mtpdevice);
+	if (serial)
 	{
-		CheckErrors(true);
+		std::string result(serial);
+		free(serial);
+		return result;
 	}
+	else
+	{
+		CheckErrors(false);
+		return "";
+	}
+}
 
-	LIBMTP_devicestorage_t* storage = m_mtpdevice->storage;
+std::vector<MtpStorageInfo> MtpDevice::GetStorageDevices()
+{
 	std::vector<MtpStorageInfo> result;
-	while(storage)
 	{
-		result.push_back(MtpStorageInfo(storage->id, storage->StorageDescription,
-				storage->FreeSpaceInBytes, storage->MaxCapacity));
-		storage = storage->next;
+		MtpLibLock	lock;
+
+		if (LIBMTP_Get_Storage(m_mtpdevice, LIBMTP_STORAGE_SORTBY_NOTSORTED))
+		{
+			CheckErrors(true);
+		}
+
+		LIBMTP_devicestorage_t* storage = m_mtpdevice->storage;
+		while(storage)
+		{
+			result.push_back(MtpStorageInfo(storage->id, storage->StorageDescription,
+					storage->FreeSpaceInBytes, storage->MaxCapacity));
+			storage = storage->next;
+		}
 	}
+
+	LockMutex lock(m_storageMutex);
+	m_storages = result;
+	m_storagesFetched = time(0);
 	return result;
 
 }
 
+std::vector<MtpStorageInfo> MtpDevice::GetCachedStorageDevices()
+{
+	{
+		LockMutex lock(m_storageMutex);
+		if (m_storagesFetched && (time(0) - m_storagesFetched < m_storageTimeout))
+			return m_storages;
+	}
+	return GetStorageDevices();
+}
+
 MtpStorageInfo MtpDevice::GetStorageInfo(uint32_t storageId)
 {
-	std::vector<MtpStorageInfo> storages = GetStorageDevices();
+	std::vector<MtpStorageInfo> storages = GetCachedStorageDevices();
 	for(std::vector<MtpStorageInfo>::iterator i = storages.begin(); i != storages.end(); i++)
 		if (i->id == storageId)
 			return *i;
 	throw MtpStorageNotFound("storage not found");
 }
 
-std::vector<MtpFileInfo> MtpDevice::GetFolderContents(uint32_t storageId, uint32_t folderId)
+time_t MtpDevice::StorageTimeout()
+{
+	LockMutex lock(m_storageMutex);
+	return m_storageTimeout;
+}
+
+void MtpDevice::SetStorageTimeout(time_t seconds)
+{
+	LockMutex lock(m_storageMutex);
+	m_storageTimeout = seconds;
+}
+
+void MtpDevice::ForgetStorageDevices()
+{
+	LockMutex lock(m_storageMutex);
+	m_storagesFetched = 0;
+}
+
+void MtpDevice::StorageSpaceUsed(uint32_t storageId, int64_t bytes)
+{
+	LockMutex lock(m_storageMutex);
+	for(std::vector<MtpStorageInfo>::iterator i = m_storages.begin(); i != m_storages.end(); i++)
+	{
+		if (i->id == storageId)
+		{
+			if ((bytes > 0) && ((uint64_t)bytes > i->freeSpaceInBytes))
+				i->freeSpaceInBytes = 0;
+			else if ((bytes < 0) && (i->freeSpaceInBytes - bytes > i->maxCapacity))
+				i->freeSpaceInBytes = i->maxCapacity;
+			else
+				i->freeSpaceInBytes -= bytes;
+		}
+	}
+}
+
+void MtpDevice::GetFolderContents(uint32_t storageId, uint32_t folderId, MtpFolderContents& contents)
 {
 MtpLibLock lock;
 
-	std::vector<MtpFileInfo> result;
 	LIBMTP_file_t* files = LIBMTP_Get_Files_And_Folders(m_mtpdevice, storageId, folderId);
 	if (files == 0)
 	{
 		CheckErrors(false);
-		return result;
+		return;
 	}
 	LIBMTP_file_t* filesWalk = files;
 	while(filesWalk)
 	{
-		MtpFileInfo fileInfo(MtpFileInfo(filesWalk->item_id, filesWalk->parent_id, filesWalk->storage_id, filesWalk->filename,
-					filesWalk->filetype, filesWalk->filesize));
-		result.push_back(fileInfo);
+		contents.add(*filesWalk);
 		filesWalk = filesWalk->next;
 	}
 	if (files)
 		LIBMTP_destroy_file_t(files);
-	return result;
 }
 
 
@@ -182,14 +254,118 @@ MtpLibLock lock;
 		CheckErrors(true);
 }
 
-void MtpDevice::CreateFolder(const std::string& name, uint32_t parentId, uint32_t storageId)
+void MtpDevice::GetFile(uint32_t id, MTPDataPutFunc putFunc, void* priv)
+{
+MtpLibLock lock;
+
+	if (LIBMTP_Get_File_To_Handler(m_mtpdevice, id, putFunc, priv, 0, 0))
+		CheckErrors(true);
+}
+
+bool MtpDevice::CanGetPartialFile()
+{
+	return m_canGetPartialFile;
+}
+
+size_t MtpDevice::GetPartialFile(uint32_t id, uint64_t offset, size_t size, void* buf)
+{
+MtpLibLock lock;
+
+	// Ask for it a piece at a time so libmtp doesn't have to buffer huge reads.
+	const size_t maxRequestSize = 1024*1024;
+	size_t gotBytes = 0;
+	while(gotBytes < size)
+	{
+		unsigned char* data = 0;
+		unsigned int dataSize = 0;
+		struct timespec start, end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (LIBMTP_GetPartialObject(m_mtpdevice, id, offset + gotBytes,
+				std::min(size - gotBytes, maxRequestSize), &data, &dataSize))
+		{
+			free(data);
+			CheckErrors(true);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		uint64_t elapsedUs = (end.tv_sec - start.tv_sec) * 1000000ull + (end.tv_nsec - start.tv_nsec) / 1000;
+		if (dataSize && elapsedUs)
+		{
+			LockMutex rateLock(m_partialFileRateMutex);
+			uint64_t rate = dataSize * 1000000ull / elapsedUs;
+			// Smoothed, so one slow request doesn't throw it off.
+			m_partialFileRate = m_partialFileRate ? (3 * m_partialFileRate + rate) / 4 : rate;
+		}
+		memcpy((char*) buf + gotBytes, data, dataSize);
+		free(data);
+		gotBytes += dataSize;
+		if (dataSize == 0)
+			break;
+	}
+	return gotBytes;
+}
+
+uint64_t MtpDevice::PartialFileRate()
+{
+	LockMutex rateLock(m_partialFileRateMutex);
+
+	return m_partialFileRate;
+}
+
+bool MtpDevice::CanEditFile()
+{
+	return m_canEditFile;
+}
+
+void MtpDevice::BeginEditFile(uint32_t id)
+{
+MtpLibLock lock;
+
+	if (LIBMTP_BeginEditObject(m_mtpdevice, id))
+		CheckErrors(true);
+}
+
+void MtpDevice::SendPartialFile(uint32_t id, uint64_t offset, const void* data, size_t size)
+{
+MtpLibLock lock;
+
+	if (LIBMTP_SendPartialObject(m_mtpdevice, id, offset, (unsigned char*) data, size))
+		CheckErrors(true);
+}
+
+void MtpDevice::TruncateFile(uint32_t id, uint64_t size)
 {
 MtpLibLock lock;
 
-	if (LIBMTP_Create_Folder(m_mtpdevice, (char*) name.c_str(), parentId, storageId)==0)
+	if (LIBMTP_TruncateObject(m_mtpdevice, id, size))
 		CheckErrors(true);
 }
 
+void MtpDevice::EndEditFile(uint32_t id)
+{
+MtpLibLock lock;
+
+	if (LIBMTP_EndEditObject(m_mtpdevice, id))
+		CheckErrors(true);
+}
+
+uint32_t MtpDevice::CreateFolder(const std::string& name, uint32_t parentId, uint32_t storageId)
+{
+MtpLibLock lock;
+
+	uint32_t id = LIBMTP_Create_Folder(m_mtpdevice, (char*) name.c_str(), parentId, storageId);
+	if (id==0)
+		CheckErrors(true);
+	return id;
+}
+
+void MtpDevice::SetDisconnectHandler(void (*handler)(void* data), void* data)
+{
+MtpLibLock lock;
+
+	m_disconnectHandler = handler;
+	m_disconnectData = data;
+}
+
 void MtpDevice::CheckErrors(bool throwEvenWithNoError)
 {
 MtpLibLock lock;
@@ -203,6 +379,12 @@ MtpLibLock lock;
 		switch(errorCode)
 		{
 		case LIBMTP_ERROR_NO_DEVICE_ATTACHED:
+			if (!m_disconnected)
+			{
+				m_disconnected = true;
+				if (m_disconnectHandler)
+					m_disconnectHandler(m_disconnectData);
+			}
 			throw MtpDeviceDisconnected(errorText);
 		default:
 			throw MtpError(errorText, errorCode);
@@ -214,18 +396,21 @@ MtpLibLock lock;
 		throw ExpectedMtpErrorNotFound();
 }
 
-void MtpDevice::DeleteObject(uint32_t id)
+void MtpDevice::DeleteObject(const MtpFileInfo& object)
 {
-MtpLibLock lock;
-	if (LIBMTP_Delete_Object(m_mtpdevice, id))
-		CheckErrors(true);
+	{
+		MtpLibLock lock;
+		if (LIBMTP_Delete_Object(m_mtpdevice, object.id))
+			CheckErrors(true);
+	}
+	if (object.filetype != LIBMTP_FILETYPE_FOLDER)
+		StorageSpaceUsed(object.storageId, -(int64_t)object.filesize);
 }
 
 void MtpDevice::SendFile(LIBMTP_file_t* destination, int fd)
 {
 MtpLibLock lock;
 
-const char* mimeType = 0;
 	if (destination->filesize > 0)
 	{
 		// We want to use magic_descriptor here, but there is a bug
@@ -241,14 +426,35 @@ const char* mimeType = 0;
 		lseek(fd, 0, SEEK_SET);
 		ssize_t bytesRead = read(fd, m_magicBuffer, MAGIC_BUFFER_SIZE);
 		lseek(fd,0,SEEK_SET);
-		mimeType = magic_buffer(m_magicCookie, m_magicBuffer, bytesRead);
+		if (bytesRead > 0)
+			SetFiletype(destination, m_magicBuffer, bytesRead);
 	}
-	if (mimeType)
-		destination->filetype = PropertyTypeFromMimeType(mimeType);
 
 
 	if (LIBMTP_Send_File_From_File_Descriptor(m_mtpdevice, fd, destination, 0,0))
 		CheckErrors(true);
+	StorageSpaceUsed(destination->storage_id, destination->filesize);
+}
+
+void MtpDevice::SendFile(LIBMTP_file_t* destination, MTPDataGetFunc getFunc, void* priv,
+		const char* header, size_t headerSize)
+{
+MtpLibLock lock;
+
+	if (headerSize > 0)
+		SetFiletype(destination, header, headerSize);
+	if (LIBMTP_Send_File_From_Handler(m_mtpdevice, getFunc, priv, destination, 0, 0))
+		CheckErrors(true);
+	StorageSpaceUsed(destination->storage_id, destination->filesize);
+}
+
+void MtpDevice::SetFiletype(LIBMTP_file_t* destination, const char* header, size_t headerSize)
+{
+MtpLibLock lock;
+
+	const char* mimeType = magic_buffer(m_magicCookie, header, headerSize);
+	if (mimeType)
+		destination->filetype = PropertyTypeFromMimeType(mimeType);
 }
 
 
@@ -273,6 +479,55 @@ void MtpDevice::SetObjectProperty(uint32_t id, LIBMTP_property_t property, const
 		CheckErrors(true);
 }
 
+#ifdef HAVE_LIBMTP_READ_EVENT_ASYNC
+bool MtpDevice::ReadEvent(LIBMTP_event_t& event, uint32_t& param, int timeoutMs)
+{
+	if (!m_eventPending)
+	{
+		MtpLibLock lock;
+
+		m_eventReceived = 0;
+		if (LIBMTP_Read_Event_Async(m_mtpdevice, EventReceived, this))
+			return false;
+		m_eventPending = true;
+	}
+	// This just runs libusb's event loop, which is safe alongside the other
+	// calls, so it isn't serialized with them. Holding the lock would stall
+	// them for the whole wait.
+	struct timeval timeout;
+	timeout.tv_sec = timeoutMs / 1000;
+	timeout.tv_usec = (timeoutMs % 1000) * 1000;
+	if (LIBMTP_Handle_Events_Timeout_Completed(&timeout, &m_eventReceived))
+		return false;
+	if (!m_eventReceived)
+	{
+		event = LIBMTP_EVENT_NONE;
+		return true;
+	}
+	m_eventPending = false;
+	if (m_eventResult != LIBMTP_HANDLER_RETURN_OK)
+		return false;
+	event = m_event;
+	param = m_eventParam;
+	return true;
+}
+
+/*
+ * Called by libusb's event loop, which may be running in another thread in
+ * the middle of a call on the device, so this mustn't touch the device.
+ * libusb's event lock orders it with the waiting thread seeing
+ * m_eventReceived set.
+ */
+void MtpDevice::EventReceived(int result, LIBMTP_event_t event, uint32_t param, void* device)
+{
+	MtpDevice* self = (MtpDevice*) device;
+	self->m_eventResult = result;
+	self->m_event = event;
+	self->m_eventParam = param;
+	self->m_eventReceived = 1;
+}
+#endif
+
 LIBMTP_filetype_t MtpDevice::PropertyTypeFromMimeType(const std::string& mimeType)
 {
 	if (mimeType == "video/quicktime")
@@ -23,11 +23,13 @@
 #define MTPDEVICE_H_
 
 #include "libmtp.h"
+#include "Mutex.h"
 #include <string>
 #include <vector>
 #include <stdexcept>
 #include <string.h>
 #include <magic.h>
+#include <time.h>
 
 #define MAGIC_BUFFER_SIZE 8192
 
@@ -119,6 +121,8 @@ private:
 	NewLIBMTPFile& operator=(const NewLIBMTPFile&);
 };
 
+class MtpFolderContents;
+
 class MtpDevice
 {
 public:
@@ -126,26 +130,132 @@ public:
 	~MtpDevice();
 
 	std::string Get_Modelname();
+	std::string Get_Serialnumber();
 	std::vector<MtpStorageInfo> GetStorageDevices();
+
+	/*
+	 * Capacity and free space of the storages, for statfs. Answered from
+	 * the last GetStorageDevices if that was less than StorageTimeout seconds
+	 * ago, without waiting for the device. Space used or freed by our own
+	 * SendFile and DeleteObject calls is accounted for in the meantime.
+	 */
+	std::vector<MtpStorageInfo> GetCachedStorageDevices();
 	MtpStorageInfo GetStorageInfo(uint32_t storageId);
-	std::vector<MtpFileInfo> GetFolderContents(uint32_t storageId, uint32_t folderId);
+	time_t StorageTimeout();
+	void SetStorageTimeout(time_t seconds);
+
+	/*
+	 * Makes the next GetCachedStorageDevices ask the device, because a
+	 * storage has been added or removed.
+	 */
+	void ForgetStorageDevices();
+
+	/*
+	 * Adds the objects in a folder to contents.
+	 */
+	void GetFolderContents(uint32_t storageId, uint32_t folderId, MtpFolderContents& contents);
 	MtpFileInfo GetFileInfo(uint32_t id);
 	void GetFile(uint32_t id, int fd);
+
+	/*
+	 * Gets a file, handing it to putFunc as it arrives.
+	 */
+	void GetFile(uint32_t id, MTPDataPutFunc putFunc, void* priv);
+
+	/*
+	 * True if the device can send just part of a file.
+	 */
+	bool CanGetPartialFile();
+
+	/*
+	 * Reads size bytes starting at offset of the file into buf, without
+	 * transferring the rest of it. Returns how many bytes were read, which
+	 * is less than size only at the end of the file.
+	 */
+	size_t GetPartialFile(uint32_t id, uint64_t offset, size_t size, void* buf);
+
+	/*
+	 * Recent speed of GetPartialFile in bytes per second, including the
+	 * time spent on each request. 0 until it has been used.
+	 */
+	uint64_t PartialFileRate();
+
+	/*
+	 * True if the device can change files in place (Android's edit object
+	 * extensions). Changes are made between BeginEditFile and EndEditFile.
+	 */
+	bool CanEditFile();
+	void BeginEditFile(uint32_t id);
+	void SendPartialFile(uint32_t id, uint64_t offset, const void* data, size_t size);
+	void TruncateFile(uint32_t id, uint64_t size);
+	void EndEditFile(uint32_t id);
 	void SendFile(LIBMTP_file_t* destination, int fd);
-	void CreateFolder(const std::string& name, uint32_t parentId, uint32_t storageId);
-	void DeleteObject(uint32_t id);
+
+	/*
+	 * Sends a file whose contents are handed to libmtp by getFunc as it asks
+	 * for them. header is the start of the contents, used to work out the
+	 * file type.
+	 */
+	void SendFile(LIBMTP_file_t* destination, MTPDataGetFunc getFunc, void* priv,
+			const char* header, size_t headerSize);
+	/*
+	 * Returns the id of the new folder.
+	 */
+	uint32_t CreateFolder(const std::string& name, uint32_t parentId, uint32_t storageId);
+	void DeleteObject(const MtpFileInfo& object);
 	void RenameFile(uint32_t id, const std::string& newName);
 	void SetObjectProperty(uint32_t id, LIBMTP_property_t property, const std::string& value);
+
+#ifdef HAVE_LIBMTP_READ_EVENT_ASYNC
+	/*
+	 * Waits up to timeoutMs for the device to report that something changed
+	 * on it, setting event to LIBMTP_EVENT_NONE if it didn't. Returns false
+	 * if waiting fails, which it does straight away on devices that can't
+	 * report events. A wait that times out carries on with the next call.
+	 * Only one thread may wait for events.
+	 */
+	bool ReadEvent(LIBMTP_event_t& event, uint32_t& param, int timeoutMs);
+#endif
 	static LIBMTP_filetype_t PropertyTypeFromMimeType(const std::string& mimeType);
 
+	/*
+	 * handler is called with data the first time a call finds the device
+	 * disconnected, from whichever thread made it, just before it throws
+	 * MtpDeviceDisconnected. It's called with MtpLibLock held, so it mustn't
+	 * use the device.
+	 */
+	void SetDisconnectHandler(void (*handler)(void* data), void* data);
+
 
 protected:
 	void CheckErrors(bool throwEvenIfNoError);
+	void SetFiletype(LIBMTP_file_t* destination, const char* header, size_t headerSize);
+	void StorageSpaceUsed(uint32_t storageId, int64_t bytes);
 	LIBMTP_mtpdevice_t* m_mtpdevice;
 	uint32_t		m_busLocation;
 	uint8_t			m_devnum;
 	magic_t			m_magicCookie;
 	char			m_magicBuffer[MAGIC_BUFFER_SIZE];
+	std::vector<MtpStorageInfo>	m_storages;
+	time_t			m_storagesFetched;
+	time_t			m_storageTimeout;
+	RecursiveMutex	m_storageMutex;
+	bool			m_canGetPartialFile;
+	bool			m_canEditFile;
+	uint64_t		m_partialFileRate;
+	RecursiveMutex	m_partialFileRateMutex;
+	bool			m_disconnected;
+	void			(*m_disconnectHandler)(void* data);
+	void*			m_disconnectData;
+#ifdef HAVE_LIBMTP_READ_EVENT_ASYNC
+	static void EventReceived(int result, LIBMTP_event_t event, uint32_t param, void* device);
+	// The event being waited for, set by EventReceived.
+	bool			m_eventPending;
+	int				m_eventReceived;
+	int				m_eventResult;
+	LIBMTP_event_t	m_event;
+	uint32_t		m_eventParam;
+#endif
 };
 
 
@@ -0,0 +1,76 @@
+/*
+ * MtpDirectoryListing.cpp
+ *
+ *      Author: Jason Ferrara
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+#include "MtpDirectoryListing.h"
+#include "MtpFile.h"
+#include <string.h>
+
+MtpDirectoryFiller::~MtpDirectoryFiller()
+{
+
+}
+
+MtpDirectoryListing::MtpDirectoryListing(MtpMetadataCache& cache, const std::shared_ptr<const MtpNodeMetadata>& md) :
+	m_cache(cache), m_metadata(md)
+{
+
+}
+
+void MtpDirectoryListing::fill(MtpDirectoryFiller& filler, off_t offset)
+{
+	size_t storageCount = m_metadata->storages.size();
+	size_t count = 2 + storageCount + m_metadata->children.size();
+	struct stat info;
+	for(size_t i = offset; i < count; i++)
+	{
+		memset(&info, 0, sizeof(info));
+		const char* name;
+		if (i < 2)
+		{
+			name = (i == 0) ? "." : "..";
+			info.st_mode = S_IFDIR | 0755;
+		}
+		else if (i - 2 < storageCount)
+		{
+			name = m_metadata->storages[i - 2].description.c_str();
+			info.st_mode = S_IFDIR | 0755;
+			info.st_nlink = 2;
+		}
+		else
+		{
+			const MtpFolderContents& children = m_metadata->children;
+			size_t child = i - 2 - storageCount;
+			name = children.name(child);
+			if (children.filetype(child) == LIBMTP_FILETYPE_FOLDER)
+			{
+				// Counting subfolders for st_nlink would mean listing each one, so
+				// leave that to getattr.
+				info.st_mode = S_IFDIR | 0755;
+				info.st_nlink = 2;
+				info.st_mtime = children.modificationdate(child);
+			}
+			else
+				MtpFile::statFromInfo(m_cache, children.id(child), children.filesize(child),
+						children.modificationdate(child), info);
+		}
+		if (!filler.add(name, info, i + 1))
+			return;
+	}
+}
@@ -0,0 +1,62 @@
+/*
+ * MtpDirectoryListing.h
+ *
+ *      Author: Jason Ferrara
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+
+#ifndef MTPDIRECTORYLISTING_H_
+#define MTPDIRECTORYLISTING_H_
+
+#include "MtpMetadataCache.h"
+#include "FuseHeader.h"
+#include <memory>
+#include <string>
+
+/*
+ * Implemented by the fuse frontends to take directory entries from a listing.
+ * add returns false once the frontend's buffer is full. next is the offset to
+ * resume from after this entry.
+ */
+class MtpDirectoryFiller
+{
+public:
+	virtual ~MtpDirectoryFiller();
+
+	virtual bool add(const char* name, const struct stat& info, off_t next) = 0;
+};
+
+/*
+ * A snapshot of a directory's contents, taken when it is opened. The offset
+ * of an entry is its index in the snapshot, with "." and ".." at 0 and 1,
+ * so readdir can resume from any offset without redoing earlier entries,
+ * and offsets stay valid for as long as the directory is open.
+ */
+class MtpDirectoryListing
+{
+public:
+	MtpDirectoryListing(MtpMetadataCache& cache, const std::shared_ptr<const MtpNodeMetadata>& md);
+
+	void fill(MtpDirectoryFiller& filler, off_t offset);
+
+protected:
+	MtpMetadataCache&	m_cache;
+	std::shared_ptr<const MtpNodeMetadata>	m_metadata;
+};
+
+
+#endif /* MTPDIRECTORYLISTING_H_ */
@@ -0,0 +1,273 @@
+/*
+ * MtpDiskCache.cpp
+ *
+ *      Author: Jason Ferrara
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+#include "MtpDiskCache.h"
+#include <sys/stat.h>
+#include <algorithm>
+#include <iostream>
+#include <iterator>
+#include <vector>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Copies are moved in and out of the cache directory in pieces of this size.
+static const size_t diskCachePieceSize = 1024 * 1024;
+
+/*
+ * Copies the first size bytes of from to to. Returns false if that fails,
+ * including if from is shorter than size.
+ */
+static bool copyFileData(int from, int to, uint64_t size)
+{
+	std::vector<char> data(std::min(size, (uint64_t) diskCachePieceSize));
+	uint64_t position = 0;
+	while(position < size)
+	{
+		ssize_t got = pread(from, &data[0], std::min(size - position, (uint64_t) data.size()), position);
+		if (got == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		if (got == 0)
+			return false;
+		ssize_t wroteBytes = 0;
+		while(wroteBytes < got)
+		{
+			ssize_t result = pwrite(to, &data[wroteBytes], got - wroteBytes, position + wroteBytes);
+			if (result == -1)
+			{
+				if (errno == EINTR)
+					continue;
+				return false;
+			}
+			wroteBytes += result;
+		}
+		position += got;
+	}
+	return true;
+}
+
+/*
+ * Like mkdir -p.
+ */
+static void makeDirectories(const std::string& directory)
+{
+	for(size_t p = directory.find('/', 1); ; p = directory.find('/', p + 1))
+	{
+		mkdir(directory.substr(0, p).c_str(), 0700);
+		if (p == std::string::npos)
+			break;
+	}
+}
+
+MtpDiskCache::MtpDiskCache(const std::string& directory, uint64_t maxBytes) :
+	m_directory(directory), m_maxBytes(maxBytes), m_totalBytes(0)
+{
+	makeDirectories(m_directory);
+	DIR* dir = opendir(m_directory.c_str());
+	if (dir == 0)
+	{
+		std::cerr << "Can't use cache directory " << m_directory << ": " << strerror(errno) << std::endl;
+		return;
+	}
+	std::vector<Entry> found;
+	while(struct dirent* e = readdir(dir))
+	{
+		std::string name(e->d_name);
+		if (name.compare(0, 4, "tmp-") == 0)
+		{
+			// Left by a store that didn't finish.
+			unlink((m_directory + "/" + name).c_str());
+			continue;
+		}
+		uint32_t storageId, id;
+		Entry entry;
+		unsigned long long size;
+		long long modified;
+		char end;
+		if (sscanf(e->d_name, "%8x-%8x-%8x-%llu-%lld%c", &storageId, &id, &entry.nameHash,
+				&size, &modified, &end) != 5)
+			continue;
+		struct stat info;
+		if (stat((m_directory + "/" + name).c_str(), &info) || !S_ISREG(info.st_mode))
+			continue;
+		entry.key = makeKey(storageId, id);
+		entry.size = size;
+		entry.modified = modified;
+		entry.used = info.st_mtime;
+		found.push_back(entry);
+	}
+	closedir(dir);
+
+	std::sort(found.begin(), found.end(), usedBefore);
+	for(std::vector<Entry>::iterator i = found.begin(); i != found.end(); i++)
+	{
+		// Of two versions of the same file, the one used last wins.
+		std::unordered_map<std::string, entry_list_type::iterator>::iterator old = m_lookup.find(i->key);
+		if (old != m_lookup.end())
+			removeEntry(old->second);
+		m_entries.push_back(*i);
+		m_lookup[i->key] = std::prev(m_entries.end());
+		m_totalBytes += i->size;
+	}
+	trim();
+}
+
+bool MtpDiskCache::fill(uint32_t storageId, uint32_t id, const std::string& name, uint64_t size,
+		time_t modified, int fd)
+{
+	int cached;
+	{
+		LockMutex lock(m_mutex);
+
+		std::unordered_map<std::string, entry_list_type::iterator>::iterator i = m_lookup.find(makeKey(storageId, id));
+		if (i == m_lookup.end())
+			return false;
+		entry_list_type::iterator entry = i->second;
+		if ((entry->nameHash != hashName(name)) || (entry->size != size) || (entry->modified != modified))
+		{
+			// The file has changed since, so this copy is no good to anyone.
+			removeEntry(entry);
+			return false;
+		}
+		cached = open(path(*entry).c_str(), O_RDONLY);
+		if (cached == -1)
+		{
+			removeEntry(entry);
+			return false;
+		}
+		futimens(cached, 0);
+		entry->used = time(0);
+		m_entries.splice(m_entries.end(), m_entries, entry);
+	}
+	// Done unlocked. If the copy is dropped meanwhile, the open descriptor still reads it.
+	bool result = copyFileData(cached, fd, size);
+	close(cached);
+	return result;
+}
+
+void MtpDiskCache::store(uint32_t storageId, uint32_t id, const std::string& name, uint64_t size,
+		time_t modified, int fd)
+{
+	if (size > m_maxBytes)
+		return;
+	std::string tempPath = m_directory + "/tmp-XXXXXX";
+	std::vector<char> tempName(tempPath.begin(), tempPath.end());
+	tempName.push_back(0);
+	int temp = mkstemp(&tempName[0]);
+	if (temp == -1)
+	{
+		std::cerr << "Can't keep a copy of " << name << " in " << m_directory << ": " << strerror(errno) << std::endl;
+		return;
+	}
+	bool copied = copyFileData(fd, temp, size);
+	int err = errno;
+	close(temp);
+	if (!copied)
+	{
+		unlink(&tempName[0]);
+		std::cerr << "Can't keep a copy of " << name << " in " << m_directory << ": " << strerror(err) << std::endl;
+		return;
+	}
+
+	LockMutex lock(m_mutex);
+
+	Entry entry;
+	entry.key = makeKey(storageId, id);
+	entry.nameHash = hashName(name);
+	entry.size = size;
+	entry.modified = modified;
+	entry.used = time(0);
+	std::unordered_map<std::string, entry_list_type::iterator>::iterator old = m_lookup.find(entry.key);
+	if (old != m_lookup.end())
+		removeEntry(old->second);
+	if (rename(&tempName[0], path(entry).c_str()))
+	{
+		unlink(&tempName[0]);
+		return;
+	}
+	m_entries.push_back(entry);
+	m_lookup[entry.key] = std::prev(m_entries.end());
+	m_totalBytes += size;
+	trim();
+}
+
+bool MtpDiskCache::usedBefore(const Entry& a, const Entry& b)
+{
+	return a.used < b.used;
+}
+
+std::string MtpDiskCache::makeKey(uint32_t storageId, uint32_t id)
+{
+	char key[20];
+	snprintf(key, sizeof(key), "%08x-%08x", storageId, id);
+	return key;
+}
+
+/*
+ * FNV-1a, which unlike std::hash gives the same result from one build to
+ * the next.
+ */
+uint32_t MtpDiskCache::hashName(const std::string& name)
+{
+	uint32_t hash = 2166136261u;
+	for(std::string::const_iterator i = name.begin(); i != name.end(); i++)
+	{
+		hash ^= (unsigned char) *i;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+std::string MtpDiskCache::path(const Entry& entry)
+{
+	char name[80];
+	snprintf(name, sizeof(name), "%s-%08x-%llu-%lld", entry.key.c_str(), entry.nameHash,
+			(unsigned long long) entry.size, (long long) entry.modified);
+	return m_directory + "/" + name;
+}
+
+/*
+ * Called with m_mutex held.
+ */
+void MtpDiskCache::removeEntry(entry_list_type::iterator entry)
+{
+	unlink(path(*entry).c_str());
+	m_totalBytes -= entry->size;
+	m_lookup.erase(entry->key);
+	m_entries.erase(entry);
+}
+
+/*
+ * Drops the least recently used copies until they fit within m_maxBytes.
+ * Called with m_mutex held.
+ */
+void MtpDiskCache::trim()
+{
+	while((m_totalBytes > m_maxBytes) && !m_entries.empty())
+		removeEntry(m_entries.begin());
+}
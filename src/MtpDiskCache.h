@@ -0,0 +1,95 @@
+/*
+ * MtpDiskCache.h
+ *
+ *      Author: Jason Ferrara
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+
+#ifndef MTPDISKCACHE_H_
+#define MTPDISKCACHE_H_
+
+#include "Mutex.h"
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Copies of files from the device kept in a directory on local disk, so they
+ * survive unmounting and don't have to be copied from the device again the
+ * next time it is mounted. A copy is found by the file's storage and object
+ * id, and is only used if the file still has the name, size and modification
+ * date it had when it was kept. Copies that haven't been used for longest are
+ * removed to keep the directory within its size budget. The last use of a
+ * copy is its file's modification time, so that order carries over from one
+ * mount to the next.
+ *
+ * Nothing here is essential. If the directory can't be used, files are just
+ * copied from the device as they would be without it.
+ */
+class MtpDiskCache
+{
+public:
+	MtpDiskCache(const std::string& directory, uint64_t maxBytes);
+
+	/*
+	 * Copies the kept copy of a file into fd. Returns false if there isn't
+	 * one, or it is for a different version of the file.
+	 */
+	bool fill(uint32_t storageId, uint32_t id, const std::string& name, uint64_t size,
+			time_t modified, int fd);
+
+	/*
+	 * Keeps a copy of the first size bytes of fd, replacing any copy of an
+	 * older version of the file.
+	 */
+	void store(uint32_t storageId, uint32_t id, const std::string& name, uint64_t size,
+			time_t modified, int fd);
+
+private:
+	MtpDiskCache(const MtpDiskCache&);
+	MtpDiskCache& operator=(const MtpDiskCache&);
+
+	struct Entry
+	{
+		std::string	key;
+		uint32_t	nameHash;
+		uint64_t	size;
+		time_t		modified;
+		time_t		used;
+	};
+	typedef std::list<Entry> entry_list_type;
+
+	static bool usedBefore(const Entry& a, const Entry& b);
+	static std::string makeKey(uint32_t storageId, uint32_t id);
+	static uint32_t hashName(const std::string& name);
+	std::string path(const Entry& entry);
+	void removeEntry(entry_list_type::iterator entry);
+	void trim();
+
+	std::string			m_directory;
+	uint64_t			m_maxBytes;
+	uint64_t			m_totalBytes;
+	// Least recently used first.
+	entry_list_type		m_entries;
+	std::unordered_map<std::string, entry_list_type::iterator>	m_lookup;
+	RecursiveMutex		m_mutex;
+};
+
+
+#endif /* MTPDISKCACHE_H_ */
@@ -0,0 +1,116 @@
+/*
+ * MtpEventListener.cpp
+ *
+ *      Author: Jason Ferrara
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+#include "MtpEventListener.h"
+#include "MtpMetadataCache.h"
+#include "MtpRoot.h"
+#include "mtpFilesystemErrors.h"
+#include <unistd.h>
+
+// Waiting for events is given up on after this many failures in a row, with
+// a second in between, as on devices that can't report them.
+static const int maxEventFailures = 5;
+// How long a wait for an event can hold up stopping the listener.
+static const int eventWaitMs = 500;
+
+MtpEventListener::MtpEventListener(MtpDevice& device, MtpMetadataCache& cache) :
+	m_device(device), m_cache(cache)
+{
+}
+
+MtpEventListener::~MtpEventListener()
+{
+	stop();
+}
+
+void MtpEventListener::start()
+{
+#ifdef HAVE_LIBMTP_READ_EVENT_ASYNC
+	// Without the thread the cache just relies on its timeout.
+	BackgroundQueue::start();
+#endif
+}
+
+void MtpEventListener::run()
+{
+#ifdef HAVE_LIBMTP_READ_EVENT_ASYNC
+	int failures = 0;
+	while(!stopping() && (failures < maxEventFailures))
+	{
+		LIBMTP_event_t event;
+		uint32_t param;
+		if (m_device.ReadEvent(event, param, eventWaitMs))
+		{
+			failures = 0;
+			try
+			{
+				handleEvent(event, param);
+			}
+			catch(MtpDeviceDisconnected&)
+			{
+				// The mount is about to be torn down, which stops us anyway.
+				break;
+			}
+			continue;
+		}
+		failures++;
+		sleep(1);
+	}
+#endif
+}
+
+void MtpEventListener::handleEvent(LIBMTP_event_t event, uint32_t param)
+{
+	try
+	{
+		switch(event)
+		{
+		case LIBMTP_EVENT_OBJECT_ADDED:
+		{
+			// Only the listing of the folder it was added to changes, and all
+			// it needs is what was added. Often that's already in it, as we
+			// added it.
+			MtpFileInfo info = m_device.GetFileInfo(param);
+			m_cache.childAdded(info.parentId ? info.parentId : info.storageId, info);
+			break;
+		}
+		case LIBMTP_EVENT_OBJECT_REMOVED:
+			m_cache.objectRemoved(param);
+			break;
+		case LIBMTP_EVENT_STORE_ADDED:
+		case LIBMTP_EVENT_STORE_REMOVED:
+			m_device.ForgetStorageDevices();
+			m_cache.clearItem(MtpRoot(m_device, m_cache).Id());
+			m_cache.clearItem(param);
+			break;
+		default:
+			break;
+		}
+	}
+	catch(MtpDeviceDisconnected&)
+	{
+		throw;
+	}
+	catch(std::exception&)
+	{
+		// Most likely an object that was added and removed again before
+		// we got to it, which the removal event takes care of.
+	}
+}
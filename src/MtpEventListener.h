@@ -0,0 +1,65 @@
+/*
+ * MtpEventListener.h
+ *
+ *      Author: Jason Ferrara
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+
+
+#ifndef MTPEVENTLISTENER_H_
+#define MTPEVENTLISTENER_H_
+
+#include "BackgroundQueue.h"
+#include "MtpDevice.h"
+
+class MtpMetadataCache;
+
+/*
+ * Waits for the device to report objects being added or removed, and
+ * storages coming and going, from a background thread, and clears just
+ * what that changes from the cache. Changes made on the device then show
+ * up straight away, instead of once the cache times out, and the cache
+ * timeout can be made long on devices that report them. libmtp doesn't
+ * pass on other events, such as an object being renamed or rewritten, so
+ * those are still only noticed when the cache times out.
+ *
+ * Events are waited for a short while at a time, so destroying the listener
+ * stops the thread and waits for it, before the device and cache go away.
+ * libmtp only has a wait with a timeout from 1.1.16. With older versions
+ * there is no listener, and the cache relies on its timeout.
+ */
+class MtpEventListener : public BackgroundQueue
+{
+public:
+	MtpEventListener(MtpDevice& device, MtpMetadataCache& cache);
+	~MtpEventListener();
+
+	/*
+	 * Start listening, if that hasn't started already.
+	 */
+	void start();
+
+private:
+	void run();
+	void handleEvent(LIBMTP_event_t event, uint32_t param);
+
+	MtpDevice&			m_device;
+	MtpMetadataCache&	m_cache;
+};
+
+
+#endif /* MTPEVENTLISTENER_H_ */
@@ -21,6 +21,11 @@
 #include "MtpFile.h"
 #include "mtpFilesystemErrors.h"
 #include <errno.h>
+#include <sstream>
+#include <time.h>
+
+// Setting this to the final size of a new file lets it be streamed to the device as it is written.
+static const char sizeHintXattr[] = "user.jmtpfs.size";
 
 MtpFile::MtpFile(MtpDevice& device,  MtpMetadataCache& cache, uint32_t id) : MtpNode(device, cache, id), m_opened(false)
 {
@@ -35,64 +40,98 @@ std::unique_ptr<MtpNode> MtpFile::getNode(const FilesystemPath& path)
 	throw FileNotFound(path.str());
 }
 
+std::unique_ptr<MtpNode> MtpFile::Clone()
+{
+	return std::unique_ptr<MtpNode>(new MtpFile(m_device, m_cache, m_id));
+}
+
 MtpNodeMetadata MtpFile::getMetadata()
 {
 	MtpNodeMetadata md;
+	// Until the local copy is sent in place of a remote file that was
+	// deleted, it is still the file that was.
+	std::shared_ptr<MtpLocalFileCopy> localFile = m_cache.getOpenedFile(m_id);
+	if (localFile && localFile->remoteDeleted(md.self))
+		return md;
 	md.self = m_device.GetFileInfo(m_id);
 	return md;
 }
 
 void MtpFile::getattr(struct stat& info)
 {
-	MtpNodeMetadata md = m_cache.getItem(m_id, *this);
+	// The remote file may be gone for a while as changes are written back,
+	// and the local copy knows all there is to know in the meantime.
+	std::shared_ptr<MtpLocalFileCopy> localFile = m_cache.getOpenedFile(m_id);
+	if (localFile && localFile->isDirty())
+	{
+		info.st_mode = S_IFREG | 0644;
+		info.st_nlink = 1;
+		info.st_mtime = localFile->modificationTime();
+		info.st_size = localFile->getSize();
+		return;
+	}
+
+	std::shared_ptr<const MtpNodeMetadata> md = m_cache.getItem(m_id, *this);
+
+	statFromInfo(m_cache, md->self, info);
+}
+
+void MtpFile::statFromInfo(MtpMetadataCache& cache, const MtpFileInfo& file, struct stat& info)
+{
+	statFromInfo(cache, file.id, file.filesize, file.modificationdate, info);
+}
 
+void MtpFile::statFromInfo(MtpMetadataCache& cache, uint32_t id, uint64_t filesize,
+		time_t modificationdate, struct stat& info)
+{
 	info.st_mode = S_IFREG | 0644;
 	info.st_nlink = 1;
-	info.st_mtime = md.self.modificationdate;
-	MtpLocalFileCopy* localFile = m_cache.getOpenedFile(m_id);
-	if (localFile)
+	info.st_mtime = modificationdate;
+	// Only look at the local copy if it has changed. It may still be in the
+	// middle of being copied from the device, in which case its size is wrong.
+	std::shared_ptr<MtpLocalFileCopy> localFile = cache.getOpenedFile(id);
+	if (localFile && localFile->isDirty())
 	{
 		info.st_size = localFile->getSize();
 	}
 	else
-		info.st_size = md.self.filesize;
+		info.st_size = filesize;
 }
 
 
-void MtpFile::Open()
+std::shared_ptr<MtpLocalFileCopy> MtpFile::Open()
 {
-	m_cache.openFile(m_device, m_id);
+	return m_cache.openFileHandle(m_device, m_id);
 }
 
 int MtpFile::Read(char *buf, size_t size, off_t offset)
 {
-	MtpLocalFileCopy* localFile = m_cache.openFile(m_device, m_id);
+	std::shared_ptr<MtpLocalFileCopy> localFile = m_cache.openFile(m_device, m_id);
 
-	localFile->seek(offset);
-	return localFile->read(buf, size);
+	return localFile->read(buf, size, offset);
 
 }
 
 int MtpFile::Write(const char* buf, size_t size, off_t offset)
 {
 
-	MtpLocalFileCopy* localFile = m_cache.openFile(m_device, m_id);
-	localFile->seek(offset);
+	std::shared_ptr<MtpLocalFileCopy> localFile = m_cache.openFile(m_device, m_id);
 //	m_cache.clearItem(m_id);
-	return localFile->write(buf, size);
+	return localFile->write(buf, size, offset);
 }
 
 void MtpFile::Fsync()
 {
-	uint32_t parentId = GetParentNodeId();
-	m_cache.clearItem(m_id);
-	m_id = m_cache.closeFile(m_id);
-	m_cache.clearItem(parentId);
+	CurrentId();
+	m_id = m_cache.syncFile(m_id, GetParentNodeId());
 }
 
 void MtpFile::Close()
 {
-	Fsync();
+	// Nothing on the device changes until the last handle is released and the
+	// write back queue gets to the file, and it clears the cached metadata when it does.
+	CurrentId();
+	m_id = m_cache.closeFile(m_id, GetParentNodeId());
 }
 
 void MtpFile::Truncate(off_t length)
@@ -103,21 +142,62 @@ void MtpFile::Truncate(off_t length)
 	if (info.st_size == length)
 		return;
 	uint32_t parentId = GetParentNodeId();
-	MtpLocalFileCopy* localFile = m_cache.openFile(m_device, m_id);
+	std::shared_ptr<MtpLocalFileCopy> localFile = m_cache.openFile(m_device, m_id);
 	localFile->truncate(length);
-	m_id = m_cache.closeFile(m_id);
-	m_cache.clearItem(m_id);
-	m_cache.clearItem(parentId);
+	m_id = m_cache.closeFile(m_id, parentId);
 }
 
+void MtpFile::Allocate(off_t length)
+{
+	struct stat info;
+	getattr(info);
+	if (info.st_size >= length)
+		return;
+	uint32_t parentId = GetParentNodeId();
+	std::shared_ptr<MtpLocalFileCopy> localFile = m_cache.openFile(m_device, m_id);
+	localFile->allocate(length);
+	// Given the size of a new file, as with setxattr before it is opened, the
+	// copy waits for the writes to stream to the device. Writing it back now
+	// would send it as zeros.
+	if (!localFile->streaming())
+		m_id = m_cache.closeFile(m_id, parentId);
+}
 
+void MtpFile::setxattr(const std::string& name, const std::string& value)
+{
+	if (name != sizeHintXattr)
+		throw XattrNotSupported();
+	std::istringstream valueStr(value);
+	off_t length = -1;
+	valueStr >> length;
+	if (!valueStr || (length < 0))
+		throw InvalidArgument();
+	Allocate(length);
+}
 
 void MtpFile::Remove()
 {
+	CurrentId();
 	uint32_t parentId = GetParentNodeId();
-	m_device.DeleteObject(m_id);
-	m_cache.clearItem(parentId);
+	// Don't let a pending write back bring the file back.
+	std::shared_ptr<MtpLocalFileCopy> localFile = m_cache.getOpenedFile(m_id);
+	if (localFile)
+	{
+		uint32_t id = localFile->discard();
+		if (id == 0)
+		{
+			// There's nothing of it on the device, since it was being streamed
+			// there or a failed write back deleted it.
+			m_cache.clearItem(m_id);
+			m_cache.childRemoved(parentId, m_id);
+			return;
+		}
+		m_id = id;
+	}
+	std::shared_ptr<const MtpNodeMetadata> md = m_cache.getItem(m_id, *this);
+	m_device.DeleteObject(md->self);
 	m_cache.clearItem(m_id);
+	m_cache.childRemoved(parentId, m_id);
 
 }
 
@@ -126,28 +206,39 @@ void MtpFile::Rename(MtpNode& newParent, const std::string& newName)
 	if (newName.length() > MAX_MTP_NAME_LENGTH)
 		throw MtpNameTooLong();
 	Fsync();
-	MtpNodeMetadata md = m_cache.getItem(m_id, *this);
+	std::shared_ptr<const MtpNodeMetadata> md = m_cache.getItem(m_id, *this);
 	uint32_t parentId = GetParentNodeId();
 	/* This true in place rename seems to confuse apps on the android device. The Gallery app
 	 * for example, won't notice image files that have been renamed. So to prevent this strangeness
 	 * real rename is disabled, and instead we make a copy of the file and delete the original
-	if ((newParent.FolderId() == md.self.parentId) && (newParent.StorageId() == md.self.storageId))
+	if ((newParent.FolderId() == md->self.parentId) && (newParent.StorageId() == md->self.storageId))
 	{
 		// we can do a real rename
-		m_device.RenameFile(md.self.id, newName);
+		m_device.RenameFile(md->self.id, newName);
 	}
 	else
 	*/
 	{
 		//we have to do a copy and delete
-		MtpLocalFileCopy* localFile = m_cache.openFile(m_device, md.self.id);
+		std::shared_ptr<MtpLocalFileCopy> localFile = m_cache.openFile(m_device, md->self.id);
 		NewLIBMTPFile newFile(newName, newParent.FolderId(), newParent.StorageId(), localFile->getSize());
 		localFile->CopyTo(m_device, newFile);
-		m_cache.clearItem(md.self.id);
+		m_cache.clearItem(md->self.id);
 		m_cache.clearItem(((LIBMTP_file_t*)newFile)->item_id);
-		m_device.DeleteObject(md.self.id);
+		m_device.DeleteObject(md->self);
 		m_id = ((LIBMTP_file_t*)newFile)->item_id;
-
+		// Keep any open handles pointed at the file's new identity.
+		m_cache.renameFile(md->self.id, m_id);
+		m_cache.closeFile(m_id, newParent.Id());
+
+		MtpFileInfo added(*(LIBMTP_file_t*)newFile);
+		added.modificationdate = time(0);
+		if (newParent.Id() == parentId)
+			m_cache.childReplaced(parentId, md->self.id, added);
+		else
+		{
+			m_cache.childRemoved(parentId, md->self.id);
+			m_cache.childAdded(newParent.Id(), added);
+		}
 	}
-	m_cache.clearItem(parentId);
 }
@@ -34,7 +34,7 @@ public:
 	std::unique_ptr<MtpNode> getNode(const FilesystemPath& path);
 	void getattr(struct stat& info);
 
-	void Open();
+	std::shared_ptr<MtpLocalFileCopy> Open();
 	void Close();
 	int Read(char *buf, size_t size, off_t offset);
 	int Write(const char* buf, size_t size, off_t offset);
@@ -42,10 +42,21 @@ public:
 
 	void Fsync();
 	void Truncate(off_t length);
+	void Allocate(off_t length);
+	void setxattr(const std::string& name, const std::string& value);
 	void Rename(MtpNode& newParent, const std::string& newName);
 
 	MtpNodeMetadata getMetadata();
 
+	std::unique_ptr<MtpNode> Clone();
+
+	/*
+	 * Fills in info for a file, given its entry from a folder listing.
+	 */
+	static void statFromInfo(MtpMetadataCache& cache, const MtpFileInfo& file, struct stat& info);
+	static void statFromInfo(MtpMetadataCache& cache, uint32_t id, uint64_t filesize,
+			time_t modificationdate, struct stat& info);
+
 protected:
 	MtpFileInfo	m_info;
 	bool		m_opened;
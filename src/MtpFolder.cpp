@@ -23,6 +23,7 @@
 #include "MtpFile.h"
 #include "mtpFilesystemErrors.h"
 #include "TemporaryFile.h"
+#include <time.h>
 
 MtpFolder::MtpFolder(MtpDevice& device, MtpMetadataCache& cache, uint32_t storageId,
 		uint32_t folderId) : MtpNode(device, cache, folderId ? folderId : storageId),
@@ -41,74 +42,81 @@ MtpNodeMetadata MtpFolder::getMetadata()
 		md.self.id = m_storageId;
 		md.self.parentId = 0;
 		md.self.storageId = m_storageId;
+		md.self.filetype = LIBMTP_FILETYPE_FOLDER;
+		md.self.filesize = 0;
+		md.self.modificationdate = 0;
 	}
 	else
 	{
 		md.self = m_device.GetFileInfo(m_id);
 	}
-	md.children = m_device.GetFolderContents(m_storageId, folderId);
+	m_device.GetFolderContents(m_storageId, folderId, md.children);
 
 	return md;
 }
 
 void MtpFolder::getattr(struct stat& info)
 {
-	MtpNodeMetadata md = m_cache.getItem(m_id, *this);
+	std::shared_ptr<const MtpNodeMetadata> md = m_cache.getItem(m_id, *this);
 	info.st_mode = S_IFDIR | 0755;
-	info.st_nlink = 2;
-	info.st_mtime = md.self.modificationdate;
-	for(std::vector<MtpFileInfo>::iterator i = md.children.begin(); i!=md.children.end(); i++)
-	{
-		if (i->filetype == LIBMTP_FILETYPE_FOLDER)
-			info.st_nlink++;
-	}
+	info.st_nlink = 2 + md->children.count(LIBMTP_FILETYPE_FOLDER);
+	info.st_mtime = md->self.modificationdate;
 }
 
 std::unique_ptr<MtpNode> MtpFolder::getNode(const FilesystemPath& path)
 {
-	MtpNodeMetadata md = m_cache.getItem(m_id, *this);
+	std::unique_ptr<MtpNode> n = getChild(path.Head());
+	FilesystemPath childPath = path.Body();
+	if (childPath.Empty())
+		return n;
+	else
+		return n->getNode(childPath);
+}
 
-	std::string filename = path.Head();
-	for(std::vector<MtpFileInfo>::iterator i = md.children.begin(); i!=md.children.end(); i++)
-	{
-		if (i->name == filename)
-		{
-			if (i->filetype != LIBMTP_FILETYPE_FOLDER)
-				return std::unique_ptr<MtpNode>(new MtpFile(m_device, m_cache, i->id));
-			else
-			{
-				std::unique_ptr<MtpNode> n(new MtpFolder(m_device, m_cache, m_storageId, i->id));
-				FilesystemPath childPath = path.Body();
-				if (childPath.Empty())
-					return n;
-				else
-					return n->getNode(childPath);
-			}
-		}
-	}
-	throw FileNotFound(path.str());
+std::unique_ptr<MtpNode> MtpFolder::getChild(const std::string& name)
+{
+	std::shared_ptr<const MtpNodeMetadata> md = m_cache.getItem(m_id, *this);
+
+	size_t child = md->children.find(name);
+	if (child == MtpFolderContents::npos)
+		throw FileNotFound(name);
+	if (md->children.filetype(child) != LIBMTP_FILETYPE_FOLDER)
+		return std::unique_ptr<MtpNode>(new MtpFile(m_device, m_cache, md->children.id(child)));
+	else
+		return std::unique_ptr<MtpNode>(new MtpFolder(m_device, m_cache, m_storageId, md->children.id(child)));
+}
+
+std::unique_ptr<MtpNode> MtpFolder::Clone()
+{
+	return std::unique_ptr<MtpNode>(new MtpFolder(m_device, m_cache, m_storageId, m_folderId));
 }
 
 std::vector<std::string> MtpFolder::readDirectory()
 {
-	MtpNodeMetadata md = m_cache.getItem(m_id, *this);
+	std::shared_ptr<const MtpNodeMetadata> md = m_cache.getItem(m_id, *this);
 
 	std::vector<std::string> result;
 
-	for(std::vector<MtpFileInfo>::iterator i = md.children.begin(); i != md.children.end(); i++)
-		result.push_back(i->name);
+	result.reserve(md->children.size());
+	for(size_t i = 0; i < md->children.size(); i++)
+		result.push_back(md->children.name(i));
 	return result;
 }
 
 
+std::unique_ptr<MtpDirectoryListing> MtpFolder::openDirectory()
+{
+	return std::unique_ptr<MtpDirectoryListing>(new MtpDirectoryListing(m_cache, m_cache.getItem(m_id, *this)));
+}
+
 void MtpFolder::Remove()
 {
 	if (readDirectory().size()>0)
 		throw MtpDirectoryNotEmpty();
 	uint32_t parentId = GetParentNodeId();
-	m_device.DeleteObject(m_id);
-	m_cache.clearItem(parentId);
+	m_device.DeleteObject(m_cache.getItem(m_id, *this)->self);
 	m_cache.clearItem(m_id);
+	m_cache.childRemoved(parentId, m_id);
 
 }
 
@@ -116,9 +124,14 @@ void MtpFolder::mkdir(const std::string& name)
 {
 	if (name.length() > MAX_MTP_NAME_LENGTH)
 		throw MtpNameTooLong();
-
-	m_device.CreateFolder(name, m_folderId, m_storageId);
-	m_cache.clearItem(m_id);
+	// The device would happily make a second one with the same name.
+	if (m_cache.getItem(m_id, *this)->children.find(name) != MtpFolderContents::npos)
+		throw FileExists();
+
+	uint32_t id = m_device.CreateFolder(name, m_folderId, m_storageId);
+	MtpFileInfo added(id, m_folderId, m_storageId, name, LIBMTP_FILETYPE_FOLDER, 0);
+	added.modificationdate = time(0);
+	m_cache.childAdded(m_id, added);
 }
 
 
@@ -127,12 +140,17 @@ void MtpFolder::CreateFile(const std::string& name)
 {
 	if (name.length() > MAX_MTP_NAME_LENGTH)
 		throw MtpNameTooLong();
+	if (m_cache.getItem(m_id, *this)->children.find(name) != MtpFolderContents::npos)
+		throw FileExists();
 
 	NewLIBMTPFile newFile(name, m_folderId, m_storageId);
 	TemporaryFile empty;
 	m_device.SendFile(newFile, empty.FileNo());
 	m_cache.clearItem(((LIBMTP_file_t*)newFile)->item_id);
-	m_cache.clearItem(m_id);
+	MtpFileInfo added(*(LIBMTP_file_t*)newFile);
+	added.modificationdate = time(0);
+	m_cache.childAdded(m_id, added);
+	m_cache.newFile(m_device, ((LIBMTP_file_t*)newFile)->item_id);
 }
 
 uint32_t MtpFolder::FolderId()
@@ -145,34 +163,44 @@ uint32_t MtpFolder::StorageId()
 	return m_storageId;
 }
 
+MtpStorageInfo MtpFolder::GetStorageInfo()
+{
+	// No need to look ourselves up, and for the storage itself that would mean listing its top folder.
+	return m_device.GetStorageInfo(m_storageId);
+}
+
 void MtpFolder::Rename(MtpNode& newParent, const std::string& newName)
 {
 	if (newName.length() > MAX_MTP_NAME_LENGTH)
 		throw MtpNameTooLong();
 
-	MtpNodeMetadata md = m_cache.getItem(m_id, *this);
+	std::shared_ptr<const MtpNodeMetadata> md = m_cache.getItem(m_id, *this);
 
 	uint32_t parentId = GetParentNodeId();
-	if ((newParent.FolderId() == md.self.parentId) && (newParent.StorageId() == m_storageId))
+	if ((newParent.FolderId() == md->self.parentId) && (newParent.StorageId() == m_storageId))
 	{
 		// we can do a real rename
 		m_device.RenameFile(m_id, newName);
+		MtpFileInfo renamed(md->self);
+		renamed.name = newName;
+		m_cache.childReplaced(parentId, m_id, renamed);
+		// Its own listing has the old name for itself.
+		m_cache.clearItem(m_id);
 	}
 	else
 	{
 		// we have to do a copy and delete
 		newParent.mkdir(newName);
-		std::unique_ptr<MtpNode> destDir(newParent.getNode(FilesystemPath(newName.c_str())));
+		std::unique_ptr<MtpNode> destDir(newParent.getChild(newName));
 		std::vector<std::string> contents = readDirectory();
 		for(std::vector<std::string>::iterator i = contents.begin(); i != contents.end(); i++)
 		{
-			std::unique_ptr<MtpNode> child(getNode(FilesystemPath(i->c_str())));
+			std::unique_ptr<MtpNode> child(getChild(*i));
 			child->Rename(*destDir, *i);
 		}
+		// Which puts the new folder and its contents in, and takes this out of,
+		// the cached listings.
 		Remove();
 	}
-	m_cache.clearItem(newParent.Id());
-	m_cache.clearItem(parentId);
-
 }
 
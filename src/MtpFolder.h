@@ -30,9 +30,11 @@ public:
 	MtpFolder(MtpDevice& device, MtpMetadataCache& cache, uint32_t storageId, uint32_t folderId);
 
 	std::unique_ptr<MtpNode> getNode(const FilesystemPath& path);
+	std::unique_ptr<MtpNode> getChild(const std::string& name);
 	void getattr(struct stat& info);
 
 	std::vector<std::string> readDirectory();
+	std::unique_ptr<MtpDirectoryListing> openDirectory();
 	void Remove();
 
 	void mkdir(const std::string& name);
@@ -40,11 +42,14 @@ public:
 
 	uint32_t FolderId();
 	uint32_t StorageId();
+	MtpStorageInfo GetStorageInfo();
 
 	void Rename(MtpNode& newParent, const std::string& newName);
 
 	MtpNodeMetadata getMetadata();
 
+	std::unique_ptr<MtpNode> Clone();
+
 protected:
 
 
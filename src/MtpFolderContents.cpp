@@ -0,0 +1,253 @@
+/*
+ * MtpNoteMetadata.h
+ *
+ *      Author: Jason Ferrara
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+#include "MtpFolderContents.h"
+#include <algorithm>
+#include <string.h>
+
+class MtpFolderContents::NameLess
+{
+public:
+	NameLess(const MtpFolderContents& contents) : m_contents(contents) {}
+
+	bool operator()(uint32_t a, uint32_t b) const
+	{
+		return strcmp(m_contents.name(a), m_contents.name(b)) < 0;
+	}
+
+	bool operator()(uint32_t a, const char* name) const
+	{
+		return strcmp(m_contents.name(a), name) < 0;
+	}
+
+private:
+	const MtpFolderContents&	m_contents;
+};
+
+class MtpFolderContents::IdLess
+{
+public:
+	// An id looked for, rather than a position.
+	struct Id
+	{
+		explicit Id(uint32_t i) : id(i) {}
+		uint32_t	id;
+	};
+
+	IdLess(const MtpFolderContents& contents) : m_contents(contents) {}
+
+	bool operator()(uint32_t a, uint32_t b) const
+	{
+		return m_contents.m_ids[a] < m_contents.m_ids[b];
+	}
+
+	bool operator()(uint32_t a, const Id& id) const
+	{
+		return m_contents.m_ids[a] < id.id;
+	}
+
+private:
+	const MtpFolderContents&	m_contents;
+};
+
+MtpFolderContents::MtpFolderContents() : m_parentId(0), m_storageId(0), m_indexed(false)
+{
+}
+
+void MtpFolderContents::add(const LIBMTP_file_t& file)
+{
+	add(file.item_id, file.parent_id, file.storage_id, file.filename ? file.filename : "",
+			file.filetype, file.filesize, file.modificationdate);
+}
+
+void MtpFolderContents::add(const MtpFileInfo& info)
+{
+	add(info.id, info.parentId, info.storageId, info.name.c_str(), info.filetype, info.filesize,
+			info.modificationdate);
+}
+
+void MtpFolderContents::add(uint32_t id, uint32_t parentId, uint32_t storageId, const char* name,
+		LIBMTP_filetype_t filetype, uint64_t filesize, time_t modificationdate)
+{
+	m_parentId = parentId;
+	m_storageId = storageId;
+	m_ids.push_back(id);
+	m_filetypes.push_back(filetype);
+	m_filesizes.push_back(filesize);
+	m_modificationdates.push_back(modificationdate);
+	m_nameOffsets.push_back(m_names.size());
+	m_names.append(name);
+	m_names.push_back(0);
+	if (m_indexed)
+	{
+		// After any others with the same name, as it was added last.
+		uint32_t added = m_ids.size() - 1;
+		m_byName.insert(std::upper_bound(m_byName.begin(), m_byName.end(), added, NameLess(*this)),
+				added);
+		m_byId.insert(std::upper_bound(m_byId.begin(), m_byId.end(), added, IdLess(*this)), added);
+	}
+}
+
+void MtpFolderContents::remove(size_t i)
+{
+	if (m_indexed)
+	{
+		// Found through the indexes themselves, while i is still in them.
+		std::vector<uint32_t>::iterator byName = std::lower_bound(m_byName.begin(), m_byName.end(),
+				name(i), NameLess(*this));
+		while (*byName != i)
+			byName++;
+		m_byName.erase(byName);
+		std::vector<uint32_t>::iterator byId = std::lower_bound(m_byId.begin(), m_byId.end(),
+				IdLess::Id(m_ids[i]), IdLess(*this));
+		while (*byId != i)
+			byId++;
+		m_byId.erase(byId);
+		for(size_t j = 0; j < m_byName.size(); j++)
+		{
+			if (m_byName[j] > i)
+				m_byName[j]--;
+			if (m_byId[j] > i)
+				m_byId[j]--;
+		}
+	}
+	size_t nameLength = strlen(name(i)) + 1;
+	m_names.erase(m_nameOffsets[i], nameLength);
+	for(size_t j = i + 1; j < m_nameOffsets.size(); j++)
+		m_nameOffsets[j] -= nameLength;
+	m_ids.erase(m_ids.begin() + i);
+	m_filetypes.erase(m_filetypes.begin() + i);
+	m_filesizes.erase(m_filesizes.begin() + i);
+	m_modificationdates.erase(m_modificationdates.begin() + i);
+	m_nameOffsets.erase(m_nameOffsets.begin() + i);
+}
+
+void MtpFolderContents::finish()
+{
+	m_ids.shrink_to_fit();
+	m_filetypes.shrink_to_fit();
+	m_filesizes.shrink_to_fit();
+	m_modificationdates.shrink_to_fit();
+	m_nameOffsets.shrink_to_fit();
+	m_names.shrink_to_fit();
+	if (!m_indexed)
+	{
+		m_byName.resize(m_ids.size());
+		for(uint32_t i = 0; i < m_byName.size(); i++)
+			m_byName[i] = i;
+		// Stable, so of objects with the same name the first added comes first.
+		std::stable_sort(m_byName.begin(), m_byName.end(), NameLess(*this));
+		m_byId = m_byName;
+		std::sort(m_byId.begin(), m_byId.end(), IdLess(*this));
+		m_indexed = true;
+	}
+	m_byName.shrink_to_fit();
+	m_byId.shrink_to_fit();
+}
+
+size_t MtpFolderContents::size() const
+{
+	return m_ids.size();
+}
+
+bool MtpFolderContents::empty() const
+{
+	return m_ids.empty();
+}
+
+size_t MtpFolderContents::bytes() const
+{
+	return m_ids.capacity() * sizeof(uint32_t) + m_filetypes.capacity() * sizeof(uint16_t) +
+			m_filesizes.capacity() * sizeof(uint64_t) + m_modificationdates.capacity() * sizeof(int64_t) +
+			m_nameOffsets.capacity() * sizeof(uint32_t) + m_names.capacity() +
+			(m_byName.capacity() + m_byId.capacity()) * sizeof(uint32_t);
+}
+
+uint32_t MtpFolderContents::id(size_t i) const
+{
+	return m_ids[i];
+}
+
+LIBMTP_filetype_t MtpFolderContents::filetype(size_t i) const
+{
+	return (LIBMTP_filetype_t) m_filetypes[i];
+}
+
+uint64_t MtpFolderContents::filesize(size_t i) const
+{
+	return m_filesizes[i];
+}
+
+time_t MtpFolderContents::modificationdate(size_t i) const
+{
+	return m_modificationdates[i];
+}
+
+const char* MtpFolderContents::name(size_t i) const
+{
+	return m_names.c_str() + m_nameOffsets[i];
+}
+
+MtpFileInfo MtpFolderContents::info(size_t i) const
+{
+	MtpFileInfo result(m_ids[i], m_parentId, m_storageId, name(i), filetype(i), m_filesizes[i]);
+	result.modificationdate = m_modificationdates[i];
+	return result;
+}
+
+size_t MtpFolderContents::count(LIBMTP_filetype_t filetype) const
+{
+	return std::count(m_filetypes.begin(), m_filetypes.end(), (uint16_t) filetype);
+}
+
+size_t MtpFolderContents::find(const std::string& name) const
+{
+	if (!m_indexed)
+	{
+		// Not finished, so there's no index yet.
+		for(size_t i = 0; i < m_ids.size(); i++)
+		{
+			if (name == this->name(i))
+				return i;
+		}
+		return npos;
+	}
+	std::vector<uint32_t>::const_iterator i = std::lower_bound(m_byName.begin(), m_byName.end(),
+			name.c_str(), NameLess(*this));
+	if ((i != m_byName.end()) && (name == this->name(*i)))
+		return *i;
+	return npos;
+}
+
+size_t MtpFolderContents::findId(uint32_t id) const
+{
+	if (!m_indexed)
+	{
+		std::vector<uint32_t>::const_iterator i = std::find(m_ids.begin(), m_ids.end(), id);
+		if (i == m_ids.end())
+			return npos;
+		return i - m_ids.begin();
+	}
+	std::vector<uint32_t>::const_iterator i = std::lower_bound(m_byId.begin(), m_byId.end(), IdLess::Id(id),
+			IdLess(*this));
+	if ((i != m_byId.end()) && (m_ids[*i] == id))
+		return *i;
+	return npos;
+}
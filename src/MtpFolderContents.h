@@ -0,0 +1,116 @@
+/*
+ * MtpNoteMetadata.h
+ *
+ *      Author: Jason Ferrara
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+
+#ifndef MTPFOLDERCONTENTS_H_
+#define MTPFOLDERCONTENTS_H_
+
+#include "MtpDevice.h"
+#include <string>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The objects in a folder, packed so that big folders don't take much
+ * memory: each detail of the objects is in an array of its own, and the
+ * names are one after the other in a single string, instead of each object
+ * being an MtpFileInfo with a name allocated on its own. Objects are
+ * referred to by their position, in the order they were added.
+ *
+ * All the objects are in the same folder and storage. Once finish has been
+ * called, which the cache does before handing a listing out, the contents
+ * don't change. The cache makes changed copies instead, and add and remove
+ * keep the indexes of a finished copy in order rather than sorting them
+ * again.
+ */
+class MtpFolderContents
+{
+public:
+	MtpFolderContents();
+
+	void add(const LIBMTP_file_t& file);
+	void add(const MtpFileInfo& info);
+	void remove(size_t i);
+
+	/*
+	 * Sorts the indexes that find and findId use, and gives back spare space.
+	 */
+	void finish();
+
+	size_t size() const;
+	bool empty() const;
+
+	/*
+	 * Memory allocated for the contents.
+	 */
+	size_t bytes() const;
+
+	uint32_t id(size_t i) const;
+	LIBMTP_filetype_t filetype(size_t i) const;
+	uint64_t filesize(size_t i) const;
+	time_t modificationdate(size_t i) const;
+	// 0 terminated.
+	const char* name(size_t i) const;
+	MtpFileInfo info(size_t i) const;
+
+	/*
+	 * How many of the objects are of filetype.
+	 */
+	size_t count(LIBMTP_filetype_t filetype) const;
+
+	/*
+	 * The position of the object called name, or npos if there isn't one. If
+	 * there are several, which mtp allows, the first added.
+	 */
+	size_t find(const std::string& name) const;
+
+	/*
+	 * The position of the object with id, or npos.
+	 */
+	size_t findId(uint32_t id) const;
+
+	static const size_t npos = (size_t) -1;
+
+private:
+	class NameLess;
+	class IdLess;
+
+	void add(uint32_t id, uint32_t parentId, uint32_t storageId, const char* name,
+			LIBMTP_filetype_t filetype, uint64_t filesize, time_t modificationdate);
+
+	uint32_t				m_parentId;
+	uint32_t				m_storageId;
+	std::vector<uint32_t>	m_ids;
+	std::vector<uint16_t>	m_filetypes;
+	std::vector<uint64_t>	m_filesizes;
+	std::vector<int64_t>	m_modificationdates;
+	// Where each name starts in m_names.
+	std::vector<uint32_t>	m_nameOffsets;
+	// Every name, each followed by a 0.
+	std::string				m_names;
+	// Positions, in order of name and of id. Not kept until finish.
+	std::vector<uint32_t>	m_byName;
+	std::vector<uint32_t>	m_byId;
+	bool					m_indexed;
+};
+
+
+#endif /* MTPFOLDERCONTENTS_H_ */
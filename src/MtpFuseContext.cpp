@@ -21,11 +21,114 @@
 #include "MtpFuseContext.h"
 #include "mtpFilesystemErrors.h"
 #include "MtpRoot.h"
+#include <algorithm>
 
-MtpFuseContext::MtpFuseContext(std::unique_ptr<MtpDevice> device,  uid_t uid, gid_t gid) :
-	m_device(std::move(device)), m_uid(uid), m_gid(gid)
+// Reads ahead once this much has been read sequentially.
+static const off_t readAheadAfter = 512 * 1024;
+// How far a read can be from where the last one ended and still count as
+// sequential. The kernel sends its own read ahead in parallel, so reads
+// don't always arrive in order.
+static const off_t sequentialSlack = 1024 * 1024;
+static const size_t minReadAheadWindow = 1024 * 1024;
+static const size_t maxReadAheadWindow = 32 * 1024 * 1024;
+static const uint64_t readAheadSeconds = 1;
+
+MtpFileHandle::MtpFileHandle(std::unique_ptr<MtpNode> node, MtpDevice& device, MtpMetadataCache& cache) :
+	m_node(std::move(node)), m_device(device), m_cache(cache), m_nextOffset(0), m_sequentialBytes(0),
+	m_readAheadTo(0), m_readAheadWindow(minReadAheadWindow)
+{
+	m_localFile = m_node->Open();
+}
+
+MtpLocalFileCopy& MtpFileHandle::localFile()
+{
+	return *m_localFile;
+}
+
+void MtpFileHandle::fsync()
+{
+	LockMutex lock(m_nodeMutex);
+	m_node->Fsync();
+}
+
+void MtpFileHandle::allocate(off_t length)
+{
+	LockMutex lock(m_nodeMutex);
+	m_node->Allocate(length);
+}
+
+void MtpFileHandle::flush()
+{
+	m_localFile->reportWriteBackError();
+}
+
+size_t MtpFileHandle::read(void* ptr, size_t size, off_t offset)
+{
+	readingAt(offset, size);
+	return m_localFile->read(ptr, size, offset);
+}
+
+#if FUSE_VERSION >= 29
+void MtpFileHandle::readBuf(struct fuse_bufvec& buf, off_t offset)
+{
+	readingAt(offset, buf.buf[0].size);
+	m_localFile->readBuf(buf, offset);
+}
+#endif
+
+void MtpFileHandle::readingAt(off_t offset, size_t size)
 {
+	LockMutex lock(m_readAheadMutex);
 
+	if ((offset >= m_nextOffset - sequentialSlack) && (offset <= m_nextOffset + sequentialSlack))
+	{
+		m_sequentialBytes += size;
+		m_nextOffset = std::max(m_nextOffset, (off_t) (offset + size));
+	}
+	else
+	{
+		// Start over from here.
+		if (m_readAheadTo > m_nextOffset)
+			m_cache.stopReadAhead(m_localFile);
+		m_sequentialBytes = size;
+		m_nextOffset = offset + size;
+		m_readAheadTo = 0;
+		m_readAheadWindow = minReadAheadWindow;
+	}
+	if (m_sequentialBytes < readAheadAfter)
+		return;
+
+	// Top up the window once the reads are half way into it.
+	if (m_readAheadTo - m_nextOffset > (off_t) m_readAheadWindow / 2)
+		return;
+	size_t fullWindow = std::min(std::max(m_device.PartialFileRate() * readAheadSeconds,
+			(uint64_t) minReadAheadWindow), (uint64_t) maxReadAheadWindow);
+	if (m_readAheadTo > 0)
+		m_readAheadWindow = std::min(m_readAheadWindow * 2, fullWindow);
+	off_t from = std::max(m_readAheadTo, m_nextOffset);
+	m_readAheadTo = m_nextOffset + m_readAheadWindow;
+	m_cache.readAhead(m_localFile, from, m_readAheadTo - from);
+}
+
+MtpDirectoryHandle::MtpDirectoryHandle(std::unique_ptr<MtpNode> node) :
+	m_node(std::move(node)), m_listingUsed(false)
+{
+	m_listing = m_node->openDirectory();
+}
+
+void MtpDirectoryHandle::readdir(MtpDirectoryFiller& filler, off_t offset)
+{
+	if ((offset == 0) && m_listingUsed)
+		m_listing = m_node->openDirectory();
+	m_listingUsed = true;
+	m_listing->fill(filler, offset);
+}
+
+MtpFuseContext::MtpFuseContext(std::unique_ptr<MtpDevice> device,  uid_t uid, gid_t gid) :
+	m_uid(uid), m_gid(gid), m_deviceDisconnected(false), m_exit(0), m_exitData(0),
+	m_device(std::move(device)), m_eventListener(*m_device, m_cache)
+{
+	m_device->SetDisconnectHandler(disconnected, this);
 }
 
 std::unique_ptr<MtpNode> MtpFuseContext::getNode(const FilesystemPath& path)
@@ -48,3 +151,119 @@ gid_t MtpFuseContext::gid() const
 {
 	return m_gid;
 }
+
+RecursiveMutex& MtpFuseContext::mutationLock()
+{
+	return m_mutationLock;
+}
+
+time_t MtpFuseContext::cacheTimeout()
+{
+	return m_cache.timeout();
+}
+
+void MtpFuseContext::setCacheTimeout(time_t seconds)
+{
+	m_cache.setTimeout(seconds);
+}
+
+void MtpFuseContext::setBackgroundRefresh(bool backgroundRefresh)
+{
+	m_cache.setBackgroundRefresh(backgroundRefresh);
+}
+
+void MtpFuseContext::setMetadataCacheSize(size_t bytes)
+{
+	m_cache.setMaxBytes(bytes);
+}
+
+MtpMetadataCacheStats MtpFuseContext::metadataCacheStats()
+{
+	return m_cache.stats();
+}
+
+void MtpFuseContext::startEventListener()
+{
+	m_eventListener.start();
+}
+
+void MtpFuseContext::setExitHandler(void (*exit)(void* data), void* data)
+{
+	LockMutex lock(m_exitMutex);
+
+	m_exit = exit;
+	m_exitData = data;
+	if (m_exit && m_deviceDisconnected)
+		m_exit(m_exitData);
+}
+
+bool MtpFuseContext::deviceDisconnected()
+{
+	LockMutex lock(m_exitMutex);
+
+	return m_deviceDisconnected;
+}
+
+void MtpFuseContext::setFileIdListener(MtpFileIdListener* listener)
+{
+	m_cache.setFileIdListener(listener);
+}
+
+void MtpFuseContext::disconnected(void* context)
+{
+	MtpFuseContext* self = (MtpFuseContext*) context;
+	LockMutex lock(self->m_exitMutex);
+
+	self->m_deviceDisconnected = true;
+	if (self->m_exit)
+		self->m_exit(self->m_exitData);
+}
+
+void MtpFuseContext::useDiskCache(const std::string& directory, uint64_t maxBytes)
+{
+	// Object ids only mean something on the device they came from.
+	std::string device = m_device->Get_Serialnumber();
+	if (device.empty())
+		device = m_device->Get_Modelname();
+	if (device.empty())
+		device = "unknown";
+	std::replace(device.begin(), device.end(), '/', '_');
+	m_cache.setDiskCache(std::unique_ptr<MtpDiskCache>(new MtpDiskCache(directory + "/" + device, maxBytes)));
+	m_cache.setSnapshot(std::unique_ptr<MtpMetadataSnapshot>(new MtpMetadataSnapshot(directory + "/" + device,
+			m_device->GetStorageDevices())), *m_device);
+}
+
+uint64_t MtpFuseContext::openFileHandle(std::unique_ptr<MtpNode> node)
+{
+	return (uint64_t) new MtpFileHandle(std::move(node), *m_device, m_cache);
+}
+
+MtpFileHandle& MtpFuseContext::fileHandle(uint64_t fh)
+{
+	return *((MtpFileHandle*) fh);
+}
+
+void MtpFuseContext::releaseFileHandle(uint64_t fh)
+{
+	std::unique_ptr<MtpFileHandle> handle((MtpFileHandle*) fh);
+	handle->m_localFile->removeHandle();
+	if (!handle->m_localFile->hasHandles())
+		m_cache.stopReadAhead(handle->m_localFile);
+	handle->m_localFile.reset();
+	handle->m_node->Close();
+}
+
+uint64_t MtpFuseContext::openDirectoryHandle(std::unique_ptr<MtpNode> node)
+{
+	return (uint64_t) new MtpDirectoryHandle(std::move(node));
+}
+
+MtpDirectoryHandle& MtpFuseContext::directoryHandle(uint64_t fh)
+{
+	return *((MtpDirectoryHandle*) fh);
+}
+
+void MtpFuseContext::releaseDirectoryHandle(uint64_t fh)
+{
+	delete (MtpDirectoryHandle*) fh;
+}
@@ -23,11 +23,86 @@
 #define MTPFUSECONTEXT_H_
 
 #include "MtpDevice.h"
+#include "MtpEventListener.h"
 #include "MtpMetadataCache.h"
 #include "MtpNode.h"
+#include "Mutex.h"
 #include <memory>
 #include <sys/types.h>
 
+/*
+ * An open file. A pointer to one of these is stored in fuse_file_info::fh,
+ * so reads and writes go straight to the local copy instead of looking up
+ * the path again for every request.
+ *
+ * Reads through the handle are watched for a file being read from start to
+ * end, and once one is, it is read ahead of the reads. The window read ahead
+ * starts small and doubles each time it is topped up, up to about as much
+ * as the device can send in readAheadSeconds.
+ */
+class MtpFileHandle
+{
+public:
+	MtpFileHandle(std::unique_ptr<MtpNode> node, MtpDevice& device, MtpMetadataCache& cache);
+
+	MtpLocalFileCopy& localFile();
+
+	/*
+	 * The node's id changes as the file is written back, and more than one
+	 * request can be using the same handle, so these take turns.
+	 */
+	void fsync();
+	void allocate(off_t length);
+
+	/*
+	 * Throws the error from a failed write back of the file in the
+	 * background, if there's one that hasn't been reported yet.
+	 */
+	void flush();
+
+	size_t read(void* ptr, size_t size, off_t offset);
+#if FUSE_VERSION >= 29
+	void readBuf(struct fuse_bufvec& buf, off_t offset);
+#endif
+
+private:
+	friend class MtpFuseContext;
+
+	void readingAt(off_t offset, size_t size);
+
+	std::unique_ptr<MtpNode>			m_node;
+	RecursiveMutex						m_nodeMutex;
+	std::shared_ptr<MtpLocalFileCopy>	m_localFile;
+	MtpDevice&							m_device;
+	MtpMetadataCache&					m_cache;
+	// Where the next read would be if the file is read sequentially.
+	off_t								m_nextOffset;
+	off_t								m_sequentialBytes;
+	// End of what has been queued to be read ahead.
+	off_t								m_readAheadTo;
+	size_t								m_readAheadWindow;
+	RecursiveMutex						m_readAheadMutex;
+};
+
+/*
+ * An open directory, stored in fuse_file_info::fh between opendir and
+ * releasedir. Readdir calls continue from the listing taken when the
+ * directory was opened. Starting again from offset 0, as rewinddir does,
+ * takes a fresh listing.
+ */
+class MtpDirectoryHandle
+{
+public:
+	MtpDirectoryHandle(std::unique_ptr<MtpNode> node);
+
+	void readdir(MtpDirectoryFiller& filler, off_t offset);
+
+private:
+	std::unique_ptr<MtpNode>				m_node;
+	std::unique_ptr<MtpDirectoryListing>	m_listing;
+	bool									m_listingUsed;
+};
+
 class MtpFuseContext
 {
 public:
@@ -38,11 +113,89 @@ public:
 	uid_t uid() const;
 	gid_t gid() const;
 
+	/*
+	 * Held by operations that change the structure of the filesystem (creating,
+	 * removing, renaming or truncating objects), so that their multi step
+	 * sequences of device operations don't interleave. Everything else only
+	 * synchronizes on the locks in the cache, the local file copies and MtpLibLock.
+	 */
+	RecursiveMutex& mutationLock();
+
+	/*
+	 * How long, in seconds, metadata from the device is cached for, as set
+	 * by the -cache_timeout option. It is independent of how long the kernel
+	 * caches names and attributes for.
+	 */
+	time_t cacheTimeout();
+	void setCacheTimeout(time_t seconds);
+
+	/*
+	 * Answer from expired metadata straight away, and fetch it again in the
+	 * background, so browsing doesn't wait for the device.
+	 */
+	void setBackgroundRefresh(bool backgroundRefresh);
+
+	/*
+	 * Most memory, in bytes, for folder listings and file details kept from
+	 * the device, and how well they're being used.
+	 */
+	void setMetadataCacheSize(size_t bytes);
+	MtpMetadataCacheStats metadataCacheStats();
+
+	/*
+	 * Start clearing what changes on the device from the cache as the device
+	 * reports it. Called once fuse is running in the background.
+	 */
+	void startEventListener();
+
+	/*
+	 * Once a request or a background thread finds the device disconnected,
+	 * exit is called with data, so the frontend can end fuse's loop and the
+	 * mount is torn down as on an unmount, instead of the process exiting
+	 * under fuse. The frontend sets it back to 0 before fuse stops handling
+	 * signals.
+	 */
+	void setExitHandler(void (*exit)(void* data), void* data);
+	bool deviceDisconnected();
+
+	/*
+	 * Tells listener about files given new ids as they're written back, or
+	 * no one if it's 0.
+	 */
+	void setFileIdListener(MtpFileIdListener* listener);
+
+	/*
+	 * Keep copies of files read from the device in a subdirectory of
+	 * directory named after the device's serial number, using at most
+	 * maxBytes, so later mounts don't have to copy them again. Folder
+	 * listings are saved there too, so later mounts can list folders
+	 * without waiting for the device.
+	 */
+	void useDiskCache(const std::string& directory, uint64_t maxBytes);
+
+	uint64_t openFileHandle(std::unique_ptr<MtpNode> node);
+	MtpFileHandle& fileHandle(uint64_t fh);
+	void releaseFileHandle(uint64_t fh);
+
+	uint64_t openDirectoryHandle(std::unique_ptr<MtpNode> node);
+	MtpDirectoryHandle& directoryHandle(uint64_t fh);
+	void releaseDirectoryHandle(uint64_t fh);
+
 protected:
+	static void disconnected(void* context);
+
 	uid_t						m_uid;
 	gid_t						m_gid;
+	// Before the device, as the cache can still find it disconnected while
+	// it is destroyed.
+	RecursiveMutex				m_exitMutex;
+	bool						m_deviceDisconnected;
+	void						(*m_exit)(void* data);
+	void*						m_exitData;
 	std::unique_ptr<MtpDevice>	m_device;
 	MtpMetadataCache 		  	m_cache;
+	MtpEventListener			m_eventListener;
+	RecursiveMutex				m_mutationLock;
 };
 
 
@@ -0,0 +1,131 @@
+/*
+ * MtpInodeTable.cpp
+ *
+ *      Author: Jason Ferrara
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+#include "MtpInodeTable.h"
+#include "mtpFilesystemErrors.h"
+
+MtpInodeTable::MtpInodeTable(std::unique_ptr<MtpNode> root) : m_nextInode(FUSE_ROOT_ID + 1)
+{
+	Entry& e = m_nodes[FUSE_ROOT_ID];
+	e.node = std::move(root);
+	e.id = e.node->Id();
+	e.nlookup = 1;
+	e.wasOpened = false;
+	m_inodes[e.id] = FUSE_ROOT_ID;
+}
+
+fuse_ino_t MtpInodeTable::add(std::unique_ptr<MtpNode> node)
+{
+	LockMutex lock(m_mutex);
+
+	applyIdChanges();
+	uint32_t id = node->Id();
+	inode_map_type::iterator i = m_inodes.find(id);
+	if (i != m_inodes.end())
+	{
+		m_nodes[i->second].nlookup++;
+		return i->second;
+	}
+
+	fuse_ino_t ino = m_nextInode++;
+	Entry& e = m_nodes[ino];
+	e.node = std::move(node);
+	e.id = id;
+	e.nlookup = 1;
+	e.wasOpened = false;
+	m_inodes[id] = ino;
+	return ino;
+}
+
+std::unique_ptr<MtpNode> MtpInodeTable::get(fuse_ino_t ino)
+{
+	LockMutex lock(m_mutex);
+
+	node_map_type::iterator i = m_nodes.find(ino);
+	if (i == m_nodes.end())
+		throw FileNotFound("inode");
+	return i->second.node->Clone();
+}
+
+void MtpInodeTable::forget(fuse_ino_t ino, uint64_t nlookup)
+{
+	LockMutex lock(m_mutex);
+
+	if (ino == FUSE_ROOT_ID)
+		return;
+	applyIdChanges();
+	node_map_type::iterator i = m_nodes.find(ino);
+	if (i == m_nodes.end())
+		return;
+	if (i->second.nlookup > nlookup)
+	{
+		i->second.nlookup -= nlookup;
+		return;
+	}
+	inode_map_type::iterator id = m_inodes.find(i->second.id);
+	if ((id != m_inodes.end()) && (id->second == ino))
+		m_inodes.erase(id);
+	m_nodes.erase(i);
+}
+
+bool MtpInodeTable::opened(fuse_ino_t ino, const struct stat& info)
+{
+	LockMutex lock(m_mutex);
+
+	node_map_type::iterator i = m_nodes.find(ino);
+	if (i == m_nodes.end())
+		throw FileNotFound("inode");
+	Entry& e = i->second;
+	bool unchanged = e.wasOpened && (e.openedSize == info.st_size) && (e.openedMtime == info.st_mtime);
+	e.wasOpened = true;
+	e.openedSize = info.st_size;
+	e.openedMtime = info.st_mtime;
+	return unchanged;
+}
+
+void MtpInodeTable::fileIdChanged(uint32_t oldId, uint32_t newId)
+{
+	LockMutex lock(m_idChangesMutex);
+
+	m_idChanges.push_back(std::make_pair(oldId, newId));
+}
+
+/*
+ * Moves the inodes of files that have been given new ids over to them.
+ * Called with the table locked.
+ */
+void MtpInodeTable::applyIdChanges()
+{
+	id_change_list_type changes;
+	{
+		LockMutex lock(m_idChangesMutex);
+		changes.swap(m_idChanges);
+	}
+	for(id_change_list_type::iterator i = changes.begin(); i != changes.end(); i++)
+	{
+		inode_map_type::iterator old = m_inodes.find(i->first);
+		if (old == m_inodes.end())
+			continue;
+		fuse_ino_t ino = old->second;
+		m_inodes.erase(old);
+		m_nodes[ino].id = i->second;
+		m_inodes.insert(std::make_pair(i->second, ino));
+	}
+}
@@ -0,0 +1,101 @@
+/*
+ * MtpInodeTable.h
+ *
+ *      Author: Jason Ferrara
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+
+#ifndef MTPINODETABLE_H_
+#define MTPINODETABLE_H_
+
+#include "MtpMetadataCache.h"
+#include "MtpNode.h"
+#include "Mutex.h"
+#include <fuse_lowlevel.h>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/*
+ * Maps fuse inode numbers to nodes for the low level fuse frontend. A node
+ * is kept until the kernel has forgotten every lookup of it, and looking up
+ * an object that already has an inode gives back the same inode.
+ *
+ * Files change id as they're written back. As the metadata cache's file id
+ * listener, the table moves their inodes over to the new ids before it is
+ * next used, so a lookup of the new id finds the inode the kernel already
+ * has instead of making a second one for the same file.
+ */
+class MtpInodeTable : public MtpFileIdListener
+{
+public:
+	MtpInodeTable(std::unique_ptr<MtpNode> root);
+
+	/*
+	 * Records a lookup of node, as answered by a lookup, mkdir or create
+	 * reply, and returns its inode number.
+	 */
+	fuse_ino_t add(std::unique_ptr<MtpNode> node);
+
+	/*
+	 * Returns a copy of the node for the caller to use. Nodes keep track of
+	 * their file's id changing as they're used, so the table's own node is
+	 * only ever used with the table locked.
+	 */
+	std::unique_ptr<MtpNode> get(fuse_ino_t ino);
+
+	void forget(fuse_ino_t ino, uint64_t nlookup);
+
+	/*
+	 * Records the size and modification time of a file that is being opened.
+	 * Returns true if they are the same as when it was last opened, in which
+	 * case whatever the kernel has cached of its contents is still good.
+	 */
+	bool opened(fuse_ino_t ino, const struct stat& info);
+
+	void fileIdChanged(uint32_t oldId, uint32_t newId);
+
+private:
+	struct Entry
+	{
+		std::unique_ptr<MtpNode>	node;
+		uint32_t					id;
+		uint64_t					nlookup;
+		bool						wasOpened;
+		off_t						openedSize;
+		time_t						openedMtime;
+	};
+
+	typedef std::unordered_map<fuse_ino_t, Entry> node_map_type;
+	typedef std::unordered_map<uint32_t, fuse_ino_t> inode_map_type;
+	typedef std::vector<std::pair<uint32_t, uint32_t> > id_change_list_type;
+
+	void applyIdChanges();
+
+	node_map_type		m_nodes;
+	inode_map_type		m_inodes;
+	fuse_ino_t			m_nextInode;
+	RecursiveMutex		m_mutex;
+	// Noted by fileIdChanged with the cache locked, which can't wait for
+	// m_mutex, as the table's nodes use the cache with it held.
+	id_change_list_type	m_idChanges;
+	RecursiveMutex		m_idChangesMutex;
+};
+
+
+#endif /* MTPINODETABLE_H_ */
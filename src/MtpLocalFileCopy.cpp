@@ -19,113 +19,1081 @@
  * licensing@fsf.org
  */
 #include "MtpLocalFileCopy.h"
+#include "MtpMetadataCache.h"
 #include "mtpFilesystemErrors.h"
 #include <sys/stat.h>
+#include <algorithm>
 #include <iostream>
+#include <iterator>
+#include <limits>
+#include <stdlib.h>
 #include <unistd.h>
+#include <vector>
 
-MtpLocalFileCopy::MtpLocalFileCopy(MtpDevice& device, uint32_t id) :
-	m_device(device), m_remoteId(id), m_needWriteBack(false)
-{
-	m_localFile = tmpfile();
-	if (m_localFile == 0)
-		throw CantCreateTempFile(errno);
-	m_device.GetFile(m_remoteId, fileno(m_localFile));
+// The local copy is filled in from the device in blocks of this size.
+static const size_t localCopyBlockSize = 256 * 1024;
+// Most sent with one SendPartialObject when changing a file in place.
+static const size_t editPieceSize = 1024 * 1024;
 
+MtpLocalFileCopy::MtpLocalFileCopy(MtpMetadataCache& cache, MtpDevice& device, uint32_t id) :
+	m_cache(cache), m_device(device), m_remoteId(id), m_needWriteBack(false), m_writingBack(false),
+	m_discarded(false), m_remoteDeleted(false), m_fetched(false), m_partialReads(device.CanGetPartialFile()),
+	m_presentCount(0), m_presentVersion(0), m_remoteInfoId(0), m_remoteStorageId(0), m_remoteSize(0), m_remoteModified(0), m_stored(false),
+	m_checkRemote(false),
+	m_created(false), m_destroying(false), m_handles(0),
+	m_modified(time(0)), m_truncatedTo(std::numeric_limits<off_t>::max()), m_downloading(false), m_downloadStarted(false), m_cancelDownload(false),
+	m_downloaded(0)
+{
 }
 
 MtpLocalFileCopy::~MtpLocalFileCopy()
 {
-	close();
+	// The cache may be going away too, so don't tell it about a new id.
+	m_destroying = true;
+	try
+	{
+		writeBack();
+	}
+	catch(std::exception& e)
+	{
+		std::cerr << "Failed to write back changes: " << e.what() << std::endl;
+	}
+	{
+		LockMutex lock(m_fetchMutex);
+
+		m_cancelDownload = true;
+	}
+	if (m_downloadStarted)
+		pthread_join(m_downloadThread, 0);
+}
+
+void MtpLocalFileCopy::fetch()
+{
+	LockMutex lock(m_fetchMutex);
+
+	checkRemote();
+	if (m_fetched)
+		return;
+	if (partialReads() && !m_downloading && (m_presentCount > 0))
+	{
+		// Only the gaps between what has already been read need to be copied.
+		try
+		{
+			fetchBlocks(0, m_present.size());
+			return;
+		}
+		catch(MtpDeviceDisconnected&)
+		{
+			throw;
+		}
+		catch(MtpError&)
+		{
+			noPartialReads();
+		}
+	}
+	startDownload();
+	waitForDownload(m_remoteSize);
+}
+
+/*
+ * Starts copying the whole file from the device in the background, if that
+ * isn't already happening. Called with m_fetchMutex held.
+ */
+void MtpLocalFileCopy::startDownload()
+{
+	if (m_downloading)
+		return;
+	if (m_downloadStarted)
+	{
+		// An earlier attempt failed part way through. Start over.
+		pthread_join(m_downloadThread, 0);
+		m_downloadStarted = false;
+	}
+	m_downloaded = 0;
+	m_downloadError = std::exception_ptr();
+	m_downloading = true;
+	int err = pthread_create(&m_downloadThread, 0, downloadMain, this);
+	if (err)
+	{
+		m_downloading = false;
+		throw ReadError(err);
+	}
+	m_downloadStarted = true;
+}
+
+/*
+ * Waits until the first end bytes of the file have been downloaded, or the
+ * download has ended. Called with m_fetchMutex held exactly once, since it
+ * is released while waiting.
+ */
+void MtpLocalFileCopy::waitForDownload(uint64_t end)
+{
+	while(m_downloading && (m_downloaded < end))
+		m_downloadProgress.Wait(m_fetchMutex);
+	if (m_downloadError)
+	{
+		// Reported once. The next read tries again.
+		std::exception_ptr error = m_downloadError;
+		m_downloadError = std::exception_ptr();
+		std::rethrow_exception(error);
+	}
 }
 
+void* MtpLocalFileCopy::downloadMain(void* localFile)
+{
+	((MtpLocalFileCopy*) localFile)->download();
+	return 0;
+}
+
+void MtpLocalFileCopy::download()
+{
+	std::exception_ptr error;
+	try
+	{
+		m_device.GetFile(remoteId(), putData, this);
+	}
+	catch(...)
+	{
+		error = std::current_exception();
+	}
+	LockMutex lock(m_fetchMutex);
+	m_downloading = false;
+	if (!error)
+	{
+		LockMutex stateLock(m_stateMutex);
+		m_fetched = true;
+	}
+	else if (!m_cancelDownload && !m_fetched)
+		m_downloadError = error;
+	m_downloadProgress.Broadcast();
+}
 
-uint32_t MtpLocalFileCopy::close()
+uint16_t MtpLocalFileCopy::putData(void*, void* priv, uint32_t sendlen, unsigned char* data, uint32_t* putlen)
 {
-	if (m_localFile)
+	MtpLocalFileCopy* localFile = (MtpLocalFileCopy*) priv;
+	uint64_t offset;
+	std::vector<bool> present;
+	{
+		LockMutex lock(localFile->m_fetchMutex);
+
+		if (localFile->m_cancelDownload)
+			return LIBMTP_HANDLER_RETURN_CANCEL;
+		offset = localFile->m_downloaded;
+		for(uint64_t block = offset / localCopyBlockSize; block * localCopyBlockSize < offset + sendlen; block++)
+			present.push_back((block < localFile->m_present.size()) && localFile->m_present[block]);
+	}
+	// Blocks already copied may have been changed since, so they're left alone.
+	size_t wroteBytes = 0;
+	while(wroteBytes < sendlen)
+	{
+		uint64_t position = offset + wroteBytes;
+		size_t blockEnd = localCopyBlockSize - position % localCopyBlockSize;
+		size_t length = std::min(sendlen - wroteBytes, blockEnd);
+		if (present[position / localCopyBlockSize - offset / localCopyBlockSize])
+		{
+			wroteBytes += length;
+			continue;
+		}
+		ssize_t result = pwrite(localFile->m_localFile.FileNo(), data + wroteBytes, length, position);
+		if (result == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			return LIBMTP_HANDLER_RETURN_ERROR;
+		}
+		wroteBytes += result;
+	}
+	*putlen = sendlen;
+
+	LockMutex lock(localFile->m_fetchMutex);
+	localFile->m_downloaded += sendlen;
+	// Blocks the download has got past are as good as ones read on their own.
+	size_t doneBlocks = std::min(localFile->m_present.size(),
+			(size_t) ((localFile->m_downloaded >= localFile->m_remoteSize) ?
+					localFile->m_present.size() : localFile->m_downloaded / localCopyBlockSize));
 	{
-		if (m_needWriteBack)
+		LockMutex stateLock(localFile->m_stateMutex);
+		for(size_t block = offset / localCopyBlockSize; block < doneBlocks; block++)
 		{
-			m_needWriteBack = false;
-			try
+			if (!localFile->m_present[block])
 			{
-				fflush(m_localFile);
-				if (fseek(m_localFile, 0, SEEK_SET))
-					throw WriteError(errno);
-				struct stat tempInfo;
-				if (fstat(fileno(m_localFile), &tempInfo))
-					throw ReadError(errno);
-				MtpFileInfo remoteInfo = m_device.GetFileInfo(m_remoteId);
-				NewLIBMTPFile newFile(remoteInfo.name, remoteInfo.parentId, remoteInfo.storageId, tempInfo.st_size);
-				m_device.DeleteObject(m_remoteId);
-				std::cout << "************ sending file" << std::endl;
-				m_device.SendFile(newFile, fileno(m_localFile));
-				m_remoteId = ((LIBMTP_file_t*)newFile)->item_id;
+				localFile->m_present[block] = true;
+				localFile->m_presentCount++;
+			}
+		}
+		if (localFile->m_presentCount == localFile->m_present.size())
+			localFile->m_fetched = true;
+	}
+	localFile->m_downloadProgress.Broadcast();
+	return LIBMTP_HANDLER_RETURN_OK;
+}
+
+void MtpLocalFileCopy::prefetch(off_t offset, size_t size)
+{
+	if (partialReads())
+		fetchRange(offset, size);
+}
+
+/*
+ * Gets the local copy ready for a change to the range. If the device can
+ * change files in place, only the blocks the range touches are needed.
+ * Otherwise the file is sent back whole, so all of it is. Called with
+ * m_mutex held.
+ */
+void MtpLocalFileCopy::fetchForWrite(off_t offset, size_t size)
+{
+	if (m_device.CanEditFile() && partialReads())
+	{
+		// Whole blocks, so a download going on can't write over the change.
+		off_t start = offset - offset % localCopyBlockSize;
+		off_t end = (offset + size + localCopyBlockSize - 1) / localCopyBlockSize * localCopyBlockSize;
+		fetchRange(start, end - start);
+		// In case it had to give up on reading parts of the file.
+		if (!partialReads())
+			fetch();
+	}
+	else
+		fetch();
+}
+
+/*
+ * Records that the range was changed. Called with m_mutex held.
+ */
+void MtpLocalFileCopy::addDirty(off_t start, off_t end)
+{
+	std::map<off_t, off_t>::iterator i = m_dirty.upper_bound(start);
+	if ((i != m_dirty.begin()) && (std::prev(i)->second >= start))
+	{
+		i--;
+		start = i->first;
+		end = std::max(end, i->second);
+	}
+	while((i != m_dirty.end()) && (i->first <= end))
+	{
+		end = std::max(end, i->second);
+		m_dirty.erase(i++);
+	}
+	m_dirty[start] = end;
+}
+
+/*
+ * The file was cut or extended to length. Blocks past the end, or that are
+ * now zeros, don't need anything from the remote file. Called with m_mutex
+ * held.
+ */
+void MtpLocalFileCopy::truncated(off_t length)
+{
+	std::map<off_t, off_t>::iterator i = m_dirty.lower_bound(length);
+	m_dirty.erase(i, m_dirty.end());
+	if (!m_dirty.empty() && (m_dirty.rbegin()->second > length))
+		m_dirty.rbegin()->second = length;
+	m_truncatedTo = std::min(m_truncatedTo, length);
+
+	LockMutex fetchLock(m_fetchMutex);
+	LockMutex stateLock(m_stateMutex);
+	for(size_t block = (length + localCopyBlockSize - 1) / localCopyBlockSize; block < m_present.size(); block++)
+	{
+		if (!m_present[block])
+		{
+			m_present[block] = true;
+			m_presentCount++;
+		}
+	}
+	if (m_presentCount == m_present.size())
+		m_fetched = true;
+}
+
+/*
+ * Sends just what has changed to the device, changing the remote file in
+ * place so it keeps its id. Returns false, without doing anything, if the
+ * device can't do that or the local copy didn't come from the remote file.
+ * Called with m_mutex held.
+ */
+bool MtpLocalFileCopy::writeBackInPlace(uint32_t id)
+{
+	uint64_t remoteSize;
+	{
+		LockMutex fetchLock(m_fetchMutex);
+
+		if (!m_device.CanEditFile() || (m_remoteInfoId != id))
+			return false;
+		remoteSize = m_remoteSize;
+	}
+	off_t size = getSize();
+	std::map<off_t, off_t> ranges = m_dirty;
+	// Everything past where the file was cut, or its old end, is new.
+	off_t newFrom = std::min((off_t) remoteSize, m_truncatedTo);
+	if (newFrom < size)
+		ranges[newFrom] = size;
+
+	m_device.BeginEditFile(id);
+	try
+	{
+		if ((uint64_t) size < remoteSize)
+			m_device.TruncateFile(id, size);
+		std::vector<char> data;
+		for(std::map<off_t, off_t>::iterator i = ranges.begin(); i != ranges.end(); i++)
+		{
+			for(off_t position = i->first; position < std::min(i->second, size);)
+			{
+				size_t length = std::min((off_t) editPieceSize, std::min(i->second, size) - position);
+				data.resize(length);
+				size_t readBytes = 0;
+				while(readBytes < length)
+				{
+					ssize_t result = pread(m_localFile.FileNo(), &data[readBytes], length - readBytes, position + readBytes);
+					if (result == -1)
+					{
+						if (errno == EINTR)
+							continue;
+						throw ReadError(errno);
+					}
+					if (result == 0)
+						throw ReadError(EIO);
+					readBytes += result;
+				}
+				m_device.SendPartialFile(id, position, &data[0], length);
+				position += length;
 			}
-			catch(...)
+		}
+	}
+	catch(...)
+	{
+		try
+		{
+			m_device.EndEditFile(id);
+		}
+		catch(std::exception&)
+		{
+		}
+		throw;
+	}
+	m_device.EndEditFile(id);
+
+	// The parts of the remote file that weren't copied are still good.
+	MtpFileInfo info = m_device.GetFileInfo(id);
+	m_dirty.clear();
+	m_truncatedTo = std::numeric_limits<off_t>::max();
+	LockMutex fetchLock(m_fetchMutex);
+	LockMutex stateLock(m_stateMutex);
+	m_present.resize((size + localCopyBlockSize - 1) / localCopyBlockSize, true);
+	m_claimed.resize(m_present.size(), false);
+	m_presentCount = std::count(m_present.begin(), m_present.end(), true);
+	m_remoteSize = size;
+	m_remoteModified = info.modificationdate;
+	m_stored = false;
+	if (m_presentCount == m_present.size())
+		m_fetched = true;
+	return true;
+}
+
+bool MtpLocalFileCopy::partialReads()
+{
+	LockMutex stateLock(m_stateMutex);
+
+	return m_partialReads;
+}
+
+void MtpLocalFileCopy::noPartialReads()
+{
+	LockMutex stateLock(m_stateMutex);
+
+	m_partialReads = false;
+}
+
+/*
+ * Makes sure the range has been copied from the device, copying just the
+ * blocks it covers if the device can send parts of files. Anything past
+ * the end of the file reads as the end of the file.
+ */
+void MtpLocalFileCopy::fetchRange(off_t offset, size_t size)
+{
+	{
+		// m_fetchMutex can be held for a while, by a thread waiting on the
+		// device for instance, which blocks already copied needn't wait for.
+		LockMutex stateLock(m_stateMutex);
+
+		if (rangePresent(offset, size))
+			return;
+	}
+	LockMutex lock(m_fetchMutex);
+
+	checkRemote();
+	if (m_fetched)
+		return;
+	if (partialReads() && !m_downloading)
+	{
+		try
+		{
+			if ((uint64_t) offset < m_remoteSize)
+				fetchBlocks(offset / localCopyBlockSize,
+						std::min((size_t) ((offset + size + localCopyBlockSize - 1) / localCopyBlockSize),
+						m_present.size()));
+			return;
+		}
+		catch(MtpDeviceDisconnected&)
+		{
+			throw;
+		}
+		catch(MtpError&)
+		{
+			// Devices without the 64 bit version of GetPartialObject can't read
+			// past 4GB, for one. Copy the whole file instead from now on.
+			noPartialReads();
+		}
+	}
+	// Wait just for the range to be downloaded, not the whole file.
+	startDownload();
+	waitForDownload(std::min((uint64_t) (offset + size), m_remoteSize));
+}
+
+/*
+ * True if the range can be read from the local copy as it is, without
+ * looking at the remote file. Called with m_stateMutex held.
+ */
+bool MtpLocalFileCopy::rangePresent(off_t offset, size_t size)
+{
+	if (m_checkRemote)
+		return false;
+	if (m_fetched)
+		return true;
+	if (m_remoteInfoId != m_remoteId)
+		return false;
+	size_t last = std::min((size_t) ((offset + size + localCopyBlockSize - 1) / localCopyBlockSize),
+			m_present.size());
+	for(size_t block = offset / localCopyBlockSize; block < last; block++)
+	{
+		if (!m_present[block])
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Copies the blocks from first up to last that haven't been copied yet.
+ * Called with m_fetchMutex held exactly once. The blocks are claimed, and
+ * the lock released while they are read from the device, so other threads
+ * can use the rest of the copy meanwhile. Blocks another thread has claimed
+ * are waited for.
+ */
+void MtpLocalFileCopy::fetchBlocks(size_t first, size_t last)
+{
+	// Neighbouring missing blocks are read together, a few at a time.
+	const size_t maxBlocksPerRead = 4;
+	std::vector<char> data;
+	for(size_t block = first; block < std::min(last, m_present.size());)
+	{
+		if (m_present[block])
+		{
+			block++;
+			continue;
+		}
+		if (m_claimed[block])
+		{
+			m_blocksArrived.Wait(m_fetchMutex);
+			continue;
+		}
+		size_t end = block + 1;
+		while((end < std::min(last, m_present.size())) && !m_present[end] && !m_claimed[end] &&
+				(end - block < maxBlocksPerRead))
+			end++;
+
+		uint64_t start = (uint64_t) block * localCopyBlockSize;
+		size_t size = std::min((uint64_t) (end - block) * localCopyBlockSize, m_remoteSize - start);
+		unsigned int version = m_presentVersion;
+		std::fill(m_claimed.begin() + block, m_claimed.begin() + end, true);
+		data.resize(size);
+		m_fetchMutex.Unlock();
+		try
+		{
+			size = m_device.GetPartialFile(remoteId(), start, size, &data[0]);
+		}
+		catch(...)
+		{
+			m_fetchMutex.Lock();
+			if (version == m_presentVersion)
+				std::fill(m_claimed.begin() + block, m_claimed.begin() + end, false);
+			m_blocksArrived.Broadcast();
+			throw;
+		}
+		m_fetchMutex.Lock();
+		m_blocksArrived.Broadcast();
+		if (version != m_presentVersion)
+		{
+			// The copy was started over while the blocks were being read.
+			continue;
+		}
+		std::fill(m_claimed.begin() + block, m_claimed.begin() + end, false);
+		// A download going on may have got to some of them first, and they
+		// may have been changed since.
+		for(; block < end; block++)
+		{
+			size_t from = std::min((size_t) ((uint64_t) block * localCopyBlockSize - start), size);
+			size_t to = std::min(from + localCopyBlockSize, size);
+			if (m_present[block])
+				continue;
+			for(size_t wroteBytes = from; wroteBytes < to;)
 			{
-				fclose(m_localFile);
-				m_localFile=0;
-				throw;
+				ssize_t result = pwrite(m_localFile.FileNo(), &data[wroteBytes], to - wroteBytes, start + wroteBytes);
+				if (result == -1)
+				{
+					if (errno == EINTR)
+						continue;
+					throw WriteError(errno);
+				}
+				wroteBytes += result;
 			}
+			LockMutex stateLock(m_stateMutex);
+			m_present[block] = true;
+			m_presentCount++;
+		}
+	}
+	if (m_presentCount == m_present.size())
+	{
+		LockMutex stateLock(m_stateMutex);
+		m_fetched = true;
+	}
+}
+
+/*
+ * Starts the record of which blocks have been copied over, with all of them
+ * copied or none. Called with m_fetchMutex held.
+ */
+void MtpLocalFileCopy::resetPresent(size_t blocks, bool present)
+{
+	LockMutex stateLock(m_stateMutex);
+
+	m_present.assign(blocks, present);
+	m_presentCount = present ? blocks : 0;
+	m_claimed.assign(blocks, false);
+	m_presentVersion++;
+	m_blocksArrived.Broadcast();
+}
+
+/*
+ * Looks up the size of the remote file the first time it is needed, and
+ * again when a kept copy is reopened, in which case what was copied is
+ * dropped if the remote file has changed in the meantime. Called with
+ * m_fetchMutex held.
+ */
+void MtpLocalFileCopy::checkRemote()
+{
+	if (m_downloading)
+		return;
+	uint32_t id;
+	{
+		LockMutex stateLock(m_stateMutex);
+
+		// Once the contents are ours, or changed, there's nothing to check.
+		// Nor is there once a write back deleted the remote file, as the local
+		// copy is then all there is.
+		if (m_remoteDeleted || (!m_checkRemote && (m_fetched || (m_remoteInfoId == m_remoteId))))
+			return;
+		id = m_remoteId;
+	}
+	MtpFileInfo info = m_device.GetFileInfo(id);
+	if ((m_remoteInfoId != id) || (info.filesize != m_remoteSize) ||
+			(info.modificationdate != m_remoteModified))
+	{
+		// The sparse local copy reads as zeros where nothing has been copied yet.
+		if (ftruncate(m_localFile.FileNo(), 0) || ftruncate(m_localFile.FileNo(), info.filesize))
+			throw WriteError(errno);
+		resetPresent((info.filesize + localCopyBlockSize - 1) / localCopyBlockSize, false);
+		m_stored = false;
+		MtpDiskCache* diskCache = m_cache.diskCache();
+		if (diskCache && (info.filesize > 0) && diskCache->fill(info.storageId, id, info.name,
+				info.filesize, info.modificationdate, m_localFile.FileNo()))
+		{
+			resetPresent(m_present.size(), true);
+			m_stored = true;
+		}
+		LockMutex stateLock(m_stateMutex);
+		m_fetched = (m_presentCount == m_present.size());
+	}
+	m_remoteStorageId = info.storageId;
+	m_remoteName = info.name;
+	m_remoteSize = info.filesize;
+	m_remoteModified = info.modificationdate;
+	LockMutex stateLock(m_stateMutex);
+	m_remoteInfoId = id;
+	m_checkRemote = false;
+}
+
+void MtpLocalFileCopy::reopened()
+{
+	LockMutex stateLock(m_stateMutex);
+
+	m_checkRemote = true;
+}
+
+bool MtpLocalFileCopy::hasRemoteContents()
+{
+	LockMutex fetchLock(m_fetchMutex);
+	LockMutex stateLock(m_stateMutex);
+
+	return !m_discarded && !m_needWriteBack && !m_writingBack && !m_stream &&
+			(m_remoteInfoId == m_remoteId) && (m_fetched || (m_presentCount > 0));
+}
+
+bool MtpLocalFileCopy::isNew()
+{
+	LockMutex stateLock(m_stateMutex);
+
+	return m_created;
+}
+
+void MtpLocalFileCopy::store()
+{
+	MtpDiskCache* diskCache = m_cache.diskCache();
+	if (!diskCache)
+		return;
+	// Keeps writes, and anything else changing the copy, out until it is stored.
+	LockMutex lock(m_mutex);
+	LockMutex fetchLock(m_fetchMutex);
+
+	if (m_stored || m_downloading || !m_fetched || !hasRemoteContents())
+		return;
+	diskCache->store(m_remoteStorageId, m_remoteInfoId, m_remoteName, m_remoteSize,
+			m_remoteModified, m_localFile.FileNo());
+	m_stored = true;
+}
+
+off_t MtpLocalFileCopy::cachedBytes()
+{
+	struct stat tempInfo;
+	if (fstat(m_localFile.FileNo(), &tempInfo))
+			throw ReadError(errno);
+	return tempInfo.st_blocks * 512;
+}
+
+void MtpLocalFileCopy::setCreated()
+{
+	LockMutex lock(m_mutex);
+	LockMutex fetchLock(m_fetchMutex);
+	LockMutex stateLock(m_stateMutex);
+
+	m_fetched = true;
+	m_created = true;
+}
+
+bool MtpLocalFileCopy::streaming()
+{
+	LockMutex stateLock(m_stateMutex);
+
+	return m_stream.get() != 0;
+}
+
+/*
+ * Stops streaming the file to the device. If commit is true, and the upload
+ * can be finished, the remote file is what was streamed. Otherwise the
+ * upload is taken away again and the local copy, which has everything
+ * written, is written back later instead. Called with m_mutex held.
+ */
+void MtpLocalFileCopy::endStream(bool commit)
+{
+	uint32_t oldId = remoteId();
+	uint32_t newId = 0;
+	uint32_t parentId = 0;
+	if (commit)
+	{
+		try
+		{
+			newId = m_stream->finish();
+			parentId = m_stream->parentId();
+		}
+		catch(...)
+		{
+			discardStream();
+			throw;
+		}
+	}
+	if (!newId)
+	{
+		discardStream();
+		return;
+	}
+	{
+		LockMutex stateLock(m_stateMutex);
+		m_stream.reset();
+		m_needWriteBack = false;
+		m_remoteId = newId;
+	}
+	if (!m_destroying)
+	{
+		m_cache.renameFile(oldId, newId);
+		m_cache.fileWrittenBack(m_device, parentId, oldId, newId);
+	}
+}
+
+/*
+ * Called with m_mutex held.
+ */
+void MtpLocalFileCopy::discardStream()
+{
+	bool remoteExists = m_stream->discard();
+	LockMutex stateLock(m_stateMutex);
+	if (!remoteExists)
+	{
+		// As when a write back is interrupted, the local copy is all there is.
+		m_remoteDeleted = true;
+		m_deletedRemote = m_stream->replaced();
+	}
+	m_stream.reset();
+}
+
+uint32_t MtpLocalFileCopy::writeBack()
+{
+	LockMutex lock(m_mutex);
+
+	if (m_stream)
+		endStream(true);
+	uint32_t remoteId;
+	{
+		LockMutex stateLock(m_stateMutex);
+
+		if (!m_needWriteBack)
+			return m_remoteId;
+		m_needWriteBack = false;
+		m_writingBack = true;
+		remoteId = m_remoteId;
+	}
+	try
+	{
+		if (!m_remoteDeleted && writeBackInPlace(remoteId))
+		{
+			LockMutex stateLock(m_stateMutex);
+			m_writingBack = false;
+			m_writeBackError = std::exception_ptr();
+			return m_remoteId;
+		}
+		fetch();
+		if (lseek(m_localFile.FileNo(), 0, SEEK_SET) == -1)
+			throw WriteError(errno);
+		struct stat tempInfo;
+		if (fstat(m_localFile.FileNo(), &tempInfo))
+			throw ReadError(errno);
+		if (!m_remoteDeleted)
+		{
+			MtpFileInfo remote = m_device.GetFileInfo(remoteId);
+			m_device.DeleteObject(remote);
+			// Until the new file is sent, the local copy is all there is, and
+			// trying again means sending it as what was deleted.
+			LockMutex stateLock(m_stateMutex);
+			m_deletedRemote = remote;
+			m_remoteDeleted = true;
+		}
+		NewLIBMTPFile newFile(m_deletedRemote.name, m_deletedRemote.parentId, m_deletedRemote.storageId, tempInfo.st_size);
+		m_device.SendFile(newFile, m_localFile.FileNo());
+		{
+			LockMutex stateLock(m_stateMutex);
+			m_remoteDeleted = false;
 		}
+		remoteId = ((LIBMTP_file_t*)newFile)->item_id;
+		m_dirty.clear();
+		m_truncatedTo = std::numeric_limits<off_t>::max();
 
-		fclose(m_localFile);
-		m_localFile = 0;
+		// The new remote file is the local copy, so later changes can be made in place.
+		MtpFileInfo sentInfo = m_device.GetFileInfo(remoteId);
+		LockMutex fetchLock(m_fetchMutex);
+		resetPresent((tempInfo.st_size + localCopyBlockSize - 1) / localCopyBlockSize, true);
+		{
+			LockMutex stateLock(m_stateMutex);
+			m_remoteInfoId = remoteId;
+		}
+		m_remoteStorageId = sentInfo.storageId;
+		m_remoteName = sentInfo.name;
+		m_remoteSize = tempInfo.st_size;
+		m_remoteModified = sentInfo.modificationdate;
+		m_stored = false;
 	}
+	catch(...)
+	{
+		// Keep the changes, so they can be written back later.
+		LockMutex stateLock(m_stateMutex);
+		m_writingBack = false;
+		m_needWriteBack = true;
+		throw;
+	}
+	LockMutex stateLock(m_stateMutex);
+	m_writingBack = false;
+	m_writeBackError = std::exception_ptr();
+	m_remoteId = remoteId;
 	return m_remoteId;
 }
 
+uint32_t MtpLocalFileCopy::discard()
+{
+	LockMutex lock(m_mutex);
+
+	bool remoteExists = true;
+	if (m_stream)
+		remoteExists = m_stream->discard();
+	LockMutex stateLock(m_stateMutex);
+	m_stream.reset();
+	m_created = false;
+	m_discarded = true;
+	m_needWriteBack = false;
+	m_writeBackError = std::exception_ptr();
+	return (remoteExists && !m_remoteDeleted) ? m_remoteId : 0;
+}
+
+void MtpLocalFileCopy::writeBackFailed(std::exception_ptr error)
+{
+	LockMutex stateLock(m_stateMutex);
+
+	m_writeBackError = error;
+}
+
+void MtpLocalFileCopy::reportWriteBackError()
+{
+	std::exception_ptr error;
+	{
+		LockMutex stateLock(m_stateMutex);
+
+		error = m_writeBackError;
+		m_writeBackError = std::exception_ptr();
+	}
+	if (error)
+		std::rethrow_exception(error);
+}
+
+void MtpLocalFileCopy::changed()
+{
+	LockMutex stateLock(m_stateMutex);
+
+	m_created = false;
+	m_modified = time(0);
+	if (!m_discarded)
+		m_needWriteBack = true;
+}
+
 off_t MtpLocalFileCopy::getSize()
 {
-	fflush(m_localFile);
+	{
+		LockMutex stateLock(m_stateMutex);
+
+		if (m_stream)
+			return m_stream->size();
+	}
 	struct stat tempInfo;
-	if (fstat(fileno(m_localFile), &tempInfo))
+	if (fstat(m_localFile.FileNo(), &tempInfo))
 			throw ReadError(errno);
 	return tempInfo.st_size;
 }
 
-void MtpLocalFileCopy::seek(long offset)
+time_t MtpLocalFileCopy::modificationTime()
+{
+	LockMutex stateLock(m_stateMutex);
+
+	return m_modified;
+}
+
+bool MtpLocalFileCopy::isDirty()
+{
+	LockMutex stateLock(m_stateMutex);
+
+	return m_needWriteBack || m_writingBack;
+}
+
+uint32_t MtpLocalFileCopy::remoteId()
+{
+	LockMutex stateLock(m_stateMutex);
+
+	return m_remoteId;
+}
+
+bool MtpLocalFileCopy::remoteDeleted(MtpFileInfo& info)
+{
+	LockMutex stateLock(m_stateMutex);
+
+	if (m_remoteDeleted)
+		info = m_deletedRemote;
+	return m_remoteDeleted;
+}
+
+MtpDevice& MtpLocalFileCopy::device()
+{
+	return m_device;
+}
+
+void MtpLocalFileCopy::setRemoteId(uint32_t id)
+{
+	LockMutex stateLock(m_stateMutex);
+
+	m_remoteId = id;
+}
+
+void MtpLocalFileCopy::addHandle()
+{
+	LockMutex stateLock(m_stateMutex);
+
+	m_handles++;
+}
+
+void MtpLocalFileCopy::removeHandle()
+{
+	LockMutex stateLock(m_stateMutex);
+
+	m_handles--;
+}
+
+bool MtpLocalFileCopy::hasHandles()
 {
-	if (fseek(m_localFile, offset, SEEK_SET))
-		throw MtpFilesystemErrorWithErrorCode(errno, "seek failed");
+	LockMutex stateLock(m_stateMutex);
+
+	return m_handles > 0;
 }
 
-size_t MtpLocalFileCopy::write(const void* ptr, size_t size)
+size_t MtpLocalFileCopy::write(const void* ptr, size_t size, off_t offset)
 {
-	size_t wroteBytes = fwrite(ptr, 1, size, m_localFile);
-	m_needWriteBack = true;
-	if (wroteBytes!= size)
-		if (ferror(m_localFile))
+	LockMutex lock(m_mutex);
+
+	if (m_stream && !m_stream->write(ptr, size, offset))
+		endStream(false);
+	// While streaming, the local copy has all of the file that has been
+	// written, to fall back on.
+	if (!m_stream)
+		fetchForWrite(offset, size);
+
+	size_t wroteBytes = 0;
+	while(wroteBytes < size)
+	{
+		ssize_t result = pwrite(m_localFile.FileNo(), (const char*) ptr + wroteBytes, size - wroteBytes, offset + wroteBytes);
+		if (result == -1)
+		{
+			if (errno == EINTR)
+				continue;
 			throw WriteError(errno);
+		}
+		wroteBytes += result;
+	}
+	if (!m_stream)
+		addDirty(offset, offset + wroteBytes);
+	changed();
 	return wroteBytes;
 }
 
-size_t MtpLocalFileCopy::read(void* ptr, size_t size)
+size_t MtpLocalFileCopy::read(void* ptr, size_t size, off_t offset)
 {
+	fetchRange(offset, size);
+	// No lock needed since pread doesn't use the file position.
 
-	size_t readBytes = fread(ptr, 1, size, m_localFile);
-	if (readBytes!= size)
-		if (ferror(m_localFile))
+	size_t readBytes = 0;
+	while(readBytes < size)
+	{
+		ssize_t result = pread(m_localFile.FileNo(), (char*) ptr + readBytes, size - readBytes, offset + readBytes);
+		if (result == -1)
+		{
+			if (errno == EINTR)
+				continue;
 			throw ReadError(errno);
+		}
+		if (result == 0)
+			break;
+		readBytes += result;
+	}
 	return readBytes;
 }
 
+#if FUSE_VERSION >= 29
+void MtpLocalFileCopy::readBuf(struct fuse_bufvec& buf, off_t offset)
+{
+	fetchRange(offset, buf.buf[0].size);
+
+	buf.buf[0].flags = (enum fuse_buf_flags) (FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY);
+	buf.buf[0].fd = m_localFile.FileNo();
+	buf.buf[0].pos = offset;
+}
+
+size_t MtpLocalFileCopy::writeBuf(struct fuse_bufvec& buf, off_t offset)
+{
+	LockMutex lock(m_mutex);
+
+	if (m_stream)
+	{
+		std::vector<char> data(fuse_buf_size(&buf));
+		struct fuse_bufvec dest = FUSE_BUFVEC_INIT(data.size());
+		dest.buf[0].mem = &data[0];
+		ssize_t gotBytes = fuse_buf_copy(&dest, &buf, (enum fuse_buf_copy_flags) 0);
+		if (gotBytes < 0)
+			throw WriteError(-gotBytes);
+		return write(&data[0], gotBytes, offset);
+	}
+	fetchForWrite(offset, fuse_buf_size(&buf));
+
+	struct fuse_bufvec dest = FUSE_BUFVEC_INIT(fuse_buf_size(&buf));
+	dest.buf[0].flags = (enum fuse_buf_flags) (FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY);
+	dest.buf[0].fd = m_localFile.FileNo();
+	dest.buf[0].pos = offset;
+	ssize_t wroteBytes = fuse_buf_copy(&dest, &buf, (enum fuse_buf_copy_flags) 0);
+	if (wroteBytes < 0)
+		throw WriteError(-wroteBytes);
+	addDirty(offset, offset + wroteBytes);
+	changed();
+	return wroteBytes;
+}
+#endif
+
 void MtpLocalFileCopy::truncate(off_t length)
 {
-	if (ftruncate(fileno(m_localFile), length))
+	LockMutex lock(m_mutex);
+
+	if (m_stream)
+	{
+		if (length == getSize())
+			return;
+		endStream(false);
+	}
+	// Only the block the file now ends in is needed.
+	fetchForWrite(length, 0);
+
+	if (ftruncate(m_localFile.FileNo(), length))
+		throw WriteError(errno);
+	truncated(length);
+	changed();
+}
+
+void MtpLocalFileCopy::allocate(off_t length)
+{
+	LockMutex lock(m_mutex);
+
+	if (m_stream)
+	{
+		if (length <= getSize())
+			return;
+		endStream(false);
+	}
+	else if (m_created && (length > 0))
+	{
+		// Now that we know how big the new file will be, it can be sent as it is written.
+		if (ftruncate(m_localFile.FileNo(), length))
+			throw WriteError(errno);
+		std::unique_ptr<MtpUploadStream> stream(new MtpUploadStream(m_device, remoteId(), length));
+		LockMutex stateLock(m_stateMutex);
+		m_stream = std::move(stream);
+		m_created = false;
+		m_modified = time(0);
+		m_needWriteBack = true;
+		return;
+	}
+	fetchForWrite(getSize(), 0);
+	if (length <= getSize())
+		return;
+	if (ftruncate(m_localFile.FileNo(), length))
 		throw WriteError(errno);
-	m_needWriteBack = true;
+	changed();
 }
 
 void MtpLocalFileCopy::CopyTo(MtpDevice& device, NewLIBMTPFile& destination)
 {
-	fflush(m_localFile);
-	if (fseek(m_localFile, 0, SEEK_SET))
+	LockMutex lock(m_mutex);
+
+	if (m_stream)
+		endStream(true);
+	fetch();
+
+	if (lseek(m_localFile.FileNo(), 0, SEEK_SET) == -1)
 		throw WriteError(errno);
-	struct stat tempInfo;
-	if (fstat(fileno(m_localFile), &tempInfo))
-			throw ReadError(errno);
 
-	device.SendFile(destination, fileno(m_localFile));
+	device.SendFile(destination, m_localFile.FileNo());
 }
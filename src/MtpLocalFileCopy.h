@@ -23,26 +23,183 @@
 #define MTPLOCALFILECOPY_H_
 
 #include "MtpDevice.h"
+#include "MtpUploadStream.h"
+#include "Mutex.h"
+#include "TemporaryFile.h"
+#include "FuseHeader.h"
+#include <exception>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <pthread.h>
 
+class MtpMetadataCache;
+
+/*
+ * All the public methods are safe to call from multiple threads. Reads and
+ * writes of different local copies never block each other, and only fetch()
+ * and writeBack() have to wait for the device. Writes to a copy wait while it
+ * is being written back, but the state queries (isDirty, remoteId and the
+ * handle count) don't.
+ *
+ * A file we have just created whose size is given before anything is written
+ * to it, by allocate, is sent to the device as it is written by an
+ * MtpUploadStream. The writes go to the local copy as well, so if the file
+ * isn't written from start to end, the upload is taken away again before it
+ * is complete, and the local copy is written back as usual instead. The
+ * cache is told about the new id the file gets when the upload completes.
+ *
+ * If the device can send parts of files, the local copy is a sparse file
+ * that is filled in a block at a time as it is read, so reading a little of
+ * a big file only transfers that little. The rest is only copied once the
+ * file is changed. Otherwise the whole file is copied by a thread of its
+ * own, and reads only wait for the part they want to arrive.
+ *
+ * The ranges written to are tracked. If the device can also change files
+ * in place (Android's edit object extensions), only they, and any change of
+ * size, are sent on write back, and the file keeps its id. Otherwise the
+ * whole file is sent again as a new file.
+ */
 class MtpLocalFileCopy
 {
 public:
-	MtpLocalFileCopy(MtpDevice& device, uint32_t id);
+	MtpLocalFileCopy(MtpMetadataCache& cache, MtpDevice& device, uint32_t id);
 	~MtpLocalFileCopy();
 
 	/*
-	 * Close the local copy and write changes back to the remote if needed.
-	 * The return value is the id for the remote file, which may have
+	 * Copy the remote file contents into the local copy, if that hasn't
+	 * already been done. If another thread is already fetching the file
+	 * this waits for it to finish.
+	 */
+	void fetch();
+
+	/*
+	 * The remote file was just created empty, so there's nothing to fetch.
+	 */
+	void setCreated();
+
+	/*
+	 * True if the copy holds (some of) the contents of the remote file and
+	 * no changes, so it is worth keeping for the next time the file is opened.
+	 */
+	bool hasRemoteContents();
+
+	/*
+	 * True if the remote file was just created and nothing has been written
+	 * to it since, so giving its size to allocate can still stream it.
+	 */
+	bool isNew();
+
+	/*
+	 * A kept copy is being used again. The remote file is checked for changes
+	 * before anything is read from the copy.
+	 */
+	void reopened();
+
+	/*
+	 * Local disk space used by the copy.
+	 */
+	off_t cachedBytes();
+
+	/*
+	 * Puts a copy of the file in the disk cache, if there is one, and the
+	 * copy holds the whole of the remote file and no changes.
+	 */
+	void store();
+
+	/*
+	 * Write changes back to the remote if needed. The local copy stays
+	 * open. The return value is the id for the remote file, which may have
 	 * changed if we had to write back changes.
 	 */
-	uint32_t close();
+	uint32_t writeBack();
+
+	/*
+	 * The remote file is being deleted. Drops any changes that haven't been
+	 * written back and stops later ones from being written back, waiting for
+	 * a write back already in progress to finish first. Returns the id of
+	 * the remote file, or 0 if there is nothing left of it on the device,
+	 * because it was being streamed there or a failed write back deleted it.
+	 */
+	uint32_t discard();
+
+	/*
+	 * Writing back in the background failed with error. It is kept until
+	 * reportWriteBackError rethrows it, so the next open, flush or fsync of
+	 * the file fails with it, or until the changes are written back after all.
+	 */
+	void writeBackFailed(std::exception_ptr error);
+	void reportWriteBackError();
 
 	off_t getSize();
 
-	void seek(long offset);
-	size_t write(const void* ptr, size_t size);
+	/*
+	 * When the last change was made.
+	 */
+	time_t modificationTime();
+
+	/*
+	 * True if there are changes that haven't made it to the device yet,
+	 * including while they are being written back.
+	 */
+	bool isDirty();
+
+	uint32_t remoteId();
+
+	/*
+	 * True if the remote file was deleted and the local copy hasn't been
+	 * sent in its place yet, in which case info is set to what was deleted.
+	 */
+	bool remoteDeleted(MtpFileInfo& info);
+
+	/*
+	 * True while the file is being sent to the device as it is written,
+	 * after allocate gave its size.
+	 */
+	bool streaming();
+
+	MtpDevice& device();
+
+	/*
+	 * The remote file was replaced by a copy with a different id, for
+	 * example by a rename.
+	 */
+	void setRemoteId(uint32_t id);
+
+	/*
+	 * Count of fuse file handles using this copy.
+	 */
+	void addHandle();
+	void removeHandle();
+	bool hasHandles();
+
+	/*
+	 * Copy the range from the device ahead of it being read, if the device
+	 * can send parts of files.
+	 */
+	void prefetch(off_t offset, size_t size);
+
+	size_t write(const void* ptr, size_t size, off_t offset);
 	void truncate(off_t length);
-	size_t read(void* ptr, size_t size);
+	size_t read(void* ptr, size_t size, off_t offset);
+
+	/*
+	 * Make the file at least length bytes long.
+	 */
+	void allocate(off_t length);
+
+#if FUSE_VERSION >= 29
+	/*
+	 * Point a fuse buffer at the local copy, so fuse can splice the data
+	 * straight from the temporary file without copying it through our memory.
+	 * While the file is being streamed to the device readBuf fills in a
+	 * malloc'ed memory buffer instead, which the caller has to free, as
+	 * fuse_free_buf does.
+	 */
+	void readBuf(struct fuse_bufvec& buf, off_t offset);
+	size_t writeBuf(struct fuse_bufvec& buf, off_t offset);
+#endif
 
 	void CopyTo(MtpDevice& device, NewLIBMTPFile& destination);
 
@@ -50,10 +207,90 @@ private:
 	MtpLocalFileCopy(const MtpLocalFileCopy&);
 	MtpLocalFileCopy& operator=(const MtpLocalFileCopy&);
 
+	void changed();
+	void endStream(bool commit);
+	void discardStream();
+	bool partialReads();
+	void noPartialReads();
+	void fetchRange(off_t offset, size_t size);
+	bool rangePresent(off_t offset, size_t size);
+	void fetchBlocks(size_t first, size_t last);
+	void resetPresent(size_t blocks, bool present);
+	void checkRemote();
+	void fetchForWrite(off_t offset, size_t size);
+	void addDirty(off_t start, off_t end);
+	void truncated(off_t length);
+	bool writeBackInPlace(uint32_t id);
+	void startDownload();
+	void waitForDownload(uint64_t end);
+	static void* downloadMain(void* localFile);
+	void download();
+	static uint16_t putData(void* params, void* priv, uint32_t sendlen, unsigned char* data, uint32_t* putlen);
+
+	MtpMetadataCache&	m_cache;
 	MtpDevice&			m_device;
-	FILE*				m_localFile;
+	TemporaryFile		m_localFile;
 	uint32_t			m_remoteId;
 	bool				m_needWriteBack;
+	bool				m_writingBack;
+	bool				m_discarded;
+	// A write back deleted the remote file, and failed to send the new one.
+	// Protected by m_mutex, and changed with m_stateMutex held too, as is
+	// m_deletedRemote.
+	bool				m_remoteDeleted;
+	MtpFileInfo			m_deletedRemote;
+	bool				m_fetched;
+	// The copy is filled in block by block as it is read.
+	bool				m_partialReads;
+	// Which blocks have been copied, while m_fetched is false. Changed with
+	// both m_fetchMutex and m_stateMutex held, as is m_remoteInfoId, so a read
+	// can check them without waiting for m_fetchMutex.
+	std::vector<bool>	m_present;
+	size_t				m_presentCount;
+	// Blocks being read from the device by some thread, with m_fetchMutex
+	// released. m_presentVersion changes whenever m_present is started over,
+	// so blocks claimed before then aren't marked as copied.
+	std::vector<bool>	m_claimed;
+	unsigned int		m_presentVersion;
+	ConditionVariable	m_blocksArrived;
+	// The remote file the copy was taken from, as it was then.
+	uint32_t			m_remoteInfoId;
+	uint32_t			m_remoteStorageId;
+	std::string			m_remoteName;
+	uint64_t			m_remoteSize;
+	time_t				m_remoteModified;
+	// The disk cache has a copy of that.
+	bool				m_stored;
+	bool				m_checkRemote;
+	// Nothing has been written to the new empty file.
+	bool				m_created;
+	bool				m_destroying;
+	unsigned int		m_handles;
+	time_t				m_modified;
+	std::unique_ptr<MtpUploadStream>	m_stream;
+	std::exception_ptr	m_writeBackError;
+	// Ranges changed since the last write back, by start, and the shortest
+	// the file has been cut to. Protected by m_mutex.
+	std::map<off_t, off_t>	m_dirty;
+	off_t				m_truncatedTo;
+	// Copying the whole file in the background. Protected by m_fetchMutex.
+	bool				m_downloading;
+	bool				m_downloadStarted;
+	bool				m_cancelDownload;
+	// How much of the file has arrived.
+	uint64_t			m_downloaded;
+	std::exception_ptr	m_downloadError;
+	pthread_t			m_downloadThread;
+	ConditionVariable	m_downloadProgress;
+	// Held while the contents are changed or written back.
+	RecursiveMutex		m_mutex;
+	// Held while what has been copied from the device is looked at or
+	// changed, but not while blocks are read from it on their own.
+	RecursiveMutex		m_fetchMutex;
+	// Protects the remote id, the dirty flags, the handle count, the stream
+	// pointer, the write back error and m_checkRemote. m_fetched is changed with both this and
+	// m_fetchMutex held.
+	RecursiveMutex		m_stateMutex;
 };
 
 
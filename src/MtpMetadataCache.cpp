@@ -22,96 +22,790 @@
 
 #include <time.h>
 #include <assert.h>
+#include <string.h>
+#include <algorithm>
+
+// Most local disk space, and temporary files, used by copies of closed files.
+static const off_t closedFilesMaxBytes = 256 * 1024 * 1024;
+static const size_t closedFilesMaxCount = 32;
+// Allocated for each node of the cache's lists and maps, on top of what's in it.
+static const size_t nodeOverheadBytes = 2 * sizeof(void*) + 16;
 
 MtpMetadataCacheFiller::~MtpMetadataCacheFiller()
 {
 
 }
 
-MtpMetadataCache::MtpMetadataCache()
+std::unique_ptr<MtpMetadataCacheFiller> MtpMetadataCacheFiller::cloneFiller()
+{
+	return std::unique_ptr<MtpMetadataCacheFiller>();
+}
+
+MtpFileIdListener::~MtpFileIdListener()
+{
+}
+
+MtpMetadataCache::MtpMetadataCache() : m_fileIdListener(0), m_generation(0), m_timeout(5), m_backgroundRefresh(false),
+	m_maxBytes(64 * 1024 * 1024), m_bytes(0), m_snapshotDevice(0), m_snapshotChecker(*this), m_refreshQueue(*this), m_writeBackQueue(*this)
 {
 
 }
 MtpMetadataCache::~MtpMetadataCache()
 {
-	for(local_file_cache_type::iterator i = m_localFileCache.begin(); i != m_localFileCache.end(); i++)
+}
+
+
+
+std::shared_ptr<const MtpNodeMetadata> MtpMetadataCache::getItem(uint32_t id, MtpMetadataCacheFiller& source)
+{
+	unsigned long generation;
+	{
+		LockMutex lock(m_mutex);
+
+		clearOld();
+		CacheEntry entry;
+		bool found = findEntry(id, entry);
+		if (found && !expired(entry, time(0)))
+		{
+			touchItem(id);
+			m_stats.hits++;
+			return entry.data;
+		}
+		if (found && m_backgroundRefresh)
+		{
+			std::unique_ptr<MtpMetadataCacheFiller> refresher = source.cloneFiller();
+			if (refresher)
+			{
+				m_refreshQueue.add(id, std::move(refresher));
+				touchItem(id);
+				m_stats.staleHits++;
+				return entry.data;
+			}
+		}
+		if (found)
+		{
+			// Pinned items outlive their timeout, as clearOld leaves them be.
+			cache_lookup_type::iterator i = m_cacheLookup.find(id);
+			if (i != m_cacheLookup.end())
+				eraseItem(i);
+		}
+		m_stats.misses++;
+		generation = m_generation;
+	}
+
+	std::shared_ptr<MtpNodeMetadata> data(new MtpNodeMetadata);
+	bool fromSnapshot = m_snapshot && m_snapshot->getListing(id, *data);
+	if (fromSnapshot)
+		m_snapshotChecker.start(*m_snapshotDevice, *m_snapshot);
+	else
+		*data = source.getMetadata();
+	assert(data->self.id == id);
+	data->children.finish();
+	addItem(data, generation, fromSnapshot);
+	return data;
+}
+
+void MtpMetadataCache::refreshItem(uint32_t id, MtpMetadataCacheFiller& source)
+{
+	unsigned long generation;
+	{
+		LockMutex lock(m_mutex);
+
+		generation = m_generation;
+	}
+	std::shared_ptr<MtpNodeMetadata> data(new MtpNodeMetadata(source.getMetadata()));
+	assert(data->self.id == id);
+	data->children.finish();
+	addItem(data, generation, false);
+}
+
+void MtpMetadataCache::refreshQueued(uint32_t id, MtpMetadataCacheFiller& source)
+{
+	{
+		LockMutex lock(m_mutex);
+
+		// It may have been cleared since it was queued, or refreshed along
+		// with the folder it is in.
+		CacheEntry entry;
+		if (!findEntry(id, entry) || !expired(entry, time(0)))
+			return;
+	}
+	refreshItem(id, source);
+
+	LockMutex lock(m_mutex);
+	m_stats.refreshes++;
+}
+
+/*
+ * Puts what getItem or refreshItem fetched in the cache, unless the cache
+ * was cleared while it was being fetched.
+ */
+void MtpMetadataCache::addItem(const std::shared_ptr<const MtpNodeMetadata>& data, unsigned long generation, bool fromSnapshot)
+{
+	CacheEntry newData;
+	newData.data = data;
+	newData.whenCreated = time(0);
+	newData.bytes = entryBytes(*data);
+	newData.fromSnapshot = fromSnapshot;
+
+	LockMutex lock(m_mutex);
+	if (generation != m_generation)
+	{
+		// Might be out of date already, so it mustn't be saved for later either.
+		if (m_snapshot && !fromSnapshot)
+			m_snapshot->changed(data->self.id);
+	}
+	else
+	{
+		putItem(newData);
+		if (m_snapshot && !fromSnapshot)
+			m_snapshot->listed(data);
+		noteFileLocations(*data, 0);
+		clearOld();
+	}
+}
+
+/*
+ * A folder listing has everything needed to stat the files in it, so note
+ * where they are to answer for them too instead of asking the device about
+ * each one later. Their metadata is only made when first asked for, and
+ * kept with the location, as a cache entry for each would take more memory
+ * than the listing itself. Only the
+ * files from position from on are noted.
+ */
+void MtpMetadataCache::noteFileLocations(const MtpNodeMetadata& data, size_t from)
+{
+	const MtpFolderContents& children = data.children;
+	for(size_t c = from; c < children.size(); c++)
 	{
-		delete i->second;
+		if (children.filetype(c) == LIBMTP_FILETYPE_FOLDER)
+			continue;
+		// The listing is newer than what was fetched for the file on its own.
+		cache_lookup_type::iterator i = m_cacheLookup.find(children.id(c));
+		if (i != m_cacheLookup.end())
+			eraseItem(i);
+		FileLocation& location = m_fileLocations[children.id(c)];
+		m_bytes -= fileBytes(location);
+		location.folderId = data.self.id;
+		location.position = c;
+		location.data.reset();
 	}
 }
 
+/*
+ * What the metadata made for a file in a folder listing takes on the heap.
+ */
+size_t MtpMetadataCache::fileBytes(const FileLocation& location)
+{
+	if (!location.data)
+		return 0;
+	return sizeof(MtpNodeMetadata) + nodeOverheadBytes + location.data->self.name.capacity();
+}
 
+void MtpMetadataCache::eraseFileLocation(file_location_type::iterator location)
+{
+	m_bytes -= fileBytes(location->second);
+	m_fileLocations.erase(location);
+}
 
-MtpNodeMetadata MtpMetadataCache::getItem(uint32_t id, MtpMetadataCacheFiller& source)
+void MtpMetadataCache::childAdded(uint32_t folderId, const MtpFileInfo& added)
 {
+	{
+		LockMutex lock(m_mutex);
 
+		// The device reports what we added ourselves too, which the listing
+		// already has. Its time may be off by however far apart the clocks
+		// are, which isn't worth copying the listing for.
+		cache_lookup_type::iterator i = m_cacheLookup.find(folderId);
+		if ((i != m_cacheLookup.end()) && !i->second->fromSnapshot)
+		{
+			const MtpFolderContents& children = i->second->data->children;
+			size_t c = children.findId(added.id);
+			if ((c != MtpFolderContents::npos) && (children.filetype(c) == added.filetype) &&
+					(children.filesize(c) == added.filesize) && !strcmp(children.name(c), added.name.c_str()))
+				return;
+		}
+	}
+	patchListing(folderId, 0, &added);
+}
+
+void MtpMetadataCache::childRemoved(uint32_t folderId, uint32_t removedId)
+{
+	patchListing(folderId, removedId, 0);
+}
+
+void MtpMetadataCache::childReplaced(uint32_t folderId, uint32_t removedId, const MtpFileInfo& added)
+{
+	patchListing(folderId, removedId, &added);
+}
+
+/*
+ * Replaces the cached listing of a folder with a copy that has removedId
+ * taken out, unless it is 0, and added put in, unless it is null. What has
+ * been handed out never changes. The copy is of a few flat arrays, and the
+ * objects are found through the listing's indexes, which is still far
+ * quicker than listing a big folder from the device again.
+ */
+void MtpMetadataCache::patchListing(uint32_t folderId, uint32_t removedId, const MtpFileInfo* added)
+{
+	LockMutex lock(m_mutex);
+
+	cache_lookup_type::iterator i = m_cacheLookup.find(folderId);
+	if ((i == m_cacheLookup.end()) || i->second->fromSnapshot)
+	{
+		clearItem(folderId);
+		return;
+	}
+	std::shared_ptr<MtpNodeMetadata> data(new MtpNodeMetadata(*i->second->data));
+	MtpFolderContents& children = data->children;
+	// Files from here on have moved, or are new.
+	size_t moved = children.size();
+	size_t removed = removedId ? children.findId(removedId) : MtpFolderContents::npos;
+	if (removed != MtpFolderContents::npos)
+	{
+		children.remove(removed);
+		moved = removed;
+	}
+	if (added)
+	{
+		removed = children.findId(added->id);
+		if (removed != MtpFolderContents::npos)
+		{
+			children.remove(removed);
+			moved = std::min(moved, removed);
+		}
+		children.add(*added);
+		moved = std::min(moved, children.size() - 1);
+	}
+	children.finish();
+
+	// A fetch of the folder that started before the change mustn't put the
+	// old listing back.
+	m_generation++;
+	// The entry is changed in place rather than replaced, so the locations of
+	// the files before the change don't have to be noted again. Anything else
+	// that changed on the device is no newer than it was, so it keeps its age.
+	CacheEntry& entry = *i->second;
+	m_bytes -= entry.bytes;
+	entry.data = data;
+	entry.bytes = entryBytes(*data);
+	m_bytes += entry.bytes;
+	m_cache.splice(m_cache.end(), m_cache, i->second);
+	file_location_type::iterator location = m_fileLocations.find(removedId);
+	if ((location != m_fileLocations.end()) && (location->second.folderId == folderId))
+		eraseFileLocation(location);
+	if (m_snapshot)
+		m_snapshot->listed(data);
+	noteFileLocations(*data, moved);
 	clearOld();
+}
+
+void MtpMetadataCache::fileWrittenBack(MtpDevice& device, uint32_t parentId, uint32_t oldId, uint32_t newId)
+{
+	writtenBack(device, parentId, oldId, newId, std::shared_ptr<MtpLocalFileCopy>());
+}
+
+/*
+ * Also moves localFile over to newId, if there is one.
+ */
+void MtpMetadataCache::writtenBack(MtpDevice& device, uint32_t parentId, uint32_t oldId, uint32_t newId,
+		const std::shared_ptr<MtpLocalFileCopy>& localFile)
+{
+	MtpFileInfo info;
+	bool haveInfo = false;
+	try
+	{
+		info = device.GetFileInfo(newId);
+		haveInfo = true;
+	}
+	catch(MtpDeviceDisconnected&)
+	{
+		throw;
+	}
+	catch(MtpError&)
+	{
+		// Gone again already. Whatever the folder has now will be fetched.
+	}
+
+	LockMutex lock(m_mutex);
+	if (localFile && (newId != oldId))
+		rekeyFile(oldId, newId, localFile);
+	clearItem(oldId);
+	clearItem(newId);
+	if (haveInfo)
+		childReplaced(parentId, oldId, info);
+	else
+		clearItem(parentId);
+}
+
+void MtpMetadataCache::putItem(const CacheEntry& entry)
+{
+	// Another thread may have fetched the same item while we were.
+	cache_lookup_type::iterator i = m_cacheLookup.find(entry.data->self.id);
+	if (i != m_cacheLookup.end())
+		eraseItem(i);
+	file_location_type::iterator location = m_fileLocations.find(entry.data->self.id);
+	if (location != m_fileLocations.end())
+		eraseFileLocation(location);
+	m_cacheLookup[entry.data->self.id] = m_cache.insert(m_cache.end(), entry);
+	m_bytes += entry.bytes;
+}
+
+/*
+ * Drops an item, and the locations of the files in it if it's a folder.
+ */
+void MtpMetadataCache::eraseItem(cache_lookup_type::iterator i)
+{
+	const MtpFolderContents& children = i->second->data->children;
+	for(size_t c = 0; c < children.size(); c++)
+	{
+		file_location_type::iterator location = m_fileLocations.find(children.id(c));
+		if ((location != m_fileLocations.end()) && (location->second.folderId == i->first))
+			eraseFileLocation(location);
+	}
+	m_bytes -= i->second->bytes;
+	m_cache.erase(i->second);
+	m_cacheLookup.erase(i);
+}
+
+/*
+ * Roughly what an item takes on the heap once cached. Files in a folder's
+ * listing each cost a note of where they are too.
+ */
+size_t MtpMetadataCache::entryBytes(const MtpNodeMetadata& data)
+{
+	size_t bytes = sizeof(CacheEntry) + sizeof(MtpNodeMetadata) + 2 * nodeOverheadBytes;
+	bytes += data.self.name.capacity();
+	bytes += data.children.bytes();
+	bytes += data.children.size() * (sizeof(file_location_type::value_type) + nodeOverheadBytes);
+	bytes += data.storages.capacity() * sizeof(MtpStorageInfo);
+	for(std::vector<MtpStorageInfo>::const_iterator i = data.storages.begin(); i != data.storages.end(); i++)
+		bytes += i->description.capacity();
+	return bytes;
+}
+
+/*
+ * Makes the item, or the folder whose listing it is made from, the most
+ * recently used.
+ */
+void MtpMetadataCache::touchItem(uint32_t id)
+{
+	cache_lookup_type::iterator i = m_cacheLookup.find(id);
+	if (i == m_cacheLookup.end())
+	{
+		file_location_type::iterator location = m_fileLocations.find(id);
+		if (location == m_fileLocations.end())
+			return;
+		i = m_cacheLookup.find(location->second.folderId);
+	}
+	m_cache.splice(m_cache.end(), m_cache, i->second);
+}
+
+/*
+ * True if the item is the folder an open file is in, or an open file.
+ */
+bool MtpMetadataCache::pinned(uint32_t id)
+{
+	if (m_localFileCache.count(id))
+		return true;
+	for(local_file_cache_type::iterator i = m_localFileCache.begin(); i != m_localFileCache.end(); i++)
+	{
+		file_location_type::iterator location = m_fileLocations.find(i->first);
+		if ((location != m_fileLocations.end()) && (location->second.folderId == id))
+			return true;
+		cache_lookup_type::iterator file = m_cacheLookup.find(i->first);
+		if (file == m_cacheLookup.end())
+			continue;
+		const MtpFileInfo& self = file->second->data->self;
+		// Files at the top of a storage are in the folder with the storage's id.
+		if ((self.parentId == id) || ((self.parentId == 0) && (self.storageId == id)))
+			return true;
+	}
+	return false;
+}
+
+/*
+ * The cached metadata of an item, or of a file made from the listing of the
+ * folder it is in. Expired or not.
+ */
+bool MtpMetadataCache::findEntry(uint32_t id, CacheEntry& entry)
+{
 	cache_lookup_type::iterator i = m_cacheLookup.find(id);
 	if (i != m_cacheLookup.end())
-		return i->second->data;
-	CacheEntry newData;
-	newData.data = source.getMetadata();
-	assert(newData.data.self.id == id);
-	newData.whenCreated = time(0);
-	m_cacheLookup[id] = m_cache.insert(m_cache.end(), newData);
-	return newData.data;
+	{
+		entry = *i->second;
+		return true;
+	}
+	file_location_type::iterator location = m_fileLocations.find(id);
+	if (location == m_fileLocations.end())
+		return false;
+	i = m_cacheLookup.find(location->second.folderId);
+	assert(i != m_cacheLookup.end());
+	if (!location->second.data)
+	{
+		const MtpFolderContents& children = i->second->data->children;
+		assert(children.id(location->second.position) == id);
+		MtpNodeMetadata* data = new MtpNodeMetadata;
+		data->self = children.info(location->second.position);
+		location->second.data.reset(data);
+		m_bytes += fileBytes(location->second);
+	}
+	entry.data = location->second.data;
+	entry.whenCreated = i->second->whenCreated;
+	return true;
 }
 
 void MtpMetadataCache::clearItem(uint32_t id)
 {
+	LockMutex lock(m_mutex);
 
+	m_generation++;
+	if (m_snapshot)
+		m_snapshot->changed(id);
 	cache_lookup_type::iterator i = m_cacheLookup.find(id);
 	if (i != m_cacheLookup.end())
+		eraseItem(i);
+	file_location_type::iterator location = m_fileLocations.find(id);
+	if (location != m_fileLocations.end())
+		eraseFileLocation(location);
+	// Whatever happened to the file, a copy of it from before is no good.
+	for(closed_file_list_type::iterator j = m_closedFiles.begin(); j != m_closedFiles.end(); j++)
 	{
-		m_cache.erase(i->second);
-		m_cacheLookup.erase(i);
+		if (j->first == id)
+		{
+			m_closedFiles.erase(j);
+			break;
+		}
 	}
 }
 
-void MtpMetadataCache::clearOld()
+void MtpMetadataCache::objectRemoved(uint32_t id)
+{
+	LockMutex lock(m_mutex);
+
+	// Files in cached listings have their folder noted, and a folder cached
+	// on its own knows its parent. Anything else has to be looked for.
+	std::vector<uint32_t> affected;
+	file_location_type::iterator location = m_fileLocations.find(id);
+	cache_lookup_type::iterator item = m_cacheLookup.find(id);
+	if (location != m_fileLocations.end())
+		affected.push_back(location->second.folderId);
+	else if (item != m_cacheLookup.end())
+	{
+		const MtpFileInfo& self = item->second->data->self;
+		affected.push_back(self.parentId ? self.parentId : self.storageId);
+	}
+	else
+	{
+		for(cache_type::iterator i = m_cache.begin(); i != m_cache.end(); i++)
+		{
+			if (i->data->children.findId(id) != MtpFolderContents::npos)
+				affected.push_back(i->data->self.id);
+		}
+	}
+	if (m_snapshot)
+		m_snapshot->removed(id);
+	clearItem(id);
+	for(std::vector<uint32_t>::iterator i = affected.begin(); i != affected.end(); i++)
+		childRemoved(*i, id);
+}
+
+time_t MtpMetadataCache::timeout()
+{
+	LockMutex lock(m_mutex);
+
+	return m_timeout;
+}
+
+void MtpMetadataCache::setTimeout(time_t seconds)
+{
+	LockMutex lock(m_mutex);
+
+	m_timeout = seconds;
+}
+
+void MtpMetadataCache::setDiskCache(std::unique_ptr<MtpDiskCache> diskCache)
+{
+	m_diskCache = std::move(diskCache);
+}
+
+MtpDiskCache* MtpMetadataCache::diskCache()
+{
+	return m_diskCache.get();
+}
+
+void MtpMetadataCache::setSnapshot(std::unique_ptr<MtpMetadataSnapshot> snapshot, MtpDevice& device)
+{
+	m_snapshot = std::move(snapshot);
+	m_snapshotDevice = &device;
+}
+
+void MtpMetadataCache::setBackgroundRefresh(bool backgroundRefresh)
+{
+	LockMutex lock(m_mutex);
+
+	m_backgroundRefresh = backgroundRefresh;
+}
+
+void MtpMetadataCache::setMaxBytes(size_t maxBytes)
+{
+	LockMutex lock(m_mutex);
+
+	m_maxBytes = maxBytes;
+	clearOld();
+}
+
+MtpMetadataCacheStats MtpMetadataCache::stats()
 {
+	LockMutex lock(m_mutex);
 
+	MtpMetadataCacheStats result = m_stats;
+	result.entries = m_cache.size();
+	result.bytes = m_bytes;
+	return result;
+}
+
+bool MtpMetadataCache::expired(const CacheEntry& entry, time_t now)
+{
+	return (now - entry.whenCreated) > m_timeout;
+}
+
+/*
+ * Drops items, least recently used first, while they've expired or the
+ * cache is over its size. Expired items behind one that is kept stay until
+ * they're looked at or evicted, which is fine as getItem doesn't hand them
+ * out.
+ */
+void MtpMetadataCache::clearOld()
+{
 	time_t now = time(0);
 	for(cache_type::iterator i = m_cache.begin(); i != m_cache.end();)
 	{
-		if ((now - i->whenCreated) > 5)
+		// Expired items are handed out while they're refreshed instead, with
+		// background refresh on.
+		bool old = !m_backgroundRefresh && expired(*i, now);
+		if (!old && (m_bytes <= m_maxBytes))
+			return;
+		cache_type::iterator next = i;
+		next++;
+		if (!pinned(i->data->self.id))
 		{
-			m_cacheLookup.erase(m_cacheLookup.find(i->data.self.id));
-			i = m_cache.erase(i);
+			if (!old)
+				m_stats.evictions++;
+			eraseItem(m_cacheLookup.find(i->data->self.id));
 		}
-		else
-			return;
+		i = next;
 	}
 }
 
-MtpLocalFileCopy* MtpMetadataCache::openFile(MtpDevice& device, uint32_t id)
+std::shared_ptr<MtpLocalFileCopy> MtpMetadataCache::openFile(MtpDevice& device, uint32_t id)
 {
+	LockMutex lock(m_mutex);
+
+	// The contents aren't copied from the device until they're first read or
+	// changed, so an open that the kernel can answer from its page cache
+	// doesn't cost a transfer.
 	local_file_cache_type::iterator i = m_localFileCache.find(id);
 	if (i != m_localFileCache.end())
 		return i->second;
-	MtpLocalFileCopy* newFile = new MtpLocalFileCopy(device, id);
-	m_localFileCache[id] = newFile;
-	return newFile;
+	for(closed_file_list_type::iterator j = m_closedFiles.begin(); j != m_closedFiles.end(); j++)
+	{
+		if (j->first == id)
+		{
+			std::shared_ptr<MtpLocalFileCopy> localFile = j->second;
+			m_closedFiles.erase(j);
+			localFile->reopened();
+			m_localFileCache[id] = localFile;
+			return localFile;
+		}
+	}
+	std::shared_ptr<MtpLocalFileCopy> localFile(new MtpLocalFileCopy(*this, device, id));
+	m_localFileCache[id] = localFile;
+	return localFile;
 }
 
-MtpLocalFileCopy* MtpMetadataCache::getOpenedFile(uint32_t id)
+void MtpMetadataCache::newFile(MtpDevice& device, uint32_t id)
 {
-	local_file_cache_type::iterator i = m_localFileCache.find(id);
+	LockMutex lock(m_mutex);
+
+	openFile(device, id)->setCreated();
+}
+
+std::shared_ptr<MtpLocalFileCopy> MtpMetadataCache::openFileHandle(MtpDevice& device, uint32_t id)
+{
+	LockMutex lock(m_mutex);
+
+	std::shared_ptr<MtpLocalFileCopy> localFile = openFile(device, id);
+	localFile->reportWriteBackError();
+	localFile->addHandle();
+	return localFile;
+}
+
+std::shared_ptr<MtpLocalFileCopy> MtpMetadataCache::getOpenedFile(uint32_t id)
+{
+	LockMutex lock(m_mutex);
+
+	local_file_cache_type::iterator i = m_localFileCache.find(currentId(id));
 	if (i != m_localFileCache.end())
 		return i->second;
 	else
-		return 0;
+		return std::shared_ptr<MtpLocalFileCopy>();
+}
+
+uint32_t MtpMetadataCache::syncFile(uint32_t id, uint32_t parentId)
+{
+	id = currentId(id);
+	std::shared_ptr<MtpLocalFileCopy> localFile = getOpenedFile(id);
+	if (!localFile)
+		return id;
+
+	bool dirty = localFile->isDirty();
+	uint32_t newId = localFile->writeBack();
+	if (dirty)
+		writtenBack(localFile->device(), parentId, id, newId, localFile);
+	else if (newId != id)
+	{
+		LockMutex lock(m_mutex);
+		rekeyFile(id, newId, localFile);
+	}
+	return newId;
 }
 
-uint32_t MtpMetadataCache::closeFile(uint32_t id)
+uint32_t MtpMetadataCache::closeFile(uint32_t id, uint32_t parentId)
 {
+	id = currentId(id);
+	std::shared_ptr<MtpLocalFileCopy> localFile = getOpenedFile(id);
+	if (!localFile)
+		return id;
+
+	// Every close of a duplicated descriptor ends up here, as does a truncate
+	// or rename of a file something else still has open. Only the last handle
+	// to go sends the file to the device, so it crosses USB once.
+	if (localFile->hasHandles())
+		return id;
+
+	if (localFile->isDirty())
+	{
+		// Stays in the cache until it has been written back, so the changes
+		// are what gets read, stat'ed or reopened in the meantime.
+		m_writeBackQueue.add(localFile, parentId);
+		return id;
+	}
+
+	// Asked before locking, since it waits for a fetch in progress.
+	bool keep = localFile->hasRemoteContents();
+	if (keep)
+		localFile->store();
+	// A new empty file is kept too, as its size may be given before it is
+	// opened again to be written, with the user.jmtpfs.size attribute.
+	keep = keep || localFile->isNew();
+	LockMutex lock(m_mutex);
 	local_file_cache_type::iterator i = m_localFileCache.find(id);
-	if (i != m_localFileCache.end())
+	if ((i != m_localFileCache.end()) && (i->second == localFile) && !localFile->hasHandles())
 	{
-		uint32_t newId = i->second->close();
-		delete i->second;
 		m_localFileCache.erase(i);
-		return newId;
+		if (keep)
+			keepClosedFile(id, localFile);
 	}
 	return id;
 }
+
+/*
+ * Keeps the copy of a closed file, so what was copied of it doesn't have to
+ * be copied again if it is reopened, dropping the oldest kept copies to stay
+ * within closedFilesMaxBytes. Called with the cache locked.
+ */
+void MtpMetadataCache::keepClosedFile(uint32_t id, const std::shared_ptr<MtpLocalFileCopy>& localFile)
+{
+	m_closedFiles.push_back(std::make_pair(id, localFile));
+	off_t total = 0;
+	size_t count = 0;
+	for(closed_file_list_type::reverse_iterator i = m_closedFiles.rbegin(); i != m_closedFiles.rend(); i++)
+	{
+		total += i->second->cachedBytes();
+		count++;
+		if ((total > closedFilesMaxBytes) || (count > closedFilesMaxCount))
+		{
+			m_closedFiles.erase(m_closedFiles.begin(), i.base());
+			break;
+		}
+	}
+}
+
+void MtpMetadataCache::writeBackQueued(const std::shared_ptr<MtpLocalFileCopy>& localFile, uint32_t parentId)
+{
+	// Reopened while it waited and being streamed to the device. Writing it
+	// back would end the stream under the writes, and the last handle to be
+	// released queues it again.
+	if (localFile->streaming() && localFile->hasHandles())
+		return;
+	uint32_t oldId = localFile->remoteId();
+	uint32_t newId = localFile->writeBack();
+	writtenBack(localFile->device(), parentId, oldId, newId, localFile);
+
+	LockMutex lock(m_mutex);
+	local_file_cache_type::iterator i = m_localFileCache.find(newId);
+	if ((i != m_localFileCache.end()) && (i->second == localFile) &&
+			!localFile->hasHandles() && !localFile->isDirty())
+		m_localFileCache.erase(i);
+}
+
+void MtpMetadataCache::readAhead(const std::shared_ptr<MtpLocalFileCopy>& localFile, off_t offset, size_t size)
+{
+	m_readAheadQueue.add(localFile, offset, size);
+}
+
+void MtpMetadataCache::stopReadAhead(const std::shared_ptr<MtpLocalFileCopy>& localFile)
+{
+	m_readAheadQueue.remove(localFile);
+}
+
+void MtpMetadataCache::renameFile(uint32_t oldId, uint32_t newId)
+{
+	LockMutex lock(m_mutex);
+
+	local_file_cache_type::iterator i = m_localFileCache.find(oldId);
+	if (i != m_localFileCache.end())
+	{
+		std::shared_ptr<MtpLocalFileCopy> localFile = i->second;
+		localFile->setRemoteId(newId);
+		rekeyFile(oldId, newId, localFile);
+	}
+	else
+		replaceId(oldId, newId);
+}
+
+uint32_t MtpMetadataCache::currentId(uint32_t id)
+{
+	LockMutex lock(m_mutex);
+
+	std::unordered_map<uint32_t, uint32_t>::iterator i = m_replacedIds.find(id);
+	if (i == m_replacedIds.end())
+		return id;
+	uint32_t newId = currentId(i->second);
+	i->second = newId;
+	return newId;
+}
+
+void MtpMetadataCache::rekeyFile(uint32_t oldId, uint32_t newId, const std::shared_ptr<MtpLocalFileCopy>& localFile)
+{
+	local_file_cache_type::iterator i = m_localFileCache.find(oldId);
+	if ((i != m_localFileCache.end()) && (i->second == localFile))
+		m_localFileCache.erase(i);
+	m_localFileCache[newId] = localFile;
+	replaceId(oldId, newId);
+}
+
+void MtpMetadataCache::replaceId(uint32_t oldId, uint32_t newId)
+{
+	m_replacedIds[oldId] = newId;
+	if (m_fileIdListener)
+		m_fileIdListener->fileIdChanged(oldId, newId);
+}
+
+void MtpMetadataCache::setFileIdListener(MtpFileIdListener* listener)
+{
+	LockMutex lock(m_mutex);
+
+	m_fileIdListener = listener;
+}
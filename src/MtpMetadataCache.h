@@ -23,9 +23,18 @@
 #define MTPMETADATACACHE_H_
 
 #include "MtpNodeMetadata.h"
+#include "MtpDiskCache.h"
 #include "MtpLocalFileCopy.h"
+#include "MtpMetadataSnapshot.h"
+#include "MtpReadAheadQueue.h"
+#include "MtpRefreshQueue.h"
+#include "MtpSnapshotChecker.h"
+#include "MtpWriteBackQueue.h"
+#include "Mutex.h"
 
 #include <list>
+#include <time.h>
+#include <memory>
 #include <unordered_map>
 
 class MtpMetadataCacheFiller
@@ -34,37 +43,278 @@ public:
 	virtual ~MtpMetadataCacheFiller();
 
 	virtual MtpNodeMetadata getMetadata()=0;
+
+	/*
+	 * A filler for the same item that is still good after this one is gone,
+	 * to fetch it again in the background. Null if there can't be one.
+	 */
+	virtual std::unique_ptr<MtpMetadataCacheFiller> cloneFiller();
+};
+
+/*
+ * Told when a file is given a new id, as it is when changes to it are
+ * written back by sending it again. It's called with the cache locked, so
+ * it mustn't use the cache.
+ */
+class MtpFileIdListener
+{
+public:
+	virtual ~MtpFileIdListener();
+
+	virtual void fileIdChanged(uint32_t oldId, uint32_t newId)=0;
+};
+
+struct MtpMetadataCacheStats
+{
+	MtpMetadataCacheStats() : hits(0), misses(0), staleHits(0), refreshes(0), evictions(0),
+			entries(0), bytes(0) {}
+
+	// Items handed out from the cache.
+	unsigned long	hits;
+	// Items that had to be fetched.
+	unsigned long	misses;
+	// Expired items handed out while they were fetched again in the background.
+	unsigned long	staleHits;
+	// Background fetches of expired items that have finished.
+	unsigned long	refreshes;
+	// Items dropped to keep within the cache's size, rather than for expiring.
+	unsigned long	evictions;
+	// What's in the cache now.
+	size_t			entries;
+	size_t			bytes;
 };
 
+/*
+ * The cache may be used from multiple threads at once. Its lock is never held
+ * while talking to the device, so lookups of cached items don't have to wait
+ * for another thread's fetch or file transfer to finish.
+ */
 class MtpMetadataCache
 {
 public:
 	MtpMetadataCache();
 	~MtpMetadataCache();
 
-	MtpNodeMetadata getItem(uint32_t id, MtpMetadataCacheFiller& source);
+	/*
+	 * What's handed out is shared with the cache, and whoever else asked for
+	 * it, rather than copied. It never changes. Changes on the device replace
+	 * it in the cache instead.
+	 */
+	std::shared_ptr<const MtpNodeMetadata> getItem(uint32_t id, MtpMetadataCacheFiller& source);
 	void clearItem(uint32_t id);
 
-	MtpLocalFileCopy* openFile(MtpDevice& device, uint32_t id);
-	MtpLocalFileCopy* getOpenedFile(uint32_t id);
+	/*
+	 * The object with id has been removed from the device, by something
+	 * other than us. Clears it, and takes it out of the listing of whichever
+	 * folder it was in.
+	 */
+	void objectRemoved(uint32_t id);
+
+	/*
+	 * Something has been added to, removed from or replaced in the folder
+	 * with folderId by us, rather than on the device. Changes the cached
+	 * listing of the folder to match, instead of fetching it all from the
+	 * device again. A listing that hasn't been checked against the device is
+	 * cleared as before. added replaces any object already listed with its id.
+	 * childAdded leaves the listing alone if it has added already, apart from
+	 * its time.
+	 */
+	void childAdded(uint32_t folderId, const MtpFileInfo& added);
+	void childRemoved(uint32_t folderId, uint32_t removedId);
+	void childReplaced(uint32_t folderId, uint32_t removedId, const MtpFileInfo& added);
+
+	/*
+	 * The file with oldId in the folder with parentId has been sent to the
+	 * device again as newId, which may be the same. Asks the device about
+	 * the file, and puts what it says in the folder's cached listing.
+	 */
+	void fileWrittenBack(MtpDevice& device, uint32_t parentId, uint32_t oldId, uint32_t newId);
+
+	/*
+	 * Fetch an item from source again, even if it is cached.
+	 */
+	void refreshItem(uint32_t id, MtpMetadataCacheFiller& source);
+
+	/*
+	 * How many seconds metadata fetched from the device is trusted for.
+	 * With MtpEventListener telling the cache about changes made on the
+	 * device, this only matters for the changes devices don't report.
+	 */
+	time_t timeout();
+	void setTimeout(time_t seconds);
 
-	uint32_t closeFile(uint32_t id);
+	/*
+	 * Hand out expired items straight away and fetch them again in the
+	 * background with MtpRefreshQueue, instead of waiting for the device.
+	 * Expired items are then kept until they are refreshed or cleared.
+	 */
+	void setBackgroundRefresh(bool backgroundRefresh);
+
+	/*
+	 * Most memory, in bytes, for cached items. Those used least recently are
+	 * dropped to keep within it, except for the folders files are open in,
+	 * so it can be exceeded by those.
+	 */
+	void setMaxBytes(size_t maxBytes);
+
+	/*
+	 * Called by the refresh queue to fetch an item again, if it is still
+	 * cached and expired.
+	 */
+	void refreshQueued(uint32_t id, MtpMetadataCacheFiller& source);
+
+	MtpMetadataCacheStats stats();
+
+	/*
+	 * Keep copies of files that have been read in diskCache, for later
+	 * mounts. Set before the cache is used. diskCache() is null without one.
+	 */
+	void setDiskCache(std::unique_ptr<MtpDiskCache> diskCache);
+	MtpDiskCache* diskCache();
+
+	/*
+	 * Use the folder listings saved in snapshot when folders aren't cached,
+	 * until they have been checked against device, and save what is listed
+	 * for later mounts. Set before the cache is used.
+	 */
+	void setSnapshot(std::unique_ptr<MtpMetadataSnapshot> snapshot, MtpDevice& device);
+
+	std::shared_ptr<MtpLocalFileCopy> openFile(MtpDevice& device, uint32_t id);
+	std::shared_ptr<MtpLocalFileCopy> getOpenedFile(uint32_t id);
+
+	/*
+	 * Sets up the local copy of a file that was just created, empty, on the
+	 * device, so that opening it doesn't fetch it and it can be streamed
+	 * to the device if its size is known in advance.
+	 */
+	void newFile(MtpDevice& device, uint32_t id);
+
+	/*
+	 * Like openFile, but also counts a file handle as using the local copy.
+	 * The count is taken while the cache is locked, so closeFile and the write
+	 * back queue can't drop the copy between it being found and being counted.
+	 * Fails with the error from a failed write back of the file in the
+	 * background, if that hasn't been reported yet.
+	 */
+	std::shared_ptr<MtpLocalFileCopy> openFileHandle(MtpDevice& device, uint32_t id);
+
+	/*
+	 * Write back any changes to the local copy of a file, keeping it open.
+	 * Returns the new id of the file. parentId is the folder the file is in.
+	 */
+	uint32_t syncFile(uint32_t id, uint32_t parentId);
+
+	/*
+	 * Called when something is done with the local copy of a file. Nothing
+	 * happens while file handles are still using it. After that, changes are
+	 * written back in the background by the write back queue, and the local
+	 * copy is dropped once it has no changes left to write back. A copy
+	 * without changes is kept a while for the next openFile instead, as
+	 * long as it holds some of the file, and put in the disk cache if it
+	 * holds all of it. parentId is the folder the file is in.
+	 */
+	uint32_t closeFile(uint32_t id, uint32_t parentId);
+
+	/*
+	 * Called by the write back queue to write back a file queued by closeFile.
+	 */
+	void writeBackQueued(const std::shared_ptr<MtpLocalFileCopy>& localFile, uint32_t parentId);
+
+	/*
+	 * Copy part of a file from the device in the background, ahead of it
+	 * being read. See MtpReadAheadQueue.
+	 */
+	void readAhead(const std::shared_ptr<MtpLocalFileCopy>& localFile, off_t offset, size_t size);
+	void stopReadAhead(const std::shared_ptr<MtpLocalFileCopy>& localFile);
+
+	/*
+	 * The file with id oldId has been replaced by newId.
+	 */
+	void renameFile(uint32_t oldId, uint32_t newId);
+
+	/*
+	 * Files get a new id when changes are written back. This maps an id
+	 * that may have been held onto since then to the file's current id.
+	 */
+	uint32_t currentId(uint32_t id);
+
+	/*
+	 * Tells listener about each file given a new id from now on, or no one
+	 * if it is 0.
+	 */
+	void setFileIdListener(MtpFileIdListener* listener);
 
 private:
 	void clearOld();
+	void addItem(const std::shared_ptr<const MtpNodeMetadata>& data, unsigned long generation, bool fromSnapshot);
+	void patchListing(uint32_t folderId, uint32_t removedId, const MtpFileInfo* added);
+	void writtenBack(MtpDevice& device, uint32_t parentId, uint32_t oldId, uint32_t newId,
+			const std::shared_ptr<MtpLocalFileCopy>& localFile);
+	void rekeyFile(uint32_t oldId, uint32_t newId, const std::shared_ptr<MtpLocalFileCopy>& localFile);
+	void replaceId(uint32_t oldId, uint32_t newId);
 	struct CacheEntry
 	{
-		MtpNodeMetadata data;
+		std::shared_ptr<const MtpNodeMetadata>	data;
 		time_t			whenCreated;
+		// Memory taken by the item, and by noting where the files in it are.
+		size_t			bytes;
+		// Saved from an earlier mount, and not checked against the device yet.
+		bool			fromSnapshot;
 	};
+	static size_t entryBytes(const MtpNodeMetadata& data);
+	bool expired(const CacheEntry& entry, time_t now);
+	void putItem(const CacheEntry& entry);
+	bool findEntry(uint32_t id, CacheEntry& entry);
+	void touchItem(uint32_t id);
+	bool pinned(uint32_t id);
+	void keepClosedFile(uint32_t id, const std::shared_ptr<MtpLocalFileCopy>& localFile);
 
 	typedef std::list<CacheEntry> cache_type;
 	typedef std::unordered_map<uint32_t, cache_type::iterator> cache_lookup_type;
-	typedef std::unordered_map<uint32_t, MtpLocalFileCopy*> local_file_cache_type;
+	// Where a file is in the cached listing of its folder.
+	struct FileLocation
+	{
+		uint32_t	folderId;
+		uint32_t	position;
+		// Made from the listing the first time the file is looked up.
+		std::shared_ptr<const MtpNodeMetadata>	data;
+	};
+	typedef std::unordered_map<uint32_t, FileLocation> file_location_type;
+	typedef std::unordered_map<uint32_t, std::shared_ptr<MtpLocalFileCopy> > local_file_cache_type;
+	typedef std::list<std::pair<uint32_t, std::shared_ptr<MtpLocalFileCopy> > > closed_file_list_type;
+
+	void eraseItem(cache_lookup_type::iterator i);
+	void noteFileLocations(const MtpNodeMetadata& data, size_t from);
+	static size_t fileBytes(const FileLocation& location);
+	void eraseFileLocation(file_location_type::iterator location);
 
+	// Least recently used first.
 	cache_type				m_cache;
 	cache_lookup_type		m_cacheLookup;
+	// Files that aren't cached on their own, but are in a cached folder listing.
+	file_location_type		m_fileLocations;
 	local_file_cache_type	m_localFileCache;
+	// Copies of closed files, least recently closed first.
+	closed_file_list_type	m_closedFiles;
+	std::unordered_map<uint32_t, uint32_t>	m_replacedIds;
+	MtpFileIdListener*		m_fileIdListener;
+	// Bumped by clearItem, so a fetch that raced with it doesn't put stale data back in the cache.
+	unsigned long			m_generation;
+	time_t					m_timeout;
+	bool					m_backgroundRefresh;
+	size_t					m_maxBytes;
+	size_t					m_bytes;
+	MtpMetadataCacheStats	m_stats;
+	RecursiveMutex			m_mutex;
+	std::unique_ptr<MtpDiskCache>	m_diskCache;
+	// Saves the listings when destroyed, so it has to outlive the write back queue.
+	std::unique_ptr<MtpMetadataSnapshot>	m_snapshot;
+	MtpDevice*				m_snapshotDevice;
+	MtpSnapshotChecker		m_snapshotChecker;
+	MtpRefreshQueue			m_refreshQueue;
+	MtpReadAheadQueue		m_readAheadQueue;
+	// Last, so it is destroyed first and finishes its uploads while the rest of the cache is still there.
+	MtpWriteBackQueue		m_writeBackQueue;
 
 };
 
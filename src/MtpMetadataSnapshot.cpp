@@ -0,0 +1,414 @@
+/*
+ * MtpMetadataSnapshot.cpp
+ *
+ *      Author: Jason Ferrara
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+#include "MtpMetadataSnapshot.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+struct MtpMetadataSnapshot::Header
+{
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	storageId;
+	uint32_t	folderCount;
+	uint32_t	objectCount;
+	uint64_t	stringBytes;
+};
+
+struct MtpMetadataSnapshot::Object
+{
+	uint32_t	id;
+	uint32_t	parentId;
+	uint32_t	filetype;
+	// Where the name is in the strings, which aren't 0 terminated.
+	uint32_t	nameOffset;
+	uint32_t	nameLength;
+	uint32_t	unused;
+	uint64_t	filesize;
+	int64_t		modificationdate;
+};
+
+struct MtpMetadataSnapshot::Folder
+{
+	Object		self;
+	// The folder's contents are objects[firstChild] to objects[firstChild + childCount - 1].
+	uint32_t	firstChild;
+	uint32_t	childCount;
+};
+
+static const char snapshotMagic[8] = { 'J', 'M', 'T', 'P', 'F', 'S', 'M', 'D' };
+static const uint32_t snapshotVersion = 1;
+
+static bool writeAll(int fd, const void* data, size_t size)
+{
+	size_t wroteBytes = 0;
+	while(wroteBytes < size)
+	{
+		ssize_t result = write(fd, (const char*) data + wroteBytes, size - wroteBytes);
+		if (result == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		wroteBytes += result;
+	}
+	return true;
+}
+
+MtpMetadataSnapshot::MtpMetadataSnapshot(const std::string& directory, const std::vector<MtpStorageInfo>& storages)
+{
+	for(std::vector<MtpStorageInfo>::const_iterator s = storages.begin(); s != storages.end(); s++)
+	{
+		char name[40];
+		snprintf(name, sizeof(name), "/listings-%08x", s->id);
+		StorageFile file;
+		file.storageId = s->id;
+		file.path = directory + name;
+		file.map = 0;
+		file.mapSize = 0;
+		file.nextToCheck = 0;
+		load(file);
+		m_files.push_back(file);
+	}
+}
+
+MtpMetadataSnapshot::~MtpMetadataSnapshot()
+{
+	save();
+	for(std::vector<StorageFile>::iterator f = m_files.begin(); f != m_files.end(); f++)
+	{
+		if (f->map)
+			munmap(f->map, f->mapSize);
+	}
+}
+
+/*
+ * Maps in the file saved for a storage, if there is one and it makes sense.
+ */
+void MtpMetadataSnapshot::load(StorageFile& file)
+{
+	int fd = open(file.path.c_str(), O_RDONLY);
+	if (fd == -1)
+		return;
+	struct stat info;
+	if (fstat(fd, &info) || ((size_t) info.st_size < sizeof(Header)))
+	{
+		close(fd);
+		return;
+	}
+	void* map = mmap(0, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return;
+
+	const Header* header = (const Header*) map;
+	uint64_t expectedSize = sizeof(Header) + (uint64_t) header->folderCount * sizeof(Folder) +
+			(uint64_t) header->objectCount * sizeof(Object) + header->stringBytes;
+	const Folder* folders = (const Folder*) (header + 1);
+	const Object* objects = (const Object*) (folders + header->folderCount);
+	if (memcmp(header->magic, snapshotMagic, sizeof(snapshotMagic)) || (header->version != snapshotVersion) ||
+			(header->storageId != file.storageId) || (expectedSize != (uint64_t) info.st_size) ||
+			!valid(*header, folders, objects))
+	{
+		munmap(map, info.st_size);
+		return;
+	}
+	file.map = map;
+	file.mapSize = info.st_size;
+	file.header = header;
+	file.folders = folders;
+	file.objects = objects;
+	file.strings = (const char*) (objects + header->objectCount);
+	file.checked.assign(header->folderCount, false);
+	for(uint32_t folder = 0; folder < header->folderCount; folder++)
+	{
+		for(uint32_t i = folders[folder].firstChild; i < folders[folder].firstChild + folders[folder].childCount; i++)
+			file.folderOf[objects[i].id] = folder;
+	}
+}
+
+/*
+ * Checks that everything in a mapped file points inside it, and that the
+ * folders are in order, so the rest of the code can take that for granted.
+ */
+bool MtpMetadataSnapshot::valid(const Header& header, const Folder* folders, const Object* objects)
+{
+	for(uint32_t folder = 0; folder < header.folderCount; folder++)
+	{
+		const Folder& f = folders[folder];
+		if (((uint64_t) f.firstChild + f.childCount > header.objectCount) ||
+				((uint64_t) f.self.nameOffset + f.self.nameLength > header.stringBytes) ||
+				((folder > 0) && (folders[folder - 1].self.id >= f.self.id)))
+			return false;
+	}
+	for(uint32_t i = 0; i < header.objectCount; i++)
+	{
+		if ((uint64_t) objects[i].nameOffset + objects[i].nameLength > header.stringBytes)
+			return false;
+	}
+	return true;
+}
+
+bool MtpMetadataSnapshot::folderIdLess(const Folder& folder, uint32_t id)
+{
+	return folder.self.id < id;
+}
+
+/*
+ * Finds the saved listing of a folder. Called with m_mutex held.
+ */
+bool MtpMetadataSnapshot::findFolder(uint32_t id, size_t& storage, size_t& folder)
+{
+	for(size_t s = 0; s < m_files.size(); s++)
+	{
+		const StorageFile& file = m_files[s];
+		if (!file.map)
+			continue;
+		const Folder* end = file.folders + file.header->folderCount;
+		const Folder* f = std::lower_bound(file.folders, end, id, folderIdLess);
+		if ((f != end) && (f->self.id == id))
+		{
+			storage = s;
+			folder = f - file.folders;
+			return true;
+		}
+	}
+	return false;
+}
+
+MtpFileInfo MtpMetadataSnapshot::objectInfo(const StorageFile& file, const Object& object)
+{
+	std::string name(file.strings + object.nameOffset, object.nameLength);
+	MtpFileInfo info(object.id, object.parentId, file.storageId, name,
+			(LIBMTP_filetype_t) object.filetype, object.filesize);
+	info.modificationdate = object.modificationdate;
+	return info;
+}
+
+MtpNodeMetadata MtpMetadataSnapshot::folderListing(const StorageFile& file, const Folder& folder)
+{
+	MtpNodeMetadata md;
+	md.self = objectInfo(file, folder.self);
+	for(uint32_t i = folder.firstChild; i < folder.firstChild + folder.childCount; i++)
+		md.children.add(objectInfo(file, file.objects[i]));
+	return md;
+}
+
+bool MtpMetadataSnapshot::getListing(uint32_t id, MtpNodeMetadata& md)
+{
+	LockMutex lock(m_mutex);
+
+	size_t storage, folder;
+	if (!findFolder(id, storage, folder) || m_files[storage].checked[folder])
+		return false;
+	md = folderListing(m_files[storage], m_files[storage].folders[folder]);
+	m_handedOut.push_back(std::make_pair(storage, folder));
+	return true;
+}
+
+void MtpMetadataSnapshot::listed(const std::shared_ptr<const MtpNodeMetadata>& md)
+{
+	LockMutex lock(m_mutex);
+
+	if (md->self.filetype != LIBMTP_FILETYPE_FOLDER)
+		return;
+	for(std::vector<StorageFile>::iterator f = m_files.begin(); f != m_files.end(); f++)
+	{
+		if (f->storageId == md->self.storageId)
+		{
+			m_listings[md->self.id] = md;
+			break;
+		}
+	}
+	size_t storage, folder;
+	if (findFolder(md->self.id, storage, folder))
+		m_files[storage].checked[folder] = true;
+}
+
+void MtpMetadataSnapshot::changed(uint32_t id)
+{
+	LockMutex lock(m_mutex);
+
+	m_listings.erase(id);
+	size_t storage, folder;
+	if (findFolder(id, storage, folder))
+		m_files[storage].checked[folder] = true;
+}
+
+void MtpMetadataSnapshot::removed(uint32_t id)
+{
+	LockMutex lock(m_mutex);
+
+	changed(id);
+	for(std::unordered_map<uint32_t, std::shared_ptr<const MtpNodeMetadata> >::iterator i = m_listings.begin();
+			i != m_listings.end();)
+	{
+		if (i->second->children.findId(id) != MtpFolderContents::npos)
+			i = m_listings.erase(i);
+		else
+			i++;
+	}
+	for(std::vector<StorageFile>::iterator f = m_files.begin(); f != m_files.end(); f++)
+	{
+		std::unordered_map<uint32_t, size_t>::const_iterator folder = f->folderOf.find(id);
+		if (folder != f->folderOf.end())
+			f->checked[folder->second] = true;
+	}
+}
+
+bool MtpMetadataSnapshot::nextToCheck(uint32_t& storageId, uint32_t& folderId)
+{
+	LockMutex lock(m_mutex);
+
+	size_t storage, folder;
+	bool found = false;
+	while(!found && !m_handedOut.empty())
+	{
+		storage = m_handedOut.front().first;
+		folder = m_handedOut.front().second;
+		m_handedOut.pop_front();
+		found = !m_files[storage].checked[folder];
+	}
+	for(size_t s = 0; !found && (s < m_files.size()); s++)
+	{
+		StorageFile& file = m_files[s];
+		while(!found && (file.nextToCheck < file.checked.size()))
+		{
+			storage = s;
+			folder = file.nextToCheck++;
+			found = !file.checked[folder];
+		}
+	}
+	if (!found)
+		return false;
+	// A storage's top folder is listed by its id, but is folder 0 to the device.
+	storageId = m_files[storage].storageId;
+	folderId = m_files[storage].folders[folder].self.id;
+	if (folderId == storageId)
+		folderId = 0;
+	return true;
+}
+
+void MtpMetadataSnapshot::save()
+{
+	LockMutex lock(m_mutex);
+
+	for(std::vector<StorageFile>::iterator f = m_files.begin(); f != m_files.end(); f++)
+		saveStorage(*f);
+}
+
+/*
+ * Called with m_mutex held.
+ */
+void MtpMetadataSnapshot::saveStorage(const StorageFile& file)
+{
+	std::map<uint32_t, std::shared_ptr<const MtpNodeMetadata> > listings;
+	for(std::unordered_map<uint32_t, std::shared_ptr<const MtpNodeMetadata> >::iterator i = m_listings.begin();
+			i != m_listings.end(); i++)
+	{
+		if (i->second->self.storageId == file.storageId)
+			listings[i->first] = i->second;
+	}
+	for(size_t i = 0; i < file.checked.size(); i++)
+	{
+		if (!file.checked[i] && !listings.count(file.folders[i].self.id))
+			listings[file.folders[i].self.id].reset(new MtpNodeMetadata(folderListing(file, file.folders[i])));
+	}
+
+	std::vector<Folder> folders;
+	std::vector<Object> objects;
+	std::string strings;
+	for(std::map<uint32_t, std::shared_ptr<const MtpNodeMetadata> >::iterator i = listings.begin(); i != listings.end(); i++)
+	{
+		Folder folder;
+		memset(&folder, 0, sizeof(folder));
+		const MtpFolderContents& children = i->second->children;
+		std::vector<MtpFileInfo> infos;
+		infos.reserve(children.size() + 1);
+		infos.push_back(i->second->self);
+		for(size_t c = 0; c < children.size(); c++)
+			infos.push_back(children.info(c));
+		for(std::vector<MtpFileInfo>::iterator info = infos.begin(); info != infos.end(); info++)
+		{
+			Object object;
+			memset(&object, 0, sizeof(object));
+			object.id = info->id;
+			object.parentId = info->parentId;
+			object.filetype = info->filetype;
+			object.nameOffset = strings.size();
+			object.nameLength = info->name.size();
+			object.filesize = info->filesize;
+			object.modificationdate = info->modificationdate;
+			strings += info->name;
+			if (info == infos.begin())
+				folder.self = object;
+			else
+				objects.push_back(object);
+		}
+		folder.firstChild = objects.size() - i->second->children.size();
+		folder.childCount = i->second->children.size();
+		folders.push_back(folder);
+	}
+	if (strings.size() > 0xFFFFFFFFu)
+		return;
+
+	Header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, snapshotMagic, sizeof(snapshotMagic));
+	header.version = snapshotVersion;
+	header.storageId = file.storageId;
+	header.folderCount = folders.size();
+	header.objectCount = objects.size();
+	header.stringBytes = strings.size();
+
+	// Written beside the old one and renamed over it, so a crash doesn't leave half a file.
+	std::string tempPath = file.path.substr(0, file.path.rfind('/')) + "/tmp-listings-XXXXXX";
+	std::vector<char> tempName(tempPath.begin(), tempPath.end());
+	tempName.push_back(0);
+	int fd = mkstemp(&tempName[0]);
+	if (fd == -1)
+	{
+		std::cerr << "Can't save folder listings in " << file.path << ": " << strerror(errno) << std::endl;
+		return;
+	}
+	bool written = writeAll(fd, &header, sizeof(header)) &&
+			writeAll(fd, folders.data(), folders.size() * sizeof(Folder)) &&
+			writeAll(fd, objects.data(), objects.size() * sizeof(Object)) &&
+			writeAll(fd, strings.data(), strings.size());
+	int err = errno;
+	close(fd);
+	if (!written || rename(&tempName[0], file.path.c_str()))
+	{
+		if (written)
+			err = errno;
+		unlink(&tempName[0]);
+		std::cerr << "Can't save folder listings in " << file.path << ": " << strerror(err) << std::endl;
+	}
+}
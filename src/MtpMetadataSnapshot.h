@@ -0,0 +1,133 @@
+/*
+ * MtpMetadataSnapshot.h
+ *
+ *      Author: Jason Ferrara
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+
+#ifndef MTPMETADATASNAPSHOT_H_
+#define MTPMETADATASNAPSHOT_H_
+
+#include "MtpDevice.h"
+#include "MtpNodeMetadata.h"
+#include "Mutex.h"
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <stddef.h>
+
+/*
+ * Folder listings saved when unmounting, so the next mount can list folders
+ * straight away instead of asking the device about each one as it is first
+ * visited. There's a file for each storage in the directory, which is mapped
+ * in rather than read: a header, the listed folders sorted by id, each with
+ * the range of the objects table holding its contents, and the names of
+ * everything one after the other. Numbers are in the machine's byte order,
+ * since the file never leaves it.
+ *
+ * A saved listing may be out of date, so it is only handed out until the
+ * folder has been listed from the device, which MtpSnapshotChecker does for
+ * every folder in the background, those that have been asked for first.
+ * What's saved is what was listed from the device during the mount, plus
+ * whatever saved listings didn't get checked.
+ */
+class MtpMetadataSnapshot
+{
+public:
+	MtpMetadataSnapshot(const std::string& directory, const std::vector<MtpStorageInfo>& storages);
+	~MtpMetadataSnapshot();
+
+	/*
+	 * The saved listing of the folder with id, if there is one and the
+	 * folder hasn't been listed from the device since.
+	 */
+	bool getListing(uint32_t id, MtpNodeMetadata& md);
+
+	/*
+	 * md was just fetched from the device. Folder listings are kept, to be
+	 * saved.
+	 */
+	void listed(const std::shared_ptr<const MtpNodeMetadata>& md);
+
+	/*
+	 * The folder, or file, with id has changed.
+	 */
+	void changed(uint32_t id);
+
+	/*
+	 * The object with id is gone from the device, so the listing of the
+	 * folder it was in is no good any more either.
+	 */
+	void removed(uint32_t id);
+
+	/*
+	 * The next folder whose saved listing hasn't been checked against the
+	 * device. Returns false once there are none.
+	 */
+	bool nextToCheck(uint32_t& storageId, uint32_t& folderId);
+
+	/*
+	 * Writes the listings out for the next mount.
+	 */
+	void save();
+
+private:
+	MtpMetadataSnapshot(const MtpMetadataSnapshot&);
+	MtpMetadataSnapshot& operator=(const MtpMetadataSnapshot&);
+
+	struct Header;
+	struct Object;
+	struct Folder;
+
+	struct StorageFile
+	{
+		uint32_t		storageId;
+		std::string		path;
+		void*			map;
+		size_t			mapSize;
+		const Header*	header;
+		const Folder*	folders;
+		const Object*	objects;
+		const char*		strings;
+		// Saved listings that have since been listed from the device, or
+		// have changed, and are no good any more.
+		std::vector<bool>	checked;
+		size_t			nextToCheck;
+		// The folder each saved object is in, by the object's id.
+		std::unordered_map<uint32_t, size_t>	folderOf;
+	};
+
+	static bool folderIdLess(const Folder& folder, uint32_t id);
+	void load(StorageFile& file);
+	static bool valid(const Header& header, const Folder* folders, const Object* objects);
+	bool findFolder(uint32_t id, size_t& storage, size_t& folder);
+	MtpFileInfo objectInfo(const StorageFile& file, const Object& object);
+	MtpNodeMetadata folderListing(const StorageFile& file, const Folder& folder);
+	void saveStorage(const StorageFile& file);
+
+	std::vector<StorageFile>	m_files;
+	// Listed from the device during this mount, by folder id.
+	std::unordered_map<uint32_t, std::shared_ptr<const MtpNodeMetadata> >	m_listings;
+	// Saved listings that were handed out, by storage and folder index, to be checked first.
+	std::list<std::pair<size_t, size_t> >	m_handedOut;
+	RecursiveMutex				m_mutex;
+};
+
+
+#endif /* MTPMETADATASNAPSHOT_H_ */
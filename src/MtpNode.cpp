@@ -34,38 +34,49 @@ uint32_t MtpNode::Id()
 	return m_id;
 }
 
+uint32_t MtpNode::CurrentId()
+{
+	m_id = m_cache.currentId(m_id);
+	return m_id;
+}
+
 uint32_t MtpNode::GetParentNodeId()
 {
-	MtpNodeMetadata md = m_cache.getItem(m_id, *this);
+	std::shared_ptr<const MtpNodeMetadata> md = m_cache.getItem(m_id, *this);
 
-	if (md.self.parentId == 0)
-		return md.self.storageId;
+	if (md->self.parentId == 0)
+		return md->self.storageId;
 	else
-		return md.self.parentId;
+		return md->self.parentId;
 }
 
 
-std::vector<std::string> MtpNode::readdir()
+std::vector<std::string> MtpNode::readDirectory()
+{
+	throw NotADirectory();
+}
+
+std::unique_ptr<MtpDirectoryListing> MtpNode::openDirectory()
 {
-	std::vector<std::string> result;
-	result.push_back(".");
-	result.push_back("..");
-	std::vector<std::string> entries = readDirectory();
-	result.insert(result.end(), entries.begin(), entries.end());
-	return result;
+	throw NotADirectory();
 }
 
-std::vector<std::string> MtpNode::readDirectory()
+std::unique_ptr<MtpNode> MtpNode::getChild(const std::string& name)
 {
 	throw NotADirectory();
 }
 
 
-void MtpNode::Open()
+std::shared_ptr<MtpLocalFileCopy> MtpNode::Open()
 {
 	throw NotImplemented("Open");
 }
 
+void MtpNode::Fsync()
+{
+	throw NotImplemented("Fsync");
+}
+
 void MtpNode::Close()
 {
 	throw NotImplemented("Close");
@@ -102,6 +113,16 @@ void MtpNode::Truncate(off_t length)
 	throw NotImplemented("Truncate");
 }
 
+void MtpNode::Allocate(off_t length)
+{
+	throw NotImplemented("Allocate");
+}
+
+void MtpNode::setxattr(const std::string& name, const std::string& value)
+{
+	throw XattrNotSupported();
+}
+
 void MtpNode::Rename(MtpNode& newParent, const std::string& newName)
 {
 	throw NotImplemented("Rename");
@@ -119,8 +140,8 @@ uint32_t MtpNode::StorageId()
 
 MtpStorageInfo MtpNode::GetStorageInfo()
 {
-	MtpNodeMetadata md = m_cache.getItem(m_id, *this);
-	return m_device.GetStorageInfo(md.self.storageId);
+	std::shared_ptr<const MtpNodeMetadata> md = m_cache.getItem(m_id, *this);
+	return m_device.GetStorageInfo(md->self.storageId);
 }
 
 void MtpNode::statfs(struct statvfs *stat)
@@ -140,3 +161,8 @@ std::unique_ptr<MtpNode> MtpNode::Clone()
 {
 	throw NotImplemented("Clone");
 }
+
+std::unique_ptr<MtpMetadataCacheFiller> MtpNode::cloneFiller()
+{
+	return Clone();
+}
@@ -23,6 +23,7 @@
 #define MTPNODE_H_
 
 #include "MtpMetadataCache.h"
+#include "MtpDirectoryListing.h"
 #include "MtpFilesystemPath.h"
 #include "MtpDevice.h"
 #include "FuseHeader.h"
@@ -37,16 +38,24 @@ public:
 	MtpNode(MtpDevice& device, MtpMetadataCache& cache, uint32_t id);
 	virtual ~MtpNode();
 
-	virtual std::vector<std::string> readdir();
+	virtual std::unique_ptr<MtpDirectoryListing> openDirectory();
 
 	virtual uint32_t Id();
 
+	/*
+	 * Files get a new id each time changes are written back. This brings
+	 * the node up to date if that has happened since it was created.
+	 */
+	uint32_t CurrentId();
+
 	virtual std::unique_ptr<MtpNode> getNode(const FilesystemPath& path)=0;
+	virtual std::unique_ptr<MtpNode> getChild(const std::string& name);
 
 	virtual std::vector<std::string> readDirectory();
 	virtual void getattr(struct stat& info) = 0;
 
-	virtual void Open();
+	virtual std::shared_ptr<MtpLocalFileCopy> Open();
+	virtual void Fsync();
 	virtual void Close();
 	virtual int Read(char *buf, size_t size, off_t offset);
 	virtual int Write(const char* buf, size_t size, off_t offset);
@@ -60,6 +69,14 @@ public:
 
 	virtual void Truncate(off_t length);
 
+	/*
+	 * Makes a file at least length bytes long. For a new file this is the
+	 * hint that lets it be streamed to the device as it is written.
+	 */
+	virtual void Allocate(off_t length);
+
+	virtual void setxattr(const std::string& name, const std::string& value);
+
 	virtual MtpStorageInfo GetStorageInfo();
 
 
@@ -67,6 +84,7 @@ public:
 	virtual uint32_t StorageId();
 
 	virtual std::unique_ptr<MtpNode> Clone();
+	std::unique_ptr<MtpMetadataCacheFiller> cloneFiller();
 
 	virtual void statfs(struct statvfs *stat);
 
@@ -23,13 +23,15 @@
 #define MTPNODEMETADATA_H_
 
 #include "MtpDevice.h"
+#include "MtpFolderContents.h"
 #include <vector>
+#include <stdint.h>
 
 class MtpNodeMetadata
 {
 public:
 	MtpFileInfo					self;
-	std::vector<MtpFileInfo>	children;
+	MtpFolderContents			children;
 	std::vector<MtpStorageInfo>	storages;
 };
 
@@ -0,0 +1,118 @@
+/*
+ * MtpReadAheadQueue.cpp
+ *
+ *      Author: Jason Ferrara
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+#include "MtpReadAheadQueue.h"
+#include "mtpFilesystemErrors.h"
+#include <algorithm>
+#include <iostream>
+
+// How much of a file is read ahead before it's the next file's turn.
+static const size_t readAheadPieceSize = 1024 * 1024;
+
+MtpReadAheadQueue::MtpReadAheadQueue()
+{
+}
+
+MtpReadAheadQueue::~MtpReadAheadQueue()
+{
+	{
+		LockMutex lock(m_mutex);
+
+		m_queue.clear();
+	}
+	stop();
+}
+
+void MtpReadAheadQueue::add(const std::shared_ptr<MtpLocalFileCopy>& localFile, off_t offset, size_t size)
+{
+	LockMutex lock(m_mutex);
+
+	remove(localFile);
+	Entry entry;
+	entry.localFile = localFile;
+	entry.offset = offset;
+	entry.size = size;
+	m_queue.push_back(entry);
+
+	if (!start())
+	{
+		// The reads will just have to wait for the device.
+		m_queue.clear();
+		return;
+	}
+	m_queueChanged.Signal();
+}
+
+void MtpReadAheadQueue::remove(const std::shared_ptr<MtpLocalFileCopy>& localFile)
+{
+	LockMutex lock(m_mutex);
+
+	for(std::list<Entry>::iterator i = m_queue.begin(); i != m_queue.end(); i++)
+	{
+		if (i->localFile == localFile)
+		{
+			m_queue.erase(i);
+			return;
+		}
+	}
+}
+
+void MtpReadAheadQueue::run()
+{
+	Entry entry;
+	while(next(entry))
+	{
+		try
+		{
+			entry.localFile->prefetch(entry.offset, entry.size);
+		}
+		catch(std::exception&)
+		{
+			// Reading the file will run into the same problem, and report it.
+		}
+		entry.localFile.reset();
+	}
+}
+
+/*
+ * Waits for the next piece of a file to read ahead. Returns false once the
+ * queue is being destroyed.
+ */
+bool MtpReadAheadQueue::next(Entry& entry)
+{
+	LockMutex lock(m_mutex);
+
+	while(m_queue.empty())
+	{
+		if (stopping())
+			return false;
+		m_queueChanged.Wait(m_mutex);
+	}
+	Entry& front = m_queue.front();
+	entry.localFile = front.localFile;
+	entry.offset = front.offset;
+	entry.size = std::min(front.size, readAheadPieceSize);
+	front.offset += entry.size;
+	front.size -= entry.size;
+	if (front.size > 0)
+		m_queue.push_back(front);
+	m_queue.pop_front();
+	return true;
+}
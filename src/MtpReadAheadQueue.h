@@ -0,0 +1,73 @@
+/*
+ * MtpReadAheadQueue.h
+ *
+ *      Author: Jason Ferrara
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+
+#ifndef MTPREADAHEADQUEUE_H_
+#define MTPREADAHEADQUEUE_H_
+
+#include "BackgroundQueue.h"
+#include "MtpLocalFileCopy.h"
+#include <list>
+#include <memory>
+
+/*
+ * Copies parts of files from the device ahead of them being read, from a
+ * background thread, so a program reading a file from start to end doesn't
+ * have to wait for a USB request for every read. Files being read ahead
+ * take turns, a piece at a time.
+ *
+ * Destroying the queue drops whatever hasn't been read ahead yet.
+ */
+class MtpReadAheadQueue : public BackgroundQueue
+{
+public:
+	MtpReadAheadQueue();
+	~MtpReadAheadQueue();
+
+	/*
+	 * Queue reading size bytes at offset of localFile ahead. This replaces
+	 * any part of the file that was queued before and hasn't been read yet.
+	 */
+	void add(const std::shared_ptr<MtpLocalFileCopy>& localFile, off_t offset, size_t size);
+
+	/*
+	 * Stop reading localFile ahead.
+	 */
+	void remove(const std::shared_ptr<MtpLocalFileCopy>& localFile);
+
+private:
+	MtpReadAheadQueue(const MtpReadAheadQueue&);
+	MtpReadAheadQueue& operator=(const MtpReadAheadQueue&);
+
+	struct Entry
+	{
+		std::shared_ptr<MtpLocalFileCopy>	localFile;
+		off_t								offset;
+		size_t								size;
+	};
+
+	void run();
+	bool next(Entry& entry);
+
+	std::list<Entry>	m_queue;
+};
+
+
+#endif /* MTPREADAHEADQUEUE_H_ */
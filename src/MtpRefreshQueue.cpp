@@ -0,0 +1,98 @@
+/*
+ * MtpRefreshQueue.cpp
+ *
+ *      Author: Jason Ferrara
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+#include "MtpRefreshQueue.h"
+#include "MtpMetadataCache.h"
+#include "mtpFilesystemErrors.h"
+
+MtpRefreshQueue::MtpRefreshQueue(MtpMetadataCache& cache) : m_cache(cache)
+{
+}
+
+MtpRefreshQueue::~MtpRefreshQueue()
+{
+	{
+		LockMutex lock(m_mutex);
+
+		m_queue.clear();
+		m_queued.clear();
+	}
+	stop();
+}
+
+void MtpRefreshQueue::add(uint32_t id, std::unique_ptr<MtpMetadataCacheFiller> filler)
+{
+	LockMutex lock(m_mutex);
+
+	if (m_queued.count(id))
+		return;
+	// Without the thread the item stays expired until it is cleared.
+	if (!start())
+		return;
+	Entry entry;
+	entry.id = id;
+	entry.filler = std::move(filler);
+	m_queue.push_back(entry);
+	m_queued.insert(id);
+	m_queueChanged.Signal();
+}
+
+void MtpRefreshQueue::run()
+{
+	Entry entry;
+	while(next(entry))
+	{
+		try
+		{
+			m_cache.refreshQueued(entry.id, *entry.filler);
+		}
+		catch(MtpDeviceDisconnected&)
+		{
+			// Not gone, just out of reach until the mount is torn down.
+		}
+		catch(std::exception&)
+		{
+			// Most likely it's gone. Forget it, so the next lookup finds out.
+			m_cache.clearItem(entry.id);
+		}
+		entry.filler.reset();
+	}
+}
+
+/*
+ * Waits for the next item to fetch. Returns false once the queue is being
+ * destroyed.
+ */
+bool MtpRefreshQueue::next(Entry& entry)
+{
+	LockMutex lock(m_mutex);
+
+	while(m_queue.empty())
+	{
+		if (stopping())
+			return false;
+		m_queueChanged.Wait(m_mutex);
+	}
+	entry = m_queue.front();
+	m_queue.pop_front();
+	// Asking for it again from here on queues it again.
+	m_queued.erase(entry.id);
+	return true;
+}
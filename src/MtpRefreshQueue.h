@@ -0,0 +1,74 @@
+/*
+ * MtpRefreshQueue.h
+ *
+ *      Author: Jason Ferrara
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+
+
+#ifndef MTPREFRESHQUEUE_H_
+#define MTPREFRESHQUEUE_H_
+
+#include "BackgroundQueue.h"
+#include <list>
+#include <memory>
+#include <unordered_set>
+#include <stdint.h>
+
+class MtpMetadataCache;
+class MtpMetadataCacheFiller;
+
+/*
+ * Fetches expired cache items again from a background thread, while the
+ * cache hands out what it had, when the cache is set to refresh in the
+ * background. Items are fetched one at a time, in the order they were
+ * asked for, and each is only queued once.
+ *
+ * Destroying the queue drops whatever hasn't been fetched yet.
+ */
+class MtpRefreshQueue : public BackgroundQueue
+{
+public:
+	MtpRefreshQueue(MtpMetadataCache& cache);
+	~MtpRefreshQueue();
+
+	/*
+	 * Queue fetching the item with id again from filler, unless it is
+	 * queued already.
+	 */
+	void add(uint32_t id, std::unique_ptr<MtpMetadataCacheFiller> filler);
+
+private:
+	MtpRefreshQueue(const MtpRefreshQueue&);
+	MtpRefreshQueue& operator=(const MtpRefreshQueue&);
+
+	struct Entry
+	{
+		uint32_t								id;
+		std::shared_ptr<MtpMetadataCacheFiller>	filler;
+	};
+
+	void run();
+	bool next(Entry& entry);
+
+	MtpMetadataCache&			m_cache;
+	std::list<Entry>			m_queue;
+	std::unordered_set<uint32_t>	m_queued;
+};
+
+
+#endif /* MTPREFRESHQUEUE_H_ */
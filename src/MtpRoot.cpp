@@ -36,38 +36,44 @@ void MtpRoot::getattr(struct stat& info)
 
 std::unique_ptr<MtpNode> MtpRoot::getNode(const FilesystemPath& path)
 {
-	MtpNodeMetadata md = m_cache.getItem(m_id, *this);
-
 	if (path.Empty())
 		throw FileNotFound(path.str());
-	std::string storageName = path.Head();
-	for(std::vector<MtpStorageInfo>::iterator i = md.storages.begin(); i != md.storages.end(); i++)
+	std::unique_ptr<MtpNode> storageDevice = getChild(path.Head());
+	FilesystemPath childPath = path.Body();
+	if (childPath.Empty())
+		return storageDevice;
+	else
+		return storageDevice->getNode(childPath);
+}
+
+std::unique_ptr<MtpNode> MtpRoot::getChild(const std::string& name)
+{
+	std::shared_ptr<const MtpNodeMetadata> md = m_cache.getItem(m_id, *this);
+
+	for(std::vector<MtpStorageInfo>::const_iterator i = md->storages.begin(); i != md->storages.end(); i++)
 	{
-		if (i->description == storageName)
-		{
-			std::unique_ptr<MtpNode> storageDevice(new MtpStorage(m_device, m_cache, i->id));
-			FilesystemPath childPath = path.Body();
-			if (childPath.Empty())
-				return storageDevice;
-			else
-				return storageDevice->getNode(childPath);
-		}
+		if (i->description == name)
+			return std::unique_ptr<MtpNode>(new MtpStorage(m_device, m_cache, i->id));
 	}
-	throw FileNotFound(path.str());
+	throw FileNotFound(name);
 }
 
 
 
 std::vector<std::string> MtpRoot::readDirectory()
 {
-	MtpNodeMetadata md = m_cache.getItem(m_id, *this);
+	std::shared_ptr<const MtpNodeMetadata> md = m_cache.getItem(m_id, *this);
 
 	std::vector<std::string> result;
-	for(std::vector<MtpStorageInfo>::iterator i = md.storages.begin(); i != md.storages.end(); i++)
+	for(std::vector<MtpStorageInfo>::const_iterator i = md->storages.begin(); i != md->storages.end(); i++)
 		result.push_back(i->description);
 	return result;
 }
 
+std::unique_ptr<MtpDirectoryListing> MtpRoot::openDirectory()
+{
+	return std::unique_ptr<MtpDirectoryListing>(new MtpDirectoryListing(m_cache, m_cache.getItem(m_id, *this)));
+}
 
 void MtpRoot::mkdir(const std::string& name)
 {
@@ -95,17 +101,21 @@ MtpStorageInfo MtpRoot::GetStorageInfo()
 	return MtpStorageInfo(0,"",0,0);
 }
 
+std::unique_ptr<MtpNode> MtpRoot::Clone()
+{
+	return std::unique_ptr<MtpNode>(new MtpRoot(m_device, m_cache));
+}
+
 void MtpRoot::statfs(struct statvfs *stat)
 {
 	size_t totalSize = 0;
 	size_t totalFree = 0;
 
-	std::vector<std::string> storages = readDirectory();
-	for(std::vector<std::string>::iterator s = storages.begin(); s != storages.end(); s++)
+	std::vector<MtpStorageInfo> storages = m_device.GetCachedStorageDevices();
+	for(std::vector<MtpStorageInfo>::iterator s = storages.begin(); s != storages.end(); s++)
 	{
-		MtpStorageInfo info = getNode(FilesystemPath(s->c_str()))->GetStorageInfo();
-		totalSize += info.maxCapacity;
-		totalFree += info.freeSpaceInBytes;
+		totalSize += s->maxCapacity;
+		totalFree += s->freeSpaceInBytes;
 	}
 
 	stat->f_bsize = 512;  // We have to pick some block size, so why not 512?
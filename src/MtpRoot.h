@@ -30,9 +30,11 @@ public:
 	MtpRoot(MtpDevice& device, MtpMetadataCache& cache);
 
 	std::unique_ptr<MtpNode> getNode(const FilesystemPath& path);
+	std::unique_ptr<MtpNode> getChild(const std::string& name);
 	void getattr(struct stat& info);
 
 	std::vector<std::string> readDirectory();
+	std::unique_ptr<MtpDirectoryListing> openDirectory();
 
 	void mkdir(const std::string& name);
 	void Remove();
@@ -41,6 +43,8 @@ public:
 	MtpStorageInfo GetStorageInfo();
 
 	void statfs(struct statvfs *stat);
+
+	std::unique_ptr<MtpNode> Clone();
 };
 
 
@@ -0,0 +1,70 @@
+/*
+ * MtpSnapshotChecker.cpp
+ *
+ *      Author: Jason Ferrara
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+#include "MtpSnapshotChecker.h"
+#include "MtpMetadataCache.h"
+#include "MtpFolder.h"
+#include "mtpFilesystemErrors.h"
+
+MtpSnapshotChecker::MtpSnapshotChecker(MtpMetadataCache& cache) : m_cache(cache),
+	m_device(0), m_snapshot(0)
+{
+}
+
+MtpSnapshotChecker::~MtpSnapshotChecker()
+{
+	stop();
+}
+
+void MtpSnapshotChecker::start(MtpDevice& device, MtpMetadataSnapshot& snapshot)
+{
+	LockMutex lock(m_mutex);
+
+	if (m_snapshot)
+		return;
+	m_device = &device;
+	m_snapshot = &snapshot;
+	// If there's no thread the saved listings are still used, just not checked.
+	BackgroundQueue::start();
+}
+
+void MtpSnapshotChecker::run()
+{
+	uint32_t storageId, folderId;
+	while(!stopping() && m_snapshot->nextToCheck(storageId, folderId))
+	{
+		MtpFolder folder(*m_device, m_cache, storageId, folderId);
+		try
+		{
+			m_cache.refreshItem(folder.Id(), folder);
+		}
+		catch(MtpDeviceDisconnected&)
+		{
+			// Keep the rest of the listings for the next mount.
+			return;
+		}
+		catch(std::exception&)
+		{
+			// Most likely the folder is gone. Forget it.
+			m_cache.clearItem(folder.Id());
+		}
+	}
+}
+
@@ -0,0 +1,65 @@
+/*
+ * MtpSnapshotChecker.h
+ *
+ *      Author: Jason Ferrara
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+
+#ifndef MTPSNAPSHOTCHECKER_H_
+#define MTPSNAPSHOTCHECKER_H_
+
+#include "BackgroundQueue.h"
+#include "MtpDevice.h"
+#include "MtpMetadataSnapshot.h"
+
+
+class MtpMetadataCache;
+
+/*
+ * Lists every folder whose saved listing has been loaded from a
+ * MtpMetadataSnapshot again from the device, from a background thread, so
+ * the cache catches up with whatever changed on the device while it wasn't
+ * mounted. A folder is checked the same way as it is listed when it isn't
+ * in the cache, one device request at a time, so other operations only wait
+ * for the request in progress.
+ *
+ * Destroying the checker stops it after the folder it is on.
+ */
+class MtpSnapshotChecker : public BackgroundQueue
+{
+public:
+	MtpSnapshotChecker(MtpMetadataCache& cache);
+	~MtpSnapshotChecker();
+
+	/*
+	 * Start checking the folders in snapshot, if that hasn't started already.
+	 */
+	void start(MtpDevice& device, MtpMetadataSnapshot& snapshot);
+
+private:
+	MtpSnapshotChecker(const MtpSnapshotChecker&);
+	MtpSnapshotChecker& operator=(const MtpSnapshotChecker&);
+
+	void run();
+
+	MtpMetadataCache&		m_cache;
+	MtpDevice*				m_device;
+	MtpMetadataSnapshot*	m_snapshot;
+};
+
+
+#endif /* MTPSNAPSHOTCHECKER_H_ */
@@ -0,0 +1,284 @@
+/*
+ * MtpUploadStream.cpp
+ *
+ *      Author: Jason Ferrara
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+#include "MtpUploadStream.h"
+#include "mtpFilesystemErrors.h"
+#include <algorithm>
+#include <string.h>
+#include <time.h>
+
+// Most data that can be written ahead of what has been sent to the device.
+static const uint64_t uploadStreamBufferSize = 4 * 1024 * 1024;
+// Longest libmtp is kept waiting for the file to be written, while every
+// other call on the device waits behind the upload.
+static const long uploadStallMs = 1000;
+
+MtpUploadStream::MtpUploadStream(MtpDevice& device, uint32_t replacedId, uint64_t size) :
+	m_device(device), m_replacedId(replacedId), m_parentId(0), m_newId(0), m_size(size),
+	m_ring(std::min(size, uploadStreamBufferSize)), m_sent(0), m_filled(0),
+	m_replaced(false), m_finishing(false), m_cancelled(false), m_stalled(false), m_done(false), m_joined(false)
+{
+	int err = pthread_create(&m_thread, 0, threadMain, this);
+	if (err)
+		throw WriteError(err);
+}
+
+MtpUploadStream::~MtpUploadStream()
+{
+	stop();
+}
+
+uint64_t MtpUploadStream::size()
+{
+	return m_size;
+}
+
+uint32_t MtpUploadStream::parentId()
+{
+	LockMutex lock(m_mutex);
+
+	return m_parentId;
+}
+
+void* MtpUploadStream::threadMain(void* stream)
+{
+	((MtpUploadStream*) stream)->run();
+	return 0;
+}
+
+void MtpUploadStream::run()
+{
+	std::vector<char> header;
+	{
+		LockMutex lock(m_mutex);
+
+		// Not started until the ring is full, or the whole file is written,
+		// so the writes have a head start on the device.
+		uint64_t headerSize = std::min(m_size, (uint64_t) MAGIC_BUFFER_SIZE);
+		while(!m_cancelled && (m_filled < (uint64_t) m_ring.size()))
+			m_dataAvailable.Wait(m_mutex);
+		if (m_cancelled)
+		{
+			m_done = true;
+			return;
+		}
+		header.assign(m_ring.begin(), m_ring.begin() + headerSize);
+	}
+
+	try
+	{
+		MtpFileInfo replaced = m_device.GetFileInfo(m_replacedId);
+		{
+			LockMutex lock(m_mutex);
+			m_parentId = replaced.parentId ? replaced.parentId : replaced.storageId;
+			m_replacedInfo = replaced;
+		}
+		NewLIBMTPFile newFile(replaced.name, replaced.parentId, replaced.storageId, m_size);
+		m_device.DeleteObject(replaced);
+		{
+			LockMutex lock(m_mutex);
+			m_replaced = true;
+		}
+		try
+		{
+			m_device.SendFile(newFile, getData, this, &header[0], header.size());
+		}
+		catch(...)
+		{
+			// Don't leave a partly sent file behind.
+			uint32_t partId = ((LIBMTP_file_t*) newFile)->item_id;
+			if (partId)
+			{
+				try
+				{
+					m_device.DeleteObject(MtpFileInfo(partId, replaced.parentId, replaced.storageId,
+							replaced.name, LIBMTP_FILETYPE_UNKNOWN, 0));
+				}
+				catch(std::exception&)
+				{
+				}
+			}
+			throw;
+		}
+		LockMutex lock(m_mutex);
+		m_newId = ((LIBMTP_file_t*) newFile)->item_id;
+		m_newInfo = MtpFileInfo(m_newId, replaced.parentId, replaced.storageId, replaced.name,
+				((LIBMTP_file_t*) newFile)->filetype, m_size);
+	}
+	catch(...)
+	{
+		LockMutex lock(m_mutex);
+		// Giving up on a stalled upload isn't an error. The owner sends its copy instead.
+		if (!m_stalled)
+			m_error = std::current_exception();
+	}
+	LockMutex lock(m_mutex);
+	m_done = true;
+	m_spaceAvailable.Broadcast();
+}
+
+uint16_t MtpUploadStream::getData(void*, void* priv, uint32_t wantlen, unsigned char* data, uint32_t* gotlen)
+{
+	return ((MtpUploadStream*) priv)->take(data, wantlen, *gotlen);
+}
+
+/*
+ * Hands libmtp the next part of the file, once it has been written. This is
+ * called with MtpLibLock held, so rather than wait long for the writes, the
+ * upload is given up on.
+ */
+uint16_t MtpUploadStream::take(unsigned char* data, uint32_t wantLength, uint32_t& gotLength)
+{
+	LockMutex lock(m_mutex);
+
+	uint64_t want = std::min(std::min((uint64_t) wantLength, m_size - m_sent), (uint64_t) m_ring.size());
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += uploadStallMs / 1000;
+	deadline.tv_nsec += (uploadStallMs % 1000) * 1000000;
+	deadline.tv_sec += deadline.tv_nsec / 1000000000;
+	deadline.tv_nsec %= 1000000000;
+	while(!m_cancelled && (m_filled - m_sent < want))
+	{
+		if (!m_dataAvailable.WaitUntil(m_mutex, deadline) && (m_filled - m_sent < want))
+		{
+			m_stalled = true;
+			return LIBMTP_HANDLER_RETURN_CANCEL;
+		}
+	}
+	if (m_cancelled)
+		return LIBMTP_HANDLER_RETURN_CANCEL;
+
+	gotLength = 0;
+	while(gotLength < want)
+	{
+		size_t pos = m_sent % m_ring.size();
+		size_t chunk = std::min(want - gotLength, (uint64_t) (m_ring.size() - pos));
+		memcpy(data + gotLength, &m_ring[pos], chunk);
+		// Ready for the byte a ring's length further on, which hasn't been written.
+		memset(&m_ring[pos], 0, chunk);
+		gotLength += chunk;
+		m_sent += chunk;
+	}
+	m_spaceAvailable.Broadcast();
+	return LIBMTP_HANDLER_RETURN_OK;
+}
+
+bool MtpUploadStream::write(const void* ptr, size_t size, off_t offset)
+{
+	LockMutex lock(m_mutex);
+
+	uint64_t start = offset;
+	uint64_t end = start + size;
+	for(;;)
+	{
+		if (m_error || m_stalled || m_finishing || m_cancelled || (start < m_sent) || (end > m_size))
+			return false;
+		if (end <= m_sent + m_ring.size())
+			break;
+		// Only wait for room if what comes before has been written, or we'd wait forever.
+		if (start > m_filled)
+			return false;
+		m_spaceAvailable.Wait(m_mutex);
+	}
+
+	for(uint64_t p = start; p < end;)
+	{
+		size_t pos = p % m_ring.size();
+		size_t chunk = std::min(end - p, (uint64_t) (m_ring.size() - pos));
+		memcpy(&m_ring[pos], (const char*) ptr + (p - start), chunk);
+		p += chunk;
+	}
+
+	if (start <= m_filled)
+	{
+		m_filled = std::max(m_filled, end);
+		while(!m_written.empty() && (m_written.begin()->first <= m_filled))
+		{
+			m_filled = std::max(m_filled, m_written.begin()->second);
+			m_written.erase(m_written.begin());
+		}
+	}
+	else
+	{
+		uint64_t& writtenEnd = m_written[start];
+		writtenEnd = std::max(writtenEnd, end);
+	}
+	m_dataAvailable.Signal();
+	return true;
+}
+
+uint32_t MtpUploadStream::finish()
+{
+	{
+		LockMutex lock(m_mutex);
+
+		// Whatever hasn't been written is left as zeros.
+		m_finishing = true;
+		m_filled = m_size;
+		m_written.clear();
+		m_dataAvailable.Signal();
+	}
+	if (!m_joined)
+	{
+		pthread_join(m_thread, 0);
+		m_joined = true;
+	}
+	if (m_error)
+		std::rethrow_exception(m_error);
+	return m_newId;
+}
+
+bool MtpUploadStream::discard()
+{
+	stop();
+	if (m_newId && !m_error)
+	{
+		// The whole file was written before it was removed.
+		m_device.DeleteObject(m_newInfo);
+		m_newId = 0;
+	}
+	return !m_replaced;
+}
+
+MtpFileInfo MtpUploadStream::replaced()
+{
+	LockMutex lock(m_mutex);
+
+	return m_replacedInfo;
+}
+
+/*
+ * Cancels the upload if it is still going, and waits for the thread to exit.
+ */
+void MtpUploadStream::stop()
+{
+	{
+		LockMutex lock(m_mutex);
+
+		m_cancelled = true;
+		m_dataAvailable.Signal();
+	}
+	if (!m_joined)
+	{
+		pthread_join(m_thread, 0);
+		m_joined = true;
+	}
+}
@@ -0,0 +1,131 @@
+/*
+ * MtpUploadStream.h
+ *
+ *      Author: Jason Ferrara
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+
+#ifndef MTPUPLOADSTREAM_H_
+#define MTPUPLOADSTREAM_H_
+
+#include "MtpDevice.h"
+#include "Mutex.h"
+#include <exception>
+#include <map>
+#include <vector>
+#include <pthread.h>
+#include <sys/types.h>
+
+/*
+ * Sends a file of a size known in advance to the device while it is being
+ * written, replacing the (empty) remote file it was created as. Writes go
+ * into a ring buffer that a thread of our own feeds to libmtp, so the file
+ * crosses USB once.
+ *
+ * MTP needs the size of a file before its contents, and can't go back, so
+ * only writes at or near the point up to which the file has been sent can
+ * be taken. The owner keeps its own copy of everything written, and deals
+ * with any other write by discarding the upload, which takes whatever it
+ * left on the device away again, and sending its copy instead. Parts of the
+ * file that are never written are sent as zeros, as they would read from a
+ * file extended by fallocate.
+ *
+ * The upload doesn't start until the ring buffer is full, or the whole file
+ * has been written, which also gives the first bytes of the file that are
+ * needed to work out its file type. Until then it can be discarded without
+ * anything having happened on the device. libmtp holds MtpLibLock for the
+ * whole upload, so every other call on the device waits while it waits for
+ * the file to be written. If the writes stop for more than a moment, the
+ * upload is given up on, and the owner sends its copy once the file is
+ * complete instead.
+ */
+class MtpUploadStream
+{
+public:
+	MtpUploadStream(MtpDevice& device, uint32_t replacedId, uint64_t size);
+	~MtpUploadStream();
+
+	uint64_t size();
+
+	/*
+	 * Returns false, without taking anything, if the write can't be streamed,
+	 * or the upload has failed. Blocks while the ring buffer is full.
+	 */
+	bool write(const void* ptr, size_t size, off_t offset);
+
+	/*
+	 * Sends the rest of the file, zero filled, and waits for the upload to
+	 * complete. Returns the id of the new remote file, or 0 if the upload
+	 * was given up on because the file wasn't written quickly enough. Throws
+	 * if the upload failed.
+	 */
+	uint32_t finish();
+
+	/*
+	 * Stops the upload wherever it is, removing anything it left on the
+	 * device. Returns true if the replaced remote file is still there.
+	 * Otherwise replaced() is what it was, for sending the owner's copy as.
+	 */
+	bool discard();
+	MtpFileInfo replaced();
+
+	/*
+	 * The folder the file is in.
+	 */
+	uint32_t parentId();
+
+private:
+	MtpUploadStream(const MtpUploadStream&);
+	MtpUploadStream& operator=(const MtpUploadStream&);
+
+	static void* threadMain(void* stream);
+	void run();
+	static uint16_t getData(void* params, void* priv, uint32_t wantlen, unsigned char* data, uint32_t* gotlen);
+	uint16_t take(unsigned char* data, uint32_t wantLength, uint32_t& gotLength);
+	void stop();
+
+	MtpDevice&			m_device;
+	uint32_t			m_replacedId;
+	uint32_t			m_parentId;
+	uint32_t			m_newId;
+	MtpFileInfo			m_newInfo;
+	MtpFileInfo			m_replacedInfo;
+	uint64_t			m_size;
+	// Byte n of the file is at m_ring[n % m_ring.size()] while it is in the
+	// window that starts at m_sent. Bytes that haven't been written are 0.
+	std::vector<char>	m_ring;
+	uint64_t			m_sent;
+	// Everything before m_filled has been written.
+	uint64_t			m_filled;
+	// Ranges written beyond m_filled, by start.
+	std::map<uint64_t, uint64_t>	m_written;
+	bool				m_replaced;
+	bool				m_finishing;
+	bool				m_cancelled;
+	// Given up on, after waiting too long for the file to be written.
+	bool				m_stalled;
+	bool				m_done;
+	bool				m_joined;
+	std::exception_ptr	m_error;
+	pthread_t			m_thread;
+	RecursiveMutex		m_mutex;
+	ConditionVariable	m_dataAvailable;
+	ConditionVariable	m_spaceAvailable;
+};
+
+
+#endif /* MTPUPLOADSTREAM_H_ */
@@ -0,0 +1,168 @@
+/*
+ * MtpWriteBackQueue.cpp
+ *
+ *      Author: Jason Ferrara
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+#include "MtpWriteBackQueue.h"
+#include "MtpMetadataCache.h"
+#include "mtpFilesystemErrors.h"
+#include <algorithm>
+#include <iostream>
+
+// How long a file waits in the queue before it is written back.
+static const long writeBackDelayMs = 500;
+// How long a file that failed to write back waits before it is tried again,
+// doubling with each failure up to the most.
+static const long firstRetryDelayMs = 1000;
+static const long maxRetryDelayMs = 5 * 60 * 1000;
+
+static void dueIn(struct timespec& due, long delayMs)
+{
+	clock_gettime(CLOCK_REALTIME, &due);
+	due.tv_sec += delayMs / 1000;
+	due.tv_nsec += (delayMs % 1000) * 1000000;
+	due.tv_sec += due.tv_nsec / 1000000000;
+	due.tv_nsec %= 1000000000;
+}
+
+static bool later(const struct timespec& a, const struct timespec& b)
+{
+	return (a.tv_sec > b.tv_sec) || ((a.tv_sec == b.tv_sec) && (a.tv_nsec > b.tv_nsec));
+}
+
+MtpWriteBackQueue::MtpWriteBackQueue(MtpMetadataCache& cache) : m_cache(cache)
+{
+}
+
+MtpWriteBackQueue::~MtpWriteBackQueue()
+{
+	stop();
+}
+
+void MtpWriteBackQueue::add(const std::shared_ptr<MtpLocalFileCopy>& localFile, uint32_t parentId)
+{
+	LockMutex lock(m_mutex);
+
+	for(std::list<Entry>::iterator i = m_queue.begin(); i != m_queue.end(); i++)
+	{
+		if (i->localFile == localFile)
+		{
+			i->parentId = parentId;
+			return;
+		}
+	}
+
+	Entry entry;
+	entry.localFile = localFile;
+	entry.parentId = parentId;
+	entry.retryDelayMs = 0;
+	dueIn(entry.due, writeBackDelayMs);
+	m_queue.push_back(entry);
+
+	if (!start())
+	{
+		// Write it back now rather than not at all.
+		m_queue.pop_back();
+		m_cache.writeBackQueued(localFile, parentId);
+		return;
+	}
+	m_queueChanged.Signal();
+}
+
+void MtpWriteBackQueue::run()
+{
+	Entry entry;
+	while(next(entry))
+	{
+		try
+		{
+			m_cache.writeBackQueued(entry.localFile, entry.parentId);
+		}
+		catch(MtpDeviceDisconnected&)
+		{
+			// The mount is about to be torn down, so there's no point trying again.
+			entry.localFile->writeBackFailed(std::current_exception());
+		}
+		catch(std::exception& e)
+		{
+			// The changes stay in the local copy.
+			std::cerr << "Failed to write back changes: " << e.what() << std::endl;
+			entry.localFile->writeBackFailed(std::current_exception());
+			retry(entry);
+		}
+		entry.localFile.reset();
+	}
+}
+
+/*
+ * Queues a file that failed to write back again, unless the queue is being
+ * destroyed. Then the local copy gets one last try when it is destroyed.
+ */
+void MtpWriteBackQueue::retry(Entry& entry)
+{
+	LockMutex lock(m_mutex);
+
+	if (stopping())
+		return;
+	// It may have been queued again since, in which case that's soon enough.
+	for(std::list<Entry>::iterator i = m_queue.begin(); i != m_queue.end(); i++)
+	{
+		if (i->localFile == entry.localFile)
+			return;
+	}
+	entry.retryDelayMs = entry.retryDelayMs ? std::min(entry.retryDelayMs * 2, maxRetryDelayMs) : firstRetryDelayMs;
+	dueIn(entry.due, entry.retryDelayMs);
+	// Keep the queue in the order things are due.
+	std::list<Entry>::iterator i = m_queue.end();
+	while (i != m_queue.begin())
+	{
+		std::list<Entry>::iterator before = i;
+		before--;
+		if (!later(before->due, entry.due))
+			break;
+		i = before;
+	}
+	m_queue.insert(i, entry);
+	m_queueChanged.Signal();
+}
+
+/*
+ * Waits for the next file that is due to be written back. Returns false
+ * once the queue is being destroyed and is empty. When it is being destroyed
+ * the remaining files are written back without waiting.
+ */
+bool MtpWriteBackQueue::next(Entry& entry)
+{
+	LockMutex lock(m_mutex);
+
+	for(;;)
+	{
+		if (m_queue.empty())
+		{
+			if (stopping())
+				return false;
+			m_queueChanged.Wait(m_mutex);
+		}
+		else if (stopping() || !m_queueChanged.WaitUntil(m_mutex, m_queue.front().due))
+		{
+			entry = m_queue.front();
+			m_queue.pop_front();
+			return true;
+		}
+	}
+}
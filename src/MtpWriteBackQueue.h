@@ -0,0 +1,83 @@
+/*
+ * MtpWriteBackQueue.h
+ *
+ *      Author: Jason Ferrara
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+
+#ifndef MTPWRITEBACKQUEUE_H_
+#define MTPWRITEBACKQUEUE_H_
+
+#include "BackgroundQueue.h"
+#include "MtpLocalFileCopy.h"
+#include <list>
+#include <memory>
+
+class MtpMetadataCache;
+
+/*
+ * Writes changed files back to the device from a background thread, so
+ * closing a file doesn't have to wait for it to be uploaded. Files are
+ * written back in the order they were queued, each a short while after it
+ * was queued. That delay lets whoever is copying files create the next one
+ * on the device before the upload of the previous one ties up the device.
+ *
+ * A file that fails to write back keeps its changes, and is queued again to
+ * be tried after a delay that doubles with each failure. The error is kept
+ * with the local copy, for the next open, flush or fsync of the file to
+ * return, since once fuse is in the background nobody sees what we print.
+ *
+ * Destroying the queue waits until everything in it has been written back,
+ * or failed to be without being tried again.
+ */
+class MtpWriteBackQueue : public BackgroundQueue
+{
+public:
+	MtpWriteBackQueue(MtpMetadataCache& cache);
+	~MtpWriteBackQueue();
+
+	/*
+	 * Queue localFile to be written back. parentId is the folder whose
+	 * listing changes when it is. A file that is already waiting keeps its
+	 * place in the queue, so closing it again before then doesn't upload
+	 * it twice.
+	 */
+	void add(const std::shared_ptr<MtpLocalFileCopy>& localFile, uint32_t parentId);
+
+private:
+	MtpWriteBackQueue(const MtpWriteBackQueue&);
+	MtpWriteBackQueue& operator=(const MtpWriteBackQueue&);
+
+	struct Entry
+	{
+		std::shared_ptr<MtpLocalFileCopy>	localFile;
+		uint32_t							parentId;
+		struct timespec						due;
+		// Wait before trying again after the last failure, 0 if there wasn't one.
+		long								retryDelayMs;
+	};
+
+	void run();
+	bool next(Entry& entry);
+	void retry(Entry& entry);
+
+	MtpMetadataCache&	m_cache;
+	std::list<Entry>	m_queue;
+};
+
+
+#endif /* MTPWRITEBACKQUEUE_H_ */
@@ -21,6 +21,7 @@
 
 #include "Mutex.h"
 
+#include <errno.h>
 #include <sstream>
 #include <stdexcept>
 
@@ -68,4 +69,36 @@ LockMutex::~LockMutex()
 	m_mutex.Unlock();
 }
 
+ConditionVariable::ConditionVariable()
+{
+	checkPthreadError(pthread_cond_init(&m_cond, 0));
+}
+
+ConditionVariable::~ConditionVariable()
+{
+	pthread_cond_destroy(&m_cond);
+}
+
+void ConditionVariable::Wait(RecursiveMutex& mutex)
+{
+	checkPthreadError(pthread_cond_wait(&m_cond, &mutex.m_mutex));
+}
 
+bool ConditionVariable::WaitUntil(RecursiveMutex& mutex, const struct timespec& deadline)
+{
+	int err = pthread_cond_timedwait(&m_cond, &mutex.m_mutex, &deadline);
+	if (err == ETIMEDOUT)
+		return false;
+	checkPthreadError(err);
+	return true;
+}
+
+void ConditionVariable::Signal()
+{
+	checkPthreadError(pthread_cond_signal(&m_cond));
+}
+
+void ConditionVariable::Broadcast()
+{
+	checkPthreadError(pthread_cond_broadcast(&m_cond));
+}
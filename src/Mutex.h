@@ -23,6 +23,7 @@
 #define MUTEX_H_
 
 #include <pthread.h>
+#include <time.h>
 
 class RecursiveMutex
 {
@@ -34,6 +35,8 @@ public:
 	void Unlock();
 
 protected:
+	friend class ConditionVariable;
+
 	pthread_mutex_t	m_mutex;
 };
 
@@ -47,6 +50,31 @@ protected:
 	RecursiveMutex&	m_mutex;
 };
 
+/*
+ * The mutex passed to Wait and WaitUntil must be locked exactly once by the
+ * calling thread, since waiting only releases one level of a recursive lock.
+ */
+class ConditionVariable
+{
+public:
+	ConditionVariable();
+	~ConditionVariable();
+
+	void Wait(RecursiveMutex& mutex);
+
+	/*
+	 * Like Wait, but gives up at deadline (measured against CLOCK_REALTIME).
+	 * Returns false if it gave up.
+	 */
+	bool WaitUntil(RecursiveMutex& mutex, const struct timespec& deadline);
+
+	void Signal();
+	void Broadcast();
+
+protected:
+	pthread_cond_t	m_cond;
+};
+
 
 
 
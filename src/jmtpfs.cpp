@@ -18,17 +18,16 @@
  * Boston, MA 02111-1301, USA.
  * licensing@fsf.org
  */
-#define FUSE_USE_VERSION 26
 #include "ConnectedMtpDevices.h"
 #include "mtpFilesystemErrors.h"
 #include "Mutex.h"
-#include "FuseHeader.h"
-#include "MtpFuseContext.h"
-#include "MtpRoot.h"
+#include "jmtpfs.h"
 
+#include <algorithm>
 #include <iostream>
 #include <cstddef>
 #include <errno.h>
+#include <stdlib.h>
 #include <sstream>
 #include <iomanip>
 #include <assert.h>
@@ -38,251 +37,25 @@
 
 using namespace std;
 
-/*
- * A global lock for filesystem operations. I really didn't want to do this, but trying to keep everything
- * in sync when different threads accessed the same nodes in the filesystem was getting way to complicated.
- * So for now just to get something working I've pulled out all the lower level synchronization code and
- * we'll just use the global lock here.
- */
-RecursiveMutex	globalLock;
-
-#define FUSE_ERROR_BLOCK_START \
-	try \
-	{ \
-	LockMutex lock(globalLock); \
-	    MtpFuseContext* context((MtpFuseContext*)(fuse_get_context()->private_data)); \
-
-#define FUSE_ERROR_BLOCK_END \
-	} \
-	catch(FileNotFound&) \
-	{ \
-		return -ENOENT; \
-	} \
-	catch(MtpDeviceDisconnected&) \
-	{ \
-		exit(-1); \
-	} \
-	catch(MtpFilesystemErrorWithErrorCode& e) \
-	{ \
-		return -(e.ErrorCode()); \
-	} \
-	catch(std::exception&) \
-	{ \
-		return -EIO; \
-	}
-
-
-
-extern "C" int jmtpfs_getattr(const char* pathStr, struct stat* info)
-{
-	FUSE_ERROR_BLOCK_START
-
-		FilesystemPath path(pathStr);
-		context->getNode(path)->getattr(*info);
-		info->st_uid = context->uid();
-		info->st_gid = context->gid();
-		return 0;
-
-	FUSE_ERROR_BLOCK_END
-
-}
-
-extern "C" int jmtpfs_readdir(const char* pathStr, void* buf, fuse_fill_dir_t filler,
-		off_t offset, struct fuse_file_info *fi)
-{
-	FUSE_ERROR_BLOCK_START
-
-		FilesystemPath path(pathStr);
-		std::unique_ptr<MtpNode> n = context->getNode(path);
-		std::vector<std::string> contents = n->readdir();
-		for(std::vector<std::string>::iterator i = contents.begin(); i != contents.end(); i++)
-		{
-			if (filler(buf,i->c_str(),0, 0))
-				return 0;
-		}
-		return 0;
-
-	FUSE_ERROR_BLOCK_END
-}
-
-
-extern "C" int jmtpfs_open(const char *pathStr, struct fuse_file_info *)
-{
-	FUSE_ERROR_BLOCK_START
-
-	FilesystemPath path(pathStr);
-	context->getNode(path)->Open();
-	return 0;
-
-	FUSE_ERROR_BLOCK_END
-}
-
-extern "C" int jmtpfs_release(const char *pathStr, struct fuse_file_info *)
-{
-	FUSE_ERROR_BLOCK_START
-
-	FilesystemPath path(pathStr);
-	context->getNode(path)->Close();
-	return 0;
-
-	FUSE_ERROR_BLOCK_END
-}
-
-extern "C" int jmtpfs_read(const char *pathStr, char *buf, size_t  size, off_t offset, struct fuse_file_info *)
-{
-	FUSE_ERROR_BLOCK_START
-
-	FilesystemPath path(pathStr);
-	return context->getNode(path)->Read(buf,size,offset);
-
-	FUSE_ERROR_BLOCK_END
-}
-
-extern "C" int jmtpfs_mkdir(const char* pathStr, mode_t mode)
-{
-	FUSE_ERROR_BLOCK_START
-
-	FilesystemPath path(pathStr);
-	context->getNode(path.AllButTail())->mkdir(path.Tail());
-	return 0;
-
-	FUSE_ERROR_BLOCK_END
-}
-
-extern "C" int jmtpfs_rmdir(const char* pathStr)
-{
-	FUSE_ERROR_BLOCK_START
-
-	FilesystemPath path(pathStr);
-	context->getNode(path)->Remove();
-	return 0;
-
-	FUSE_ERROR_BLOCK_END
-}
-
-
-extern "C" int jmtpfs_create(const char* pathStr, mode_t mode, struct fuse_file_info *fileInfo)
-{
-	FUSE_ERROR_BLOCK_START
-
-	FilesystemPath path(pathStr);
-	std::unique_ptr<MtpNode> n = context->getNode(path.AllButTail());
-	n->CreateFile(path.Tail());
-	n = context->getNode(path);
-	n->Open();
-	return 0;
-
-	FUSE_ERROR_BLOCK_END
-}
-
-extern "C" int jmtpfs_write(const char *pathStr, const char *data, size_t size, off_t offset, struct fuse_file_info *)
-{
-	FUSE_ERROR_BLOCK_START
-
-	FilesystemPath path(pathStr);
-	return context->getNode(path)->Write(data, size, offset);
-
-	FUSE_ERROR_BLOCK_END
-}
-
-extern "C" int jmtpfs_truncate(const char *pathStr, off_t length)
-{
-	FUSE_ERROR_BLOCK_START
-
-	FilesystemPath path(pathStr);
-	context->getNode(path)->Truncate(length);
-	return 0;
-
-	FUSE_ERROR_BLOCK_END
-}
-
-extern "C" int jmtpfs_unlink(const char *pathStr)
-{
-	FUSE_ERROR_BLOCK_START
-
-	FilesystemPath path(pathStr);
-	context->getNode(path)->Remove();
-	return 0;
-
-	FUSE_ERROR_BLOCK_END
-}
-
-extern "C" int jmtpfs_flush(const char *pathStr, struct fuse_file_info *)
-{
-	FUSE_ERROR_BLOCK_START
-
-	FilesystemPath path(pathStr);
-	context->getNode(path)->Close();
-	return 0;
-
-	FUSE_ERROR_BLOCK_END
-}
-
-
-extern "C" int jmtpfs_rename(const char *pathStr, const char *newPathStr)
-{
-	FUSE_ERROR_BLOCK_START
-
-	FilesystemPath path(pathStr);
-	std::unique_ptr<MtpNode> n = context->getNode(path);
-	FilesystemPath newPath(newPathStr);
-	std::unique_ptr<MtpNode> newParent = context->getNode(newPath.AllButTail());
-	n->Rename(*newParent, newPath.Tail());
-
-	return 0;
-
-	FUSE_ERROR_BLOCK_END
-}
-
-extern "C" int jmtpfs_statfs(const char *pathStr, struct statvfs *stat)
-{
-	FUSE_ERROR_BLOCK_START
-
-	FilesystemPath path(pathStr);
-	std::unique_ptr<MtpNode> n = context->getNode(path);
-	n->statfs(stat);
-	return 0;
-
-	FUSE_ERROR_BLOCK_END
-}
-
-extern "C" int jmtpfs_chmod(const char* pathStr, mode_t mode)
-{
-	FUSE_ERROR_BLOCK_START
-
-	FilesystemPath path(pathStr);
-	context->getNode(path);
-	// a noop since mtp doesn't support permissions. But we need to pretend
-    // to do it to make things like "cp -r" and the mac finder happy.
-
-	return 0;
-	FUSE_ERROR_BLOCK_END
-}
-
-extern "C" int jmtpfs_utime(const char* pathStr, struct utimbuf*)
-{
-	FUSE_ERROR_BLOCK_START
-
-	FilesystemPath path(pathStr);
-	context->getNode(path);
-	// a noop since mtp doesn't support permissions. But we need to pretend
-    // to do it to make things like "cp -r" and the mac finder happy.
-
-	return 0;
-	FUSE_ERROR_BLOCK_END
-}
-
-
 struct jmtpfs_options
 {
 	jmtpfs_options() : listDevices(0), displayHelp(0),
-			showVersion(0), device(0), listStorage(0) {}
+			showVersion(0), device(0), listStorage(0), statfsTimeout(-1),
+			cacheDir(0), cacheSize(1024), cacheTimeout(-1), backgroundRefresh(0),
+			metadataCacheSize(64), cacheStats(0) {}
 
 	int	listDevices;
 	int displayHelp;
 	int showVersion;
 	int listStorage;
 	char* device;
+	int statfsTimeout;
+	char* cacheDir;
+	int cacheSize;
+	int cacheTimeout;
+	int backgroundRefresh;
+	int metadataCacheSize;
+	int cacheStats;
 };
 
 static struct fuse_opt jmtpfs_opts[] = {
@@ -293,36 +66,21 @@ static struct fuse_opt jmtpfs_opts[] = {
 		{"-h", offsetof(struct jmtpfs_options, displayHelp), 1},
 		{"--help", offsetof(struct jmtpfs_options, displayHelp),1},
 		{"-device=%s", offsetof(struct jmtpfs_options, device),0},
+		{"-statfs_timeout=%d", offsetof(struct jmtpfs_options, statfsTimeout),0},
+		{"-cache_dir=%s", offsetof(struct jmtpfs_options, cacheDir),0},
+		{"-cache_size=%d", offsetof(struct jmtpfs_options, cacheSize),0},
+		{"-cache_timeout=%d", offsetof(struct jmtpfs_options, cacheTimeout),0},
+		{"-background_refresh", offsetof(struct jmtpfs_options, backgroundRefresh),1},
+		{"-metadata_cache_size=%d", offsetof(struct jmtpfs_options, metadataCacheSize),0},
+		{"-cache_stats", offsetof(struct jmtpfs_options, cacheStats),1},
 		{"-V", offsetof(struct jmtpfs_options, showVersion),1},
 		{"--version", offsetof(struct jmtpfs_options, showVersion),1},
 		FUSE_OPT_END
 };
 
 
-static struct fuse_operations jmtpfs_oper = {
-		0,
-};
-
 int main(int argc, char *argv[])
 {
-
-	jmtpfs_oper.getattr = jmtpfs_getattr;
-	jmtpfs_oper.readdir = jmtpfs_readdir;
-	jmtpfs_oper.open = jmtpfs_open;
-	jmtpfs_oper.release = jmtpfs_release;
-	jmtpfs_oper.read = jmtpfs_read;
-	jmtpfs_oper.mkdir = jmtpfs_mkdir;
-	jmtpfs_oper.rmdir = jmtpfs_rmdir;
-	jmtpfs_oper.create = jmtpfs_create;
-	jmtpfs_oper.write = jmtpfs_write;
-	jmtpfs_oper.truncate = jmtpfs_truncate;
-	jmtpfs_oper.unlink = jmtpfs_unlink;
-	jmtpfs_oper.flush = jmtpfs_flush;
-	jmtpfs_oper.rename = jmtpfs_rename;
-	jmtpfs_oper.statfs = jmtpfs_statfs;
-	jmtpfs_oper.chmod = jmtpfs_chmod;
-	jmtpfs_oper.utime = jmtpfs_utime;
-
 	jmtpfs_options options;
 
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
@@ -453,8 +211,24 @@ int main(int argc, char *argv[])
 			std::cerr << "Requested device not found" << std::endl;
 			return -1;
 		}
+		if (options.statfsTimeout >= 0)
+			device->SetStorageTimeout(options.statfsTimeout);
 
 		context = std::unique_ptr<MtpFuseContext>(new MtpFuseContext(std::move(device), getuid(), getgid()));
+		if (options.cacheTimeout >= 0)
+			context->setCacheTimeout(options.cacheTimeout);
+		context->setBackgroundRefresh(options.backgroundRefresh);
+		context->setMetadataCacheSize((size_t) std::max(options.metadataCacheSize, 0) * 1024 * 1024);
+		if (options.cacheDir)
+		{
+			// fuse changes to / when it goes into the background.
+			std::string cacheDir(options.cacheDir);
+			char* cwd = getcwd(0, 0);
+			if ((cacheDir[0] != '/') && cwd)
+				cacheDir = std::string(cwd) + "/" + cacheDir;
+			free(cwd);
+			context->useDiskCache(cacheDir, (uint64_t) std::max(options.cacheSize, 0) * 1024 * 1024);
+		}
 
 	}
 
@@ -469,7 +243,21 @@ int main(int argc, char *argv[])
 	fuse_opt_add_arg(&args, "-s"); // bug in fuse4x where multithreaded sometimes doesn't exit correctly.
 #endif
 
-	int result = fuse_main(args.argc, args.argv, &jmtpfs_oper, context.get());
+	int result = jmtpfs_fuse_main(&args, context.get());
+	if (context && context->deviceDisconnected())
+	{
+		std::cerr << "Device disconnected" << std::endl;
+		result = -1;
+	}
+
+	if (options.cacheStats && context)
+	{
+		MtpMetadataCacheStats stats = context->metadataCacheStats();
+		std::cerr << "metadata cache: " << stats.hits << " hits, " << stats.misses << " misses, " <<
+				stats.staleHits << " stale hits, " << stats.refreshes << " background refreshes, " <<
+				stats.evictions << " evictions, " << stats.entries << " entries using " <<
+				stats.bytes << " bytes" << std::endl;
+	}
 
 	if (options.displayHelp)
 	{
@@ -477,6 +265,13 @@ int main(int argc, char *argv[])
 		std::cout << "    -l    --listDevices         list available mtp devices and then exit" << std::endl;
 //		std::cout << "    -ls   --listStorage         list the storage areas on the device (or all devices if -l is also specified)" << std::endl;
 		std::cout << "    -device=<busnum>,<devnum>   Device to mount. It not specified the first device found is used"<< std::endl;
+		std::cout << "    -statfs_timeout=<seconds>   How often free space is fetched from the device (default 30)"<< std::endl;
+		std::cout << "    -cache_dir=<directory>      Keep copies of files read from the device here, for later mounts"<< std::endl;
+		std::cout << "    -cache_size=<megabytes>     Most space used in the cache directory (default 1024)"<< std::endl;
+		std::cout << "    -cache_timeout=<seconds>    How long folder listings and file details are kept before asking the device again"<< std::endl;
+		std::cout << "    -background_refresh         Answer from out of date folder listings and file details while getting them again"<< std::endl;
+		std::cout << "    -metadata_cache_size=<megabytes> Most memory used for folder listings and file details (default 64)"<< std::endl;
+		std::cout << "    -cache_stats                Print how well folder listings and file details were cached when unmounted"<< std::endl;
 
 	}
 
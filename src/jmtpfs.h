@@ -0,0 +1,38 @@
+/*
+ * jmtpfs.h
+ *
+ *      Author: Jason Ferrara
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+
+#ifndef JMTPFS_H_
+#define JMTPFS_H_
+
+#include "FuseHeader.h"
+#include "MtpFuseContext.h"
+
+/*
+ * Runs the filesystem using whichever fuse frontend was built. By default
+ * that is the inode based low level api (jmtpfs_lowlevel.cpp). Configuring
+ * with --enable-highlevel builds the path based high level api
+ * (jmtpfs_highlevel.cpp) instead.
+ *
+ * context is null if only the help or version text was asked for.
+ */
+int jmtpfs_fuse_main(struct fuse_args* args, MtpFuseContext* context);
+
+#endif /* JMTPFS_H_ */
@@ -0,0 +1,438 @@
+/*
+ * jmtpfs_highlevel.cpp
+ *
+ *      Author: Jason Ferrara
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+#include "jmtpfs.h"
+#include "mtpFilesystemErrors.h"
+#include "Mutex.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+
+/*
+ * There is no global lock for filesystem operations. The metadata cache and each local file copy
+ * do their own locking, and the device is serialized by MtpLibLock, so lookups, reads and writes of
+ * data we already have never wait behind a transfer to or from the device. Operations that change
+ * the structure of the filesystem use FUSE_MUTATION_BLOCK_START to also take the context's mutation lock.
+ */
+#define FUSE_ERROR_BLOCK_START \
+	try \
+	{ \
+	    MtpFuseContext* context((MtpFuseContext*)(fuse_get_context()->private_data)); \
+
+#define FUSE_MUTATION_BLOCK_START \
+	FUSE_ERROR_BLOCK_START \
+	LockMutex lock(context->mutationLock()); \
+
+#define FUSE_ERROR_BLOCK_END \
+	} \
+	catch(FileNotFound&) \
+	{ \
+		return -ENOENT; \
+	} \
+	catch(MtpFilesystemErrorWithErrorCode& e) \
+	{ \
+		return -(e.ErrorCode()); \
+	} \
+	catch(std::exception&) \
+	{ \
+		return -EIO; \
+	}
+
+
+
+extern "C" int jmtpfs_getattr(const char* pathStr, struct stat* info)
+{
+	FUSE_ERROR_BLOCK_START
+
+		FilesystemPath path(pathStr);
+		context->getNode(path)->getattr(*info);
+		info->st_uid = context->uid();
+		info->st_gid = context->gid();
+		return 0;
+
+	FUSE_ERROR_BLOCK_END
+
+}
+
+class HighLevelDirectoryFiller : public MtpDirectoryFiller
+{
+public:
+	HighLevelDirectoryFiller(void* buf, fuse_fill_dir_t filler) : m_buf(buf), m_filler(filler) {}
+
+	bool add(const char* name, const struct stat& info, off_t next)
+	{
+		return m_filler(m_buf, name, &info, next) == 0;
+	}
+
+protected:
+	void*			m_buf;
+	fuse_fill_dir_t	m_filler;
+};
+
+extern "C" int jmtpfs_opendir(const char* pathStr, struct fuse_file_info *fi)
+{
+	FUSE_ERROR_BLOCK_START
+
+		FilesystemPath path(pathStr);
+		fi->fh = context->openDirectoryHandle(context->getNode(path));
+		return 0;
+
+	FUSE_ERROR_BLOCK_END
+}
+
+extern "C" int jmtpfs_readdir(const char* pathStr, void* buf, fuse_fill_dir_t filler,
+		off_t offset, struct fuse_file_info *fi)
+{
+	FUSE_ERROR_BLOCK_START
+
+		HighLevelDirectoryFiller dirFiller(buf, filler);
+		context->directoryHandle(fi->fh).readdir(dirFiller, offset);
+		return 0;
+
+	FUSE_ERROR_BLOCK_END
+}
+
+extern "C" int jmtpfs_releasedir(const char* pathStr, struct fuse_file_info *fi)
+{
+	FUSE_ERROR_BLOCK_START
+
+		context->releaseDirectoryHandle(fi->fh);
+		return 0;
+
+	FUSE_ERROR_BLOCK_END
+}
+
+
+extern "C" int jmtpfs_open(const char *pathStr, struct fuse_file_info *fi)
+{
+	FUSE_ERROR_BLOCK_START
+
+	FilesystemPath path(pathStr);
+	fi->fh = context->openFileHandle(context->getNode(path));
+	return 0;
+
+	FUSE_ERROR_BLOCK_END
+}
+
+extern "C" int jmtpfs_flush(const char *pathStr, struct fuse_file_info *fi)
+{
+	FUSE_ERROR_BLOCK_START
+
+	// Fuse sends one of these for every close of every duplicated descriptor,
+	// so nothing is written back here. It only passes on an earlier failure.
+	context->fileHandle(fi->fh).flush();
+	return 0;
+
+	FUSE_ERROR_BLOCK_END
+}
+
+extern "C" int jmtpfs_release(const char *pathStr, struct fuse_file_info *fi)
+{
+	FUSE_ERROR_BLOCK_START
+
+	// Changes go to the device once the last handle to the file is released,
+	// or on fsync.
+	context->releaseFileHandle(fi->fh);
+	return 0;
+
+	FUSE_ERROR_BLOCK_END
+}
+
+extern "C" int jmtpfs_read(const char *pathStr, char *buf, size_t  size, off_t offset, struct fuse_file_info *fi)
+{
+	FUSE_ERROR_BLOCK_START
+
+	return context->fileHandle(fi->fh).read(buf,size,offset);
+
+	FUSE_ERROR_BLOCK_END
+}
+
+#if FUSE_VERSION >= 29
+extern "C" int jmtpfs_read_buf(const char *pathStr, struct fuse_bufvec **bufp, size_t size, off_t offset,
+		struct fuse_file_info *fi)
+{
+	FUSE_ERROR_BLOCK_START
+
+	// Let fuse take the data straight from the local copy, spliced if the kernel supports it.
+	struct fuse_bufvec buf = FUSE_BUFVEC_INIT(size);
+	context->fileHandle(fi->fh).readBuf(buf, offset);
+	*bufp = (struct fuse_bufvec*) malloc(sizeof(buf));
+	if (*bufp == 0)
+		return -ENOMEM;
+	**bufp = buf;
+	return 0;
+
+	FUSE_ERROR_BLOCK_END
+}
+#endif
+
+extern "C" int jmtpfs_mkdir(const char* pathStr, mode_t mode)
+{
+	FUSE_MUTATION_BLOCK_START
+
+	FilesystemPath path(pathStr);
+	context->getNode(path.AllButTail())->mkdir(path.Tail());
+	return 0;
+
+	FUSE_ERROR_BLOCK_END
+}
+
+extern "C" int jmtpfs_rmdir(const char* pathStr)
+{
+	FUSE_MUTATION_BLOCK_START
+
+	FilesystemPath path(pathStr);
+	context->getNode(path)->Remove();
+	return 0;
+
+	FUSE_ERROR_BLOCK_END
+}
+
+
+extern "C" int jmtpfs_create(const char* pathStr, mode_t mode, struct fuse_file_info *fileInfo)
+{
+	FUSE_MUTATION_BLOCK_START
+
+	FilesystemPath path(pathStr);
+	std::unique_ptr<MtpNode> n = context->getNode(path.AllButTail());
+	n->CreateFile(path.Tail());
+	fileInfo->fh = context->openFileHandle(context->getNode(path));
+	return 0;
+
+	FUSE_ERROR_BLOCK_END
+}
+
+extern "C" int jmtpfs_write(const char *pathStr, const char *data, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	FUSE_ERROR_BLOCK_START
+
+	return context->fileHandle(fi->fh).localFile().write(data, size, offset);
+
+	FUSE_ERROR_BLOCK_END
+}
+
+#if FUSE_VERSION >= 29
+extern "C" int jmtpfs_write_buf(const char *pathStr, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi)
+{
+	FUSE_ERROR_BLOCK_START
+
+	return context->fileHandle(fi->fh).localFile().writeBuf(*buf, offset);
+
+	FUSE_ERROR_BLOCK_END
+}
+
+extern "C" int jmtpfs_fallocate(const char *pathStr, int mode, off_t offset, off_t length, struct fuse_file_info *fi)
+{
+	FUSE_MUTATION_BLOCK_START
+
+	// Nothing is reserved on the device ahead of time, so there's only
+	// something to do when the file grows.
+	if (mode & ~FALLOC_FL_KEEP_SIZE)
+		return -EOPNOTSUPP;
+	if (!(mode & FALLOC_FL_KEEP_SIZE))
+		context->fileHandle(fi->fh).allocate(offset + length);
+	return 0;
+
+	FUSE_ERROR_BLOCK_END
+}
+
+#endif
+
+extern "C" void* jmtpfs_init(struct fuse_conn_info *conn)
+{
+#if FUSE_VERSION >= 29
+	conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE);
+#endif
+	MtpFuseContext* context((MtpFuseContext*)(fuse_get_context()->private_data));
+	context->startEventListener();
+	return context;
+}
+
+extern "C" int jmtpfs_truncate(const char *pathStr, off_t length)
+{
+	FUSE_MUTATION_BLOCK_START
+
+	FilesystemPath path(pathStr);
+	context->getNode(path)->Truncate(length);
+	return 0;
+
+	FUSE_ERROR_BLOCK_END
+}
+
+#ifdef __APPLE__
+extern "C" int jmtpfs_setxattr(const char *pathStr, const char *name, const char *value, size_t size, int, uint32_t)
+#else
+extern "C" int jmtpfs_setxattr(const char *pathStr, const char *name, const char *value, size_t size, int)
+#endif
+{
+	FUSE_MUTATION_BLOCK_START
+
+	FilesystemPath path(pathStr);
+	context->getNode(path)->setxattr(name, std::string(value, size));
+	return 0;
+
+	FUSE_ERROR_BLOCK_END
+}
+
+extern "C" int jmtpfs_unlink(const char *pathStr)
+{
+	FUSE_MUTATION_BLOCK_START
+
+	FilesystemPath path(pathStr);
+	context->getNode(path)->Remove();
+	return 0;
+
+	FUSE_ERROR_BLOCK_END
+}
+
+extern "C" int jmtpfs_fsync(const char *pathStr, int, struct fuse_file_info *fi)
+{
+	FUSE_ERROR_BLOCK_START
+
+	context->fileHandle(fi->fh).fsync();
+	return 0;
+
+	FUSE_ERROR_BLOCK_END
+}
+
+
+extern "C" int jmtpfs_rename(const char *pathStr, const char *newPathStr)
+{
+	FUSE_MUTATION_BLOCK_START
+
+	FilesystemPath path(pathStr);
+	std::unique_ptr<MtpNode> n = context->getNode(path);
+	FilesystemPath newPath(newPathStr);
+	std::unique_ptr<MtpNode> newParent = context->getNode(newPath.AllButTail());
+	n->Rename(*newParent, newPath.Tail());
+
+	return 0;
+
+	FUSE_ERROR_BLOCK_END
+}
+
+extern "C" int jmtpfs_statfs(const char *pathStr, struct statvfs *stat)
+{
+	FUSE_ERROR_BLOCK_START
+
+	FilesystemPath path(pathStr);
+	std::unique_ptr<MtpNode> n = context->getNode(path);
+	n->statfs(stat);
+	return 0;
+
+	FUSE_ERROR_BLOCK_END
+}
+
+extern "C" int jmtpfs_chmod(const char* pathStr, mode_t mode)
+{
+	FUSE_ERROR_BLOCK_START
+
+	FilesystemPath path(pathStr);
+	context->getNode(path);
+	// a noop since mtp doesn't support permissions. But we need to pretend
+    // to do it to make things like "cp -r" and the mac finder happy.
+
+	return 0;
+	FUSE_ERROR_BLOCK_END
+}
+
+extern "C" int jmtpfs_utime(const char* pathStr, struct utimbuf*)
+{
+	FUSE_ERROR_BLOCK_START
+
+	FilesystemPath path(pathStr);
+	context->getNode(path);
+	// a noop since mtp doesn't support permissions. But we need to pretend
+    // to do it to make things like "cp -r" and the mac finder happy.
+
+	return 0;
+	FUSE_ERROR_BLOCK_END
+}
+
+
+struct jmtpfs_loop
+{
+	struct fuse*	fuse;
+	pthread_t		thread;
+};
+
+/*
+ * Ends fuse's loop once the device is disconnected. The thread running it may
+ * be waiting for the kernel, so it is sent a signal, whose handler fuse has
+ * set to end the loop too.
+ */
+static void jmtpfs_exit(void* loop)
+{
+	fuse_exit(((jmtpfs_loop*) loop)->fuse);
+	pthread_kill(((jmtpfs_loop*) loop)->thread, SIGTERM);
+}
+
+static struct fuse_operations jmtpfs_oper = {
+		0,
+};
+
+int jmtpfs_fuse_main(struct fuse_args* args, MtpFuseContext* context)
+{
+	jmtpfs_oper.getattr = jmtpfs_getattr;
+	jmtpfs_oper.opendir = jmtpfs_opendir;
+	jmtpfs_oper.readdir = jmtpfs_readdir;
+	jmtpfs_oper.releasedir = jmtpfs_releasedir;
+	jmtpfs_oper.open = jmtpfs_open;
+	jmtpfs_oper.flush = jmtpfs_flush;
+	jmtpfs_oper.release = jmtpfs_release;
+	jmtpfs_oper.read = jmtpfs_read;
+#if FUSE_VERSION >= 29
+	jmtpfs_oper.read_buf = jmtpfs_read_buf;
+	jmtpfs_oper.write_buf = jmtpfs_write_buf;
+	jmtpfs_oper.fallocate = jmtpfs_fallocate;
+#endif
+	jmtpfs_oper.init = jmtpfs_init;
+	jmtpfs_oper.mkdir = jmtpfs_mkdir;
+	jmtpfs_oper.rmdir = jmtpfs_rmdir;
+	jmtpfs_oper.create = jmtpfs_create;
+	jmtpfs_oper.write = jmtpfs_write;
+	jmtpfs_oper.truncate = jmtpfs_truncate;
+	jmtpfs_oper.setxattr = jmtpfs_setxattr;
+	jmtpfs_oper.unlink = jmtpfs_unlink;
+	jmtpfs_oper.fsync = jmtpfs_fsync;
+	jmtpfs_oper.rename = jmtpfs_rename;
+	jmtpfs_oper.statfs = jmtpfs_statfs;
+	jmtpfs_oper.chmod = jmtpfs_chmod;
+	jmtpfs_oper.utime = jmtpfs_utime;
+
+	// fuse_main, but with the loop ended early if the device is disconnected.
+	char* mountpoint;
+	int multithreaded;
+	struct fuse* fuse = fuse_setup(args->argc, args->argv, &jmtpfs_oper, sizeof(jmtpfs_oper), &mountpoint,
+			&multithreaded, context);
+	if (!fuse)
+		return 1;
+	jmtpfs_loop loop;
+	loop.fuse = fuse;
+	loop.thread = pthread_self();
+	context->setExitHandler(jmtpfs_exit, &loop);
+	int result = multithreaded ? fuse_loop_mt(fuse) : fuse_loop(fuse);
+	context->setExitHandler(0, 0);
+	fuse_teardown(fuse, mountpoint);
+	return result == -1 ? 1 : 0;
+}
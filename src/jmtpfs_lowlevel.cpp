@@ -0,0 +1,710 @@
+/*
+ * jmtpfs_lowlevel.cpp
+ *
+ *      Author: Jason Ferrara
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+#include "jmtpfs.h"
+#include "mtpFilesystemErrors.h"
+#include "MtpInodeTable.h"
+#include "Mutex.h"
+
+#include <fuse_lowlevel.h>
+#include <cstddef>
+#include <errno.h>
+#include <fcntl.h>
+#include <iostream>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+/*
+ * The inode based fuse frontend. Nodes looked up by the kernel are kept in an
+ * MtpInodeTable, so an operation goes straight to its node, or to a child in
+ * its parent's cached listing, without parsing or walking a path.
+ *
+ * Locking is the same as in the high level frontend. Operations that change
+ * the structure of the filesystem use FUSE_MUTATION_BLOCK_START to take the
+ * context's mutation lock, everything else relies on the locking in the
+ * cache, the local file copies and MtpLibLock. Each request gets its own
+ * copy of the nodes it uses from the inode table, since nodes change as the
+ * files they stand for are written back.
+ *
+ * This builds against either fuse 2 or, when configured with --with-fuse3,
+ * fuse 3. The differences are kept to the few operations whose signatures
+ * changed and to the session setup in jmtpfs_fuse_main.
+ */
+
+struct jmtpfs_lowlevel_options
+{
+	int		showHelp;
+	double	attrTimeout;
+	double	entryTimeout;
+};
+
+enum
+{
+	JMTPFS_LL_KEY_HELP
+};
+
+static struct fuse_opt jmtpfs_ll_opts[] = {
+		{"attr_timeout=%lf", offsetof(struct jmtpfs_lowlevel_options, attrTimeout), 0},
+		{"entry_timeout=%lf", offsetof(struct jmtpfs_lowlevel_options, entryTimeout), 0},
+		FUSE_OPT_KEY("-h", JMTPFS_LL_KEY_HELP),
+		FUSE_OPT_KEY("--help", JMTPFS_LL_KEY_HELP),
+		FUSE_OPT_END
+};
+
+struct jmtpfs_lowlevel_data
+{
+	jmtpfs_lowlevel_data(MtpFuseContext* c, const jmtpfs_lowlevel_options& options) : context(c),
+			inodes(c->getNode(FilesystemPath("/"))), attrTimeout(options.attrTimeout),
+			entryTimeout(options.entryTimeout), session(0) {}
+
+	MtpFuseContext*	context;
+	MtpInodeTable	inodes;
+	double			attrTimeout;
+	double			entryTimeout;
+	// Running the loop, so a disconnected device can end it.
+	struct fuse_session*	session;
+	pthread_t				loopThread;
+};
+
+static const ino_t jmtpfs_unknown_ino = 0xffffffff;
+// How long the kernel caches names and attributes for unless told otherwise with attr_timeout and entry_timeout.
+static const time_t jmtpfs_default_timeout = 5;
+// Largest write we ask the kernel to send at once. libfuse lowers it to what its buffers hold.
+static const unsigned jmtpfs_max_write = 1024 * 1024;
+
+#define FUSE_ERROR_BLOCK_START \
+	try \
+	{ \
+		jmtpfs_lowlevel_data& data(*(jmtpfs_lowlevel_data*)fuse_req_userdata(req)); \
+
+#define FUSE_MUTATION_BLOCK_START \
+	FUSE_ERROR_BLOCK_START \
+	LockMutex lock(data.context->mutationLock()); \
+
+#define FUSE_ERROR_BLOCK_END \
+	} \
+	catch(FileNotFound&) \
+	{ \
+		fuse_reply_err(req, ENOENT); \
+	} \
+	catch(MtpFilesystemErrorWithErrorCode& e) \
+	{ \
+		fuse_reply_err(req, e.ErrorCode()); \
+	} \
+	catch(std::exception&) \
+	{ \
+		fuse_reply_err(req, EIO); \
+	}
+
+
+static void getattr(jmtpfs_lowlevel_data& data, MtpNode& node, fuse_ino_t ino, struct stat& info)
+{
+	memset(&info, 0, sizeof(info));
+	node.getattr(info);
+	info.st_ino = ino;
+	info.st_uid = data.context->uid();
+	info.st_gid = data.context->gid();
+}
+
+/*
+ * Fills in the reply to a lookup, mkdir or create, registering the
+ * lookup with the inode table.
+ */
+static void lookupEntry(jmtpfs_lowlevel_data& data, std::unique_ptr<MtpNode> node, struct fuse_entry_param& entry)
+{
+	memset(&entry, 0, sizeof(entry));
+	getattr(data, *node, 0, entry.attr);
+	entry.ino = data.inodes.add(std::move(node));
+	entry.attr.st_ino = entry.ino;
+	entry.attr_timeout = data.attrTimeout;
+	entry.entry_timeout = data.entryTimeout;
+}
+
+extern "C" void jmtpfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+	FUSE_ERROR_BLOCK_START
+
+	struct fuse_entry_param entry;
+	lookupEntry(data, data.inodes.get(parent)->getChild(name), entry);
+	fuse_reply_entry(req, &entry);
+
+	FUSE_ERROR_BLOCK_END
+}
+
+#if FUSE_USE_VERSION >= 30
+extern "C" void jmtpfs_ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+#else
+extern "C" void jmtpfs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+#endif
+{
+	jmtpfs_lowlevel_data& data(*(jmtpfs_lowlevel_data*)fuse_req_userdata(req));
+	data.inodes.forget(ino, nlookup);
+	fuse_reply_none(req);
+}
+
+extern "C" void jmtpfs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info*)
+{
+	FUSE_ERROR_BLOCK_START
+
+	struct stat info;
+	getattr(data, *data.inodes.get(ino), ino, info);
+	fuse_reply_attr(req, &info, data.attrTimeout);
+
+	FUSE_ERROR_BLOCK_END
+}
+
+extern "C" void jmtpfs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat* attr, int toSet, struct fuse_file_info*)
+{
+	FUSE_ERROR_BLOCK_START
+
+	std::unique_ptr<MtpNode> n = data.inodes.get(ino);
+	if (toSet & FUSE_SET_ATTR_SIZE)
+	{
+		LockMutex lock(data.context->mutationLock());
+		n->Truncate(attr->st_size);
+	}
+	// Changing the mode or times is a noop since mtp doesn't support them. But we
+	// need to pretend to do it to make things like "cp -r" and the mac finder happy.
+	struct stat info;
+	getattr(data, *n, ino, info);
+	fuse_reply_attr(req, &info, data.attrTimeout);
+
+	FUSE_ERROR_BLOCK_END
+}
+
+class LowLevelDirectoryFiller : public MtpDirectoryFiller
+{
+public:
+	LowLevelDirectoryFiller(fuse_req_t req, size_t size) : m_req(req), m_buf(size), m_used(0) {}
+
+	bool add(const char* name, const struct stat& info, off_t next)
+	{
+		struct stat entryInfo(info);
+		// Inode numbers are only handed out by lookup.
+		entryInfo.st_ino = jmtpfs_unknown_ino;
+		size_t entrySize = fuse_add_direntry(m_req, &m_buf[m_used], m_buf.size() - m_used,
+				name, &entryInfo, next);
+		if (entrySize > m_buf.size() - m_used)
+			return false;
+		m_used += entrySize;
+		return true;
+	}
+
+	void reply()
+	{
+		fuse_reply_buf(m_req, &m_buf[0], m_used);
+	}
+
+protected:
+	fuse_req_t			m_req;
+	std::vector<char>	m_buf;
+	size_t				m_used;
+};
+
+#if FUSE_USE_VERSION >= 30
+/*
+ * Sends the attributes the listing already has along with each name, so
+ * listing a folder with ls -l doesn't take a lookup of every entry in it.
+ * Every entry sent, other than "." and "..", counts as a lookup of it.
+ */
+class LowLevelDirectoryPlusFiller : public LowLevelDirectoryFiller
+{
+public:
+	LowLevelDirectoryPlusFiller(fuse_req_t req, size_t size, jmtpfs_lowlevel_data& data, MtpNode& directory) :
+		LowLevelDirectoryFiller(req, size), m_data(data), m_directory(directory) {}
+
+	bool add(const char* name, const struct stat& info, off_t next)
+	{
+		// Only look the entry up once it's known to fit, since the kernel
+		// doesn't count the lookup otherwise.
+		size_t entrySize = fuse_add_direntry_plus(m_req, 0, 0, name, 0, next);
+		if (entrySize > m_buf.size() - m_used)
+			return false;
+
+		struct fuse_entry_param entry;
+		memset(&entry, 0, sizeof(entry));
+		entry.attr = info;
+		entry.attr.st_ino = jmtpfs_unknown_ino;
+		entry.attr.st_uid = m_data.context->uid();
+		entry.attr.st_gid = m_data.context->gid();
+		if (strcmp(name, ".") && strcmp(name, ".."))
+		{
+			try
+			{
+				entry.ino = m_data.inodes.add(m_directory.getChild(name));
+				entry.attr.st_ino = entry.ino;
+				entry.entry_timeout = m_data.entryTimeout;
+				// The listing doesn't count a folder's subfolders, so leave its
+				// st_nlink to getattr.
+				entry.attr_timeout = S_ISDIR(info.st_mode) ? 0 : m_data.attrTimeout;
+			}
+			catch(FileNotFound&)
+			{
+				// Gone since the directory was opened. With no inode the kernel
+				// passes the name on without caching anything about it.
+			}
+		}
+		m_used += fuse_add_direntry_plus(m_req, &m_buf[m_used], m_buf.size() - m_used, name, &entry, next);
+		return true;
+	}
+
+protected:
+	jmtpfs_lowlevel_data&	m_data;
+	MtpNode&				m_directory;
+};
+#endif
+
+extern "C" void jmtpfs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+	FUSE_ERROR_BLOCK_START
+
+	fi->fh = data.context->openDirectoryHandle(data.inodes.get(ino));
+	fuse_reply_open(req, fi);
+
+	FUSE_ERROR_BLOCK_END
+}
+
+extern "C" void jmtpfs_ll_readdir(fuse_req_t req, fuse_ino_t, size_t size, off_t offset,
+		struct fuse_file_info* fi)
+{
+	FUSE_ERROR_BLOCK_START
+
+	LowLevelDirectoryFiller filler(req, size);
+	data.context->directoryHandle(fi->fh).readdir(filler, offset);
+	filler.reply();
+
+	FUSE_ERROR_BLOCK_END
+}
+
+#if FUSE_USE_VERSION >= 30
+extern "C" void jmtpfs_ll_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+		struct fuse_file_info* fi)
+{
+	FUSE_ERROR_BLOCK_START
+
+	std::unique_ptr<MtpNode> n = data.inodes.get(ino);
+	LowLevelDirectoryPlusFiller filler(req, size, data, *n);
+	data.context->directoryHandle(fi->fh).readdir(filler, offset);
+	filler.reply();
+
+	FUSE_ERROR_BLOCK_END
+}
+#endif
+
+extern "C" void jmtpfs_ll_releasedir(fuse_req_t req, fuse_ino_t, struct fuse_file_info* fi)
+{
+	FUSE_ERROR_BLOCK_START
+
+	data.context->releaseDirectoryHandle(fi->fh);
+	fuse_reply_err(req, 0);
+
+	FUSE_ERROR_BLOCK_END
+}
+
+extern "C" void jmtpfs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+	FUSE_ERROR_BLOCK_START
+
+	std::unique_ptr<MtpNode> n = data.inodes.get(ino);
+	struct stat info;
+	getattr(data, *n, ino, info);
+	// Repeated reads of a file that hasn't changed are served from the page cache.
+	fi->keep_cache = data.inodes.opened(ino, info);
+	fi->fh = data.context->openFileHandle(std::move(n));
+	fuse_reply_open(req, fi);
+
+	FUSE_ERROR_BLOCK_END
+}
+
+extern "C" void jmtpfs_ll_flush(fuse_req_t req, fuse_ino_t, struct fuse_file_info* fi)
+{
+	FUSE_ERROR_BLOCK_START
+
+	// Fuse sends one of these for every close of every duplicated descriptor,
+	// so nothing is written back here. It only passes on an earlier failure.
+	data.context->fileHandle(fi->fh).flush();
+	fuse_reply_err(req, 0);
+
+	FUSE_ERROR_BLOCK_END
+}
+
+extern "C" void jmtpfs_ll_release(fuse_req_t req, fuse_ino_t, struct fuse_file_info* fi)
+{
+	FUSE_ERROR_BLOCK_START
+
+	// Changes go to the device once the last handle to the file is released,
+	// or on fsync.
+	data.context->releaseFileHandle(fi->fh);
+	fuse_reply_err(req, 0);
+
+	FUSE_ERROR_BLOCK_END
+}
+
+extern "C" void jmtpfs_ll_read(fuse_req_t req, fuse_ino_t, size_t size, off_t offset, struct fuse_file_info* fi)
+{
+	FUSE_ERROR_BLOCK_START
+
+#if FUSE_VERSION >= 29
+	// Let fuse take the data straight from the local copy, spliced if the kernel supports it.
+	struct fuse_bufvec buf = FUSE_BUFVEC_INIT(size);
+	data.context->fileHandle(fi->fh).readBuf(buf, offset);
+	fuse_reply_data(req, &buf, (enum fuse_buf_copy_flags) 0);
+	if (!(buf.buf[0].flags & FUSE_BUF_IS_FD))
+		free(buf.buf[0].mem);
+#else
+	std::vector<char> buf(size);
+	size_t got = data.context->fileHandle(fi->fh).read(&buf[0], size, offset);
+	fuse_reply_buf(req, &buf[0], got);
+#endif
+
+	FUSE_ERROR_BLOCK_END
+}
+
+extern "C" void jmtpfs_ll_write(fuse_req_t req, fuse_ino_t, const char* buf, size_t size, off_t offset,
+		struct fuse_file_info* fi)
+{
+	FUSE_ERROR_BLOCK_START
+
+	fuse_reply_write(req, data.context->fileHandle(fi->fh).localFile().write(buf, size, offset));
+
+	FUSE_ERROR_BLOCK_END
+}
+
+#if FUSE_VERSION >= 29
+extern "C" void jmtpfs_ll_write_buf(fuse_req_t req, fuse_ino_t, struct fuse_bufvec* buf, off_t offset,
+		struct fuse_file_info* fi)
+{
+	FUSE_ERROR_BLOCK_START
+
+	fuse_reply_write(req, data.context->fileHandle(fi->fh).localFile().writeBuf(*buf, offset));
+
+	FUSE_ERROR_BLOCK_END
+}
+
+extern "C" void jmtpfs_ll_fallocate(fuse_req_t req, fuse_ino_t, int mode, off_t offset, off_t length,
+		struct fuse_file_info* fi)
+{
+	FUSE_MUTATION_BLOCK_START
+
+	// Nothing is reserved on the device ahead of time, so there's only
+	// something to do when the file grows.
+	if (mode & ~FALLOC_FL_KEEP_SIZE)
+	{
+		fuse_reply_err(req, EOPNOTSUPP);
+		return;
+	}
+	if (!(mode & FALLOC_FL_KEEP_SIZE))
+		data.context->fileHandle(fi->fh).allocate(offset + length);
+	fuse_reply_err(req, 0);
+
+	FUSE_ERROR_BLOCK_END
+}
+#endif
+
+#ifdef __APPLE__
+extern "C" void jmtpfs_ll_setxattr(fuse_req_t req, fuse_ino_t ino, const char* name, const char* value,
+		size_t size, int, uint32_t)
+#else
+extern "C" void jmtpfs_ll_setxattr(fuse_req_t req, fuse_ino_t ino, const char* name, const char* value,
+		size_t size, int)
+#endif
+{
+	FUSE_MUTATION_BLOCK_START
+
+	data.inodes.get(ino)->setxattr(name, std::string(value, size));
+	fuse_reply_err(req, 0);
+
+	FUSE_ERROR_BLOCK_END
+}
+
+extern "C" void jmtpfs_ll_init(void* userdata, struct fuse_conn_info* conn)
+{
+	((jmtpfs_lowlevel_data*) userdata)->context->startEventListener();
+	conn->max_write = jmtpfs_max_write;
+#if FUSE_USE_VERSION >= 30
+	// Writes are gathered in the page cache and reach the local copy in large chunks.
+	conn->want |= conn->capable & FUSE_CAP_WRITEBACK_CACHE;
+#elif FUSE_VERSION >= 28
+	conn->want |= conn->capable & FUSE_CAP_BIG_WRITES;
+#endif
+#if FUSE_VERSION >= 29
+	conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE);
+#endif
+}
+
+extern "C" void jmtpfs_ll_fsync(fuse_req_t req, fuse_ino_t, int, struct fuse_file_info* fi)
+{
+	FUSE_ERROR_BLOCK_START
+
+	data.context->fileHandle(fi->fh).fsync();
+	fuse_reply_err(req, 0);
+
+	FUSE_ERROR_BLOCK_END
+}
+
+extern "C" void jmtpfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t)
+{
+	FUSE_MUTATION_BLOCK_START
+
+	std::unique_ptr<MtpNode> n = data.inodes.get(parent);
+	n->mkdir(name);
+	struct fuse_entry_param entry;
+	lookupEntry(data, n->getChild(name), entry);
+	fuse_reply_entry(req, &entry);
+
+	FUSE_ERROR_BLOCK_END
+}
+
+extern "C" void jmtpfs_ll_remove(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+	FUSE_MUTATION_BLOCK_START
+
+	data.inodes.get(parent)->getChild(name)->Remove();
+	fuse_reply_err(req, 0);
+
+	FUSE_ERROR_BLOCK_END
+}
+
+extern "C" void jmtpfs_ll_create(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t,
+		struct fuse_file_info* fi)
+{
+	FUSE_MUTATION_BLOCK_START
+
+	std::unique_ptr<MtpNode> n = data.inodes.get(parent);
+	n->CreateFile(name);
+	std::unique_ptr<MtpNode> child = n->getChild(name);
+	fi->fh = data.context->openFileHandle(child->Clone());
+	struct fuse_entry_param entry;
+	lookupEntry(data, std::move(child), entry);
+	fuse_reply_create(req, &entry, fi);
+
+	FUSE_ERROR_BLOCK_END
+}
+
+#if FUSE_USE_VERSION >= 30
+extern "C" void jmtpfs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char* name,
+		fuse_ino_t newParent, const char* newName, unsigned int flags)
+#else
+extern "C" void jmtpfs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char* name,
+		fuse_ino_t newParent, const char* newName)
+#endif
+{
+	FUSE_MUTATION_BLOCK_START
+
+#if FUSE_USE_VERSION >= 30
+	// There's no way to exchange objects or refuse to replace one atomically over mtp.
+	if (flags)
+	{
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+#endif
+
+	std::unique_ptr<MtpNode> n = data.inodes.get(parent)->getChild(name);
+	n->Rename(*data.inodes.get(newParent), newName);
+	fuse_reply_err(req, 0);
+
+	FUSE_ERROR_BLOCK_END
+}
+
+extern "C" void jmtpfs_ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	FUSE_ERROR_BLOCK_START
+
+	struct statvfs stat;
+	memset(&stat, 0, sizeof(stat));
+	data.inodes.get(ino)->statfs(&stat);
+	fuse_reply_statfs(req, &stat);
+
+	FUSE_ERROR_BLOCK_END
+}
+
+
+static int jmtpfs_ll_opt_proc(void* data, const char*, int key, struct fuse_args*)
+{
+	if (key == JMTPFS_LL_KEY_HELP)
+		((jmtpfs_lowlevel_options*) data)->showHelp = 1;
+	// Everything is passed on to fuse.
+	return 1;
+}
+
+static struct fuse_lowlevel_ops jmtpfs_ll_oper = {
+		0,
+};
+
+/*
+ * Ends fuse's loop once the device is disconnected. The thread running it may
+ * be waiting for the kernel, so it is sent a signal, whose handler fuse has
+ * set to end the loop too.
+ */
+static void jmtpfs_ll_exit(void* userdata)
+{
+	jmtpfs_lowlevel_data& data(*(jmtpfs_lowlevel_data*) userdata);
+	fuse_session_exit(data.session);
+	pthread_kill(data.loopThread, SIGTERM);
+}
+
+/*
+ * Runs fuse's loop, ending it early if the device is disconnected. It is
+ * stopped from doing that before the signal handlers are removed.
+ */
+static int jmtpfs_ll_loop(jmtpfs_lowlevel_data& data, struct fuse_session* session, bool multithreaded, int cloneFd)
+{
+	data.session = session;
+	data.loopThread = pthread_self();
+	data.context->setExitHandler(jmtpfs_ll_exit, &data);
+	data.context->setFileIdListener(&data.inodes);
+	int result;
+	if (!multithreaded)
+		result = fuse_session_loop(session);
+#if FUSE_USE_VERSION >= 30
+	else
+		result = fuse_session_loop_mt(session, cloneFd);
+#else
+	else
+		result = fuse_session_loop_mt(session);
+#endif
+	data.context->setFileIdListener(0);
+	data.context->setExitHandler(0, 0);
+	return result;
+}
+
+int jmtpfs_fuse_main(struct fuse_args* args, MtpFuseContext* context)
+{
+	jmtpfs_ll_oper.lookup = jmtpfs_ll_lookup;
+	jmtpfs_ll_oper.forget = jmtpfs_ll_forget;
+	jmtpfs_ll_oper.getattr = jmtpfs_ll_getattr;
+	jmtpfs_ll_oper.setattr = jmtpfs_ll_setattr;
+	jmtpfs_ll_oper.opendir = jmtpfs_ll_opendir;
+	jmtpfs_ll_oper.readdir = jmtpfs_ll_readdir;
+#if FUSE_USE_VERSION >= 30
+	jmtpfs_ll_oper.readdirplus = jmtpfs_ll_readdirplus;
+#endif
+	jmtpfs_ll_oper.releasedir = jmtpfs_ll_releasedir;
+	jmtpfs_ll_oper.open = jmtpfs_ll_open;
+	jmtpfs_ll_oper.flush = jmtpfs_ll_flush;
+	jmtpfs_ll_oper.release = jmtpfs_ll_release;
+	jmtpfs_ll_oper.read = jmtpfs_ll_read;
+	jmtpfs_ll_oper.write = jmtpfs_ll_write;
+#if FUSE_VERSION >= 29
+	jmtpfs_ll_oper.write_buf = jmtpfs_ll_write_buf;
+	jmtpfs_ll_oper.fallocate = jmtpfs_ll_fallocate;
+#endif
+	jmtpfs_ll_oper.setxattr = jmtpfs_ll_setxattr;
+	jmtpfs_ll_oper.init = jmtpfs_ll_init;
+	jmtpfs_ll_oper.fsync = jmtpfs_ll_fsync;
+	jmtpfs_ll_oper.mkdir = jmtpfs_ll_mkdir;
+	jmtpfs_ll_oper.rmdir = jmtpfs_ll_remove;
+	jmtpfs_ll_oper.unlink = jmtpfs_ll_remove;
+	jmtpfs_ll_oper.create = jmtpfs_ll_create;
+	jmtpfs_ll_oper.rename = jmtpfs_ll_rename;
+	jmtpfs_ll_oper.statfs = jmtpfs_ll_statfs;
+
+	// These only say how long the kernel caches names and attributes for. The
+	// metadata cache keeps its own timeout, so turning the kernel's caching off
+	// with attr_timeout=0 doesn't send every lookup to the device.
+	jmtpfs_lowlevel_options options;
+	options.showHelp = 0;
+	options.attrTimeout = options.entryTimeout = jmtpfs_default_timeout;
+	if (fuse_opt_parse(args, &options, jmtpfs_ll_opts, jmtpfs_ll_opt_proc) == -1)
+		return 1;
+
+	int result = 1;
+#if FUSE_USE_VERSION >= 30
+	struct fuse_cmdline_opts cmdline;
+	if (fuse_parse_cmdline(args, &cmdline) != 0)
+		return result;
+
+	if (cmdline.show_help)
+	{
+		std::cout << "usage: " << args->argv[0] << " [options] <mountpoint>" << std::endl << std::endl;
+		fuse_cmdline_help();
+		fuse_lowlevel_help();
+		result = 0;
+	}
+	else if (cmdline.show_version)
+	{
+		fuse_lowlevel_version();
+		result = 0;
+	}
+	else if (!cmdline.mountpoint)
+		std::cerr << "No mount point specified" << std::endl;
+	else if (context)
+	{
+		jmtpfs_lowlevel_data data(context, options);
+		struct fuse_session* session = fuse_session_new(args, &jmtpfs_ll_oper, sizeof(jmtpfs_ll_oper), &data);
+		if (session)
+		{
+			if (fuse_set_signal_handlers(session) != -1)
+			{
+				if (fuse_session_mount(session, cmdline.mountpoint) == 0)
+				{
+					fuse_daemonize(cmdline.foreground);
+					result = jmtpfs_ll_loop(data, session, !cmdline.singlethread, cmdline.clone_fd);
+					fuse_session_unmount(session);
+				}
+				fuse_remove_signal_handlers(session);
+			}
+			fuse_session_destroy(session);
+		}
+	}
+	free(cmdline.mountpoint);
+#else
+	char* mountpoint = 0;
+	int multithreaded;
+	int foreground;
+	if (fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) == -1)
+		return result;
+
+	// With -h this prints the mount options and fails, as fuse_main does.
+	struct fuse_chan* channel = fuse_mount(mountpoint, args);
+	if (channel && context)
+	{
+		jmtpfs_lowlevel_data data(context, options);
+		struct fuse_session* session = fuse_lowlevel_new(args, &jmtpfs_ll_oper, sizeof(jmtpfs_ll_oper), &data);
+		if (session)
+		{
+			if (fuse_set_signal_handlers(session) != -1)
+			{
+				fuse_session_add_chan(session, channel);
+				fuse_daemonize(foreground);
+				result = jmtpfs_ll_loop(data, session, multithreaded, 0);
+				fuse_remove_signal_handlers(session);
+				fuse_session_remove_chan(channel);
+			}
+			fuse_session_destroy(session);
+		}
+	}
+	if (channel)
+		fuse_unmount(mountpoint, channel);
+	free(mountpoint);
+#endif
+
+	if (options.showHelp)
+	{
+		std::cout << std::endl << "low level frontend options:" << std::endl;
+		std::cout << "    -o attr_timeout=T      cache timeout for attributes, in seconds (5)" << std::endl;
+		std::cout << "    -o entry_timeout=T     cache timeout for names, in seconds (5)" << std::endl;
+	}
+	return result ? 1 : 0;
+}
@@ -102,10 +102,16 @@ public:
 	MtpDirectoryNotEmpty() : MtpFilesystemErrorWithErrorCode(ENOTEMPTY, "Directoy not empty") {};
 };
 
-class NotADirectory : public MtpFilesystemError
+class FileExists : public MtpFilesystemErrorWithErrorCode
 {
 public:
-	NotADirectory() : MtpFilesystemError("Not a directory: ") {}
+	FileExists() : MtpFilesystemErrorWithErrorCode(EEXIST, "File exists") {}
+};
+
+class NotADirectory : public MtpFilesystemErrorWithErrorCode
+{
+public:
+	NotADirectory() : MtpFilesystemErrorWithErrorCode(ENOTDIR, "Not a directory") {}
 };
 
 class MtpNameTooLong : public MtpFilesystemErrorWithErrorCode
@@ -113,4 +119,16 @@ class MtpNameTooLong : public MtpFilesystemErrorWithErrorCode
 public:
 	MtpNameTooLong() : MtpFilesystemErrorWithErrorCode(ENAMETOOLONG, "Filename too long") {};
 };
+
+class XattrNotSupported : public MtpFilesystemErrorWithErrorCode
+{
+public:
+	XattrNotSupported() : MtpFilesystemErrorWithErrorCode(ENOTSUP, "Extended attribute not supported") {};
+};
+
+class InvalidArgument : public MtpFilesystemErrorWithErrorCode
+{
+public:
+	InvalidArgument() : MtpFilesystemErrorWithErrorCode(EINVAL, "Invalid argument") {};
+};
 #endif /* MTPFILESYSTEMERRORS_H_ */
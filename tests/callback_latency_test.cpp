@@ -0,0 +1,259 @@
+/*
+ * callback_latency_test.cpp
+ *
+ *      Author: Jason Ferrara
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+
+/*
+ * Calls the fuse callbacks directly, against the in-memory device of
+ * fake_libmtp.cpp, while a file is copied from the device. The copy holds
+ * MtpLibLock for its whole length, so stat'ing and listing what is already
+ * in the cache has to take no device locks at all to stay fast, which is
+ * what's checked here.
+ */
+
+#include "jmtpfs.h"
+#include "fake_libmtp.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <vector>
+
+extern "C" int jmtpfs_getattr(const char* pathStr, struct stat* info);
+extern "C" int jmtpfs_opendir(const char* pathStr, struct fuse_file_info *fi);
+extern "C" int jmtpfs_readdir(const char* pathStr, void* buf, fuse_fill_dir_t filler,
+		off_t offset, struct fuse_file_info *fi);
+extern "C" int jmtpfs_releasedir(const char* pathStr, struct fuse_file_info *fi);
+extern "C" int jmtpfs_open(const char *pathStr, struct fuse_file_info *fi);
+extern "C" int jmtpfs_read(const char *pathStr, char *buf, size_t  size, off_t offset, struct fuse_file_info *fi);
+extern "C" int jmtpfs_release(const char *pathStr, struct fuse_file_info *fi);
+
+static const int files = 50;
+static const size_t bigFileSize = 8 * 1024 * 1024;
+static const int transferMs = 2000;
+static const int lookupThreads = 4;
+// Far less than the copy takes, so waiting behind it can't pass.
+static const double maxLatency = 0.25;
+
+static struct fuse_context fuseContext;
+
+/*
+ * Takes the place of libfuse's, which only answers inside fuse's loop.
+ */
+extern "C" struct fuse_context* fuse_get_context(void)
+{
+	return &fuseContext;
+}
+
+static std::string folder;
+static std::string bigFile;
+static std::vector<unsigned char> bigFileData;
+
+static pthread_mutex_t failMutex = PTHREAD_MUTEX_INITIALIZER;
+static int failures = 0;
+static std::atomic<bool> readerDone(false);
+
+static double now()
+{
+	struct timeval t;
+	gettimeofday(&t, 0);
+	return t.tv_sec + t.tv_usec / 1e6;
+}
+
+static void fail(const char* what, const std::string& path, int err)
+{
+	pthread_mutex_lock(&failMutex);
+	fprintf(stderr, "%s %s: %s\n", what, path.c_str(), strerror(err));
+	failures++;
+	pthread_mutex_unlock(&failMutex);
+}
+
+static std::string fileName(int i)
+{
+	char name[20];
+	snprintf(name, sizeof(name), "/f%03d", i);
+	return folder + name;
+}
+
+static int countEntry(void* buf, const char*, const struct stat*, off_t)
+{
+	(*(int*) buf)++;
+	return 0;
+}
+
+static int listFolder()
+{
+	struct fuse_file_info fi;
+	memset(&fi, 0, sizeof(fi));
+	int err = jmtpfs_opendir(folder.c_str(), &fi);
+	if (err)
+		return err;
+	int entries = 0;
+	err = jmtpfs_readdir(folder.c_str(), &entries, countEntry, 0, &fi);
+	jmtpfs_releasedir(folder.c_str(), &fi);
+	if (!err && (entries < files + 1))
+		err = -EIO;
+	return err;
+}
+
+static void* readMain(void*)
+{
+	struct fuse_file_info fi;
+	memset(&fi, 0, sizeof(fi));
+	int err = jmtpfs_open(bigFile.c_str(), &fi);
+	if (err)
+	{
+		fail("open", bigFile, -err);
+		readerDone = true;
+		return 0;
+	}
+	// The end of the file, so this waits for the whole copy.
+	std::vector<char> buf(4096);
+	off_t offset = bigFileSize - buf.size();
+	int got = jmtpfs_read(bigFile.c_str(), &buf[0], buf.size(), offset, &fi);
+	if (got != (int) buf.size())
+		fail("read", bigFile, got < 0 ? -got : EIO);
+	else if (memcmp(&buf[0], &bigFileData[offset], buf.size()) != 0)
+		fail("contents of", bigFile, EIO);
+	jmtpfs_release(bigFile.c_str(), &fi);
+	readerDone = true;
+	return 0;
+}
+
+struct LookupResult
+{
+	int		calls;
+	double	maxLatency;
+};
+
+static void* lookupMain(void* resultP)
+{
+	LookupResult& result = *(LookupResult*) resultP;
+	for(int i = 0; fakeMtpTransfersInProgress() > 0; i++)
+	{
+		std::string file = fileName(i % files);
+		struct stat info;
+		double start = now();
+		int err = jmtpfs_getattr(file.c_str(), &info);
+		double latency = now() - start;
+		if (err)
+			fail("getattr", file, -err);
+		result.maxLatency = std::max(result.maxLatency, latency);
+		result.calls++;
+
+		start = now();
+		err = listFolder();
+		latency = now() - start;
+		if (err)
+			fail("listing", folder, -err);
+		result.maxLatency = std::max(result.maxLatency, latency);
+		result.calls++;
+	}
+	return 0;
+}
+
+int main()
+{
+	// Without partial reads the file is copied whole, in one long transfer.
+	fakeMtpSetPartialReads(false);
+	fakeMtpSetGetFileTime(transferMs);
+	uint32_t folderId = fakeMtpAddFolder(0, "Music");
+	for(int i = 0; i < files; i++)
+	{
+		char name[20];
+		snprintf(name, sizeof(name), "f%03d", i);
+		fakeMtpAddFile(folderId, name, std::vector<unsigned char>(1000, 'a'));
+	}
+	bigFileData.resize(bigFileSize);
+	for(size_t i = 0; i < bigFileSize; i++)
+		bigFileData[i] = (unsigned char) (i * 7 / 4096);
+	fakeMtpAddFile(folderId, "big.bin", bigFileData);
+
+	MtpFuseContext context(fakeMtpOpenDevice(), getuid(), getgid());
+	context.setCacheTimeout(3600);
+	fuseContext.private_data = &context;
+	folder = std::string("/") + fakeMtpStorageName + "/Music";
+	bigFile = folder + "/big.bin";
+
+	// Gets everything the lookups use into the cache.
+	struct stat info;
+	for(int i = 0; i < files; i++)
+	{
+		int err = jmtpfs_getattr(fileName(i).c_str(), &info);
+		if (err)
+			fail("getattr", fileName(i), -err);
+	}
+	int err = listFolder();
+	if (err)
+		fail("listing", folder, -err);
+	if (failures)
+		return 1;
+
+	pthread_t reader;
+	pthread_create(&reader, 0, readMain, 0);
+	double start = now();
+	while(!fakeMtpTransfersInProgress() && !readerDone && (now() - start < transferMs / 1000.0))
+		usleep(1000);
+	if (!fakeMtpTransfersInProgress())
+	{
+		fprintf(stderr, "copying %s from the device didn't start\n", bigFile.c_str());
+		pthread_join(reader, 0);
+		return 1;
+	}
+
+	std::vector<pthread_t> lookups(lookupThreads);
+	std::vector<LookupResult> results(lookupThreads);
+	for(int i = 0; i < lookupThreads; i++)
+	{
+		results[i].calls = 0;
+		results[i].maxLatency = 0;
+		pthread_create(&lookups[i], 0, lookupMain, &results[i]);
+	}
+	for(int i = 0; i < lookupThreads; i++)
+		pthread_join(lookups[i], 0);
+	pthread_join(reader, 0);
+
+	int calls = 0;
+	double worst = 0;
+	for(int i = 0; i < lookupThreads; i++)
+	{
+		calls += results[i].calls;
+		worst = std::max(worst, results[i].maxLatency);
+	}
+	printf("%d cached getattr and listing calls during a %.1f s copy, slowest %.1f ms\n",
+			calls, transferMs / 1000.0, worst * 1e3);
+	if (calls == 0)
+	{
+		fprintf(stderr, "no calls were made during the copy\n");
+		failures++;
+	}
+	if (worst > maxLatency)
+	{
+		fprintf(stderr, "cached calls waited %.1f ms behind the copy\n", worst * 1e3);
+		failures++;
+	}
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,177 @@
+/*
+ * concurrent_inode_test.cpp
+ *
+ *      Author: Jason Ferrara
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+
+/*
+ * Looks up, reads and writes back one file from several threads at once,
+ * to shake out races between fuse's worker threads on a single inode. Every
+ * write back gives the file a new id on the device, which the lookups and
+ * reads have to follow.
+ *
+ * It needs a device, so it runs against a writable folder on a mounted
+ * jmtpfs, named by JMTPFS_TEST_DIR, and is skipped without one.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+static const int lookupThreads = 4;
+static const int readThreads = 4;
+static const int iterations = 50;
+static const size_t fileSize = 256 * 1024;
+
+static std::string path;
+static pthread_mutex_t failMutex = PTHREAD_MUTEX_INITIALIZER;
+static int failures = 0;
+static std::atomic<bool> writerDone(false);
+
+static void fail(const char* what, int err)
+{
+	pthread_mutex_lock(&failMutex);
+	fprintf(stderr, "%s %s: %s\n", what, path.c_str(), strerror(err));
+	failures++;
+	pthread_mutex_unlock(&failMutex);
+}
+
+static void* lookupMain(void*)
+{
+	while (!writerDone)
+	{
+		struct stat info;
+		if (stat(path.c_str(), &info) != 0)
+			fail("stat", errno);
+		else if ((size_t) info.st_size != fileSize)
+			fail("stat size of", EIO);
+	}
+	return 0;
+}
+
+static void* readMain(void*)
+{
+	std::vector<char> buf(fileSize);
+	while (!writerDone)
+	{
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+		{
+			fail("open", errno);
+			continue;
+		}
+		size_t got = 0;
+		while (got < fileSize)
+		{
+			ssize_t n = pread(fd, &buf[got], fileSize - got, got);
+			if (n <= 0)
+			{
+				fail("read", n < 0 ? errno : EIO);
+				break;
+			}
+			got += n;
+		}
+		close(fd);
+	}
+	return 0;
+}
+
+static void* writeMain(void*)
+{
+	std::vector<char> buf(fileSize);
+	for(int i = 0; i < iterations; i++)
+	{
+		memset(&buf[0], 'b' + i % 2, fileSize);
+		int fd = open(path.c_str(), O_WRONLY);
+		if (fd < 0)
+		{
+			fail("open for writing", errno);
+			continue;
+		}
+		if (pwrite(fd, &buf[0], fileSize, 0) != (ssize_t) fileSize)
+			fail("write", errno);
+		if (fsync(fd) != 0)
+			fail("fsync", errno);
+		if (close(fd) != 0)
+			fail("close", errno);
+	}
+	return 0;
+}
+
+int main()
+{
+	const char* dir = getenv("JMTPFS_TEST_DIR");
+	if (!dir)
+	{
+		fprintf(stderr, "JMTPFS_TEST_DIR isn't set, skipping\n");
+		return 77;
+	}
+	path = std::string(dir) + "/concurrent_inode_test";
+
+	std::vector<char> initial(fileSize, 'a');
+	int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if ((fd < 0) || (write(fd, &initial[0], fileSize) != (ssize_t) fileSize) || (close(fd) != 0))
+	{
+		perror(path.c_str());
+		return 1;
+	}
+
+	std::vector<pthread_t> readers;
+	for(int i = 0; i < lookupThreads + readThreads; i++)
+	{
+		pthread_t thread;
+		pthread_create(&thread, 0, i < lookupThreads ? lookupMain : readMain, 0);
+		readers.push_back(thread);
+	}
+	pthread_t writer;
+	pthread_create(&writer, 0, writeMain, 0);
+	pthread_join(writer, 0);
+	writerDone = true;
+	for(size_t i = 0; i < readers.size(); i++)
+		pthread_join(readers[i], 0);
+
+	// Whatever was written last must be what's there now, all of it.
+	std::vector<char> buf(fileSize);
+	fd = open(path.c_str(), O_RDONLY);
+	if ((fd < 0) || (read(fd, &buf[0], fileSize) != (ssize_t) fileSize))
+		fail("read back", errno);
+	else
+	{
+		for(size_t i = 0; i < fileSize; i++)
+		{
+			if (buf[i] != 'b' + (iterations - 1) % 2)
+			{
+				fail("contents of", EIO);
+				break;
+			}
+		}
+	}
+	if (fd >= 0)
+		close(fd);
+	unlink(path.c_str());
+
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,410 @@
+/*
+ * fake_libmtp.cpp
+ *
+ *      Author: Jason Ferrara
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+
+/*
+ * Just the libmtp calls jmtpfs makes, answered from memory.
+ */
+
+#include "fake_libmtp.h"
+
+#include <libmtp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <map>
+
+const char* const fakeMtpStorageName = "Internal storage";
+
+static const uint32_t fakeStorageId = 0x10001;
+static const uint64_t fakeStorageCapacity = 1ull << 32;
+static const size_t fakeTransferChunk = 64 * 1024;
+
+struct FakeObject
+{
+	uint32_t					parent;
+	std::string					name;
+	LIBMTP_filetype_t			type;
+	std::vector<unsigned char>	data;
+	time_t						modified;
+};
+
+typedef std::map<uint32_t, FakeObject> FakeObjects;
+
+static FakeObjects fakeObjects;
+static uint32_t fakeNextId = 1;
+static int fakeGetFileMs = 0;
+static bool fakePartialReads = true;
+static std::atomic<int> fakeTransfers(0);
+
+static LIBMTP_devicestorage_t fakeStorage;
+static LIBMTP_mtpdevice_t fakeDevice;
+static LIBMTP_error_t fakeError;
+static bool fakeErrorPending = false;
+
+static uint32_t addObject(uint32_t parent, const std::string& name, LIBMTP_filetype_t type,
+		const std::vector<unsigned char>& data)
+{
+	FakeObject& object = fakeObjects[fakeNextId];
+	object.parent = parent;
+	object.name = name;
+	object.type = type;
+	object.data = data;
+	object.modified = time(0);
+	return fakeNextId++;
+}
+
+uint32_t fakeMtpAddFolder(uint32_t parent, const std::string& name)
+{
+	return addObject(parent, name, LIBMTP_FILETYPE_FOLDER, std::vector<unsigned char>());
+}
+
+uint32_t fakeMtpAddFile(uint32_t parent, const std::string& name, const std::vector<unsigned char>& data)
+{
+	return addObject(parent, name, LIBMTP_FILETYPE_UNKNOWN, data);
+}
+
+void fakeMtpSetGetFileTime(int milliseconds)
+{
+	fakeGetFileMs = milliseconds;
+}
+
+void fakeMtpSetPartialReads(bool partialReads)
+{
+	fakePartialReads = partialReads;
+}
+
+int fakeMtpTransfersInProgress()
+{
+	return fakeTransfers;
+}
+
+std::unique_ptr<MtpDevice> fakeMtpOpenDevice()
+{
+	LIBMTP_raw_device_t rawDevice;
+	memset(&rawDevice, 0, sizeof(rawDevice));
+	return std::unique_ptr<MtpDevice>(new MtpDevice(rawDevice));
+}
+
+static int fail()
+{
+	fakeError.errornumber = LIBMTP_ERROR_GENERAL;
+	fakeError.error_text = (char*) "fake device error";
+	fakeError.next = 0;
+	fakeErrorPending = true;
+	return -1;
+}
+
+static FakeObject* findObject(uint32_t id)
+{
+	FakeObjects::iterator i = fakeObjects.find(id);
+	if (i == fakeObjects.end())
+	{
+		fail();
+		return 0;
+	}
+	return &(i->second);
+}
+
+static LIBMTP_file_t* fileInfo(uint32_t id, const FakeObject& object)
+{
+	LIBMTP_file_t* info = LIBMTP_new_file_t();
+	info->item_id = id;
+	info->parent_id = object.parent;
+	info->storage_id = fakeStorageId;
+	info->filename = strdup(object.name.c_str());
+	info->filesize = object.data.size();
+	info->modificationdate = object.modified;
+	info->filetype = object.type;
+	return info;
+}
+
+/*
+ * Stands in for the time the data takes to cross the usb connection.
+ */
+static void transferDelay(size_t bytes, size_t total)
+{
+	if (fakeGetFileMs && total)
+		usleep((useconds_t) (fakeGetFileMs * 1000.0 * bytes / total));
+}
+
+static void sendFile(LIBMTP_file_t* info, const std::vector<unsigned char>& data)
+{
+	info->item_id = addObject(info->parent_id, info->filename, info->filetype, data);
+}
+
+extern "C" {
+
+void LIBMTP_Init(void)
+{
+}
+
+LIBMTP_mtpdevice_t* LIBMTP_Open_Raw_Device_Uncached(LIBMTP_raw_device_t*)
+{
+	memset(&fakeStorage, 0, sizeof(fakeStorage));
+	fakeStorage.id = fakeStorageId;
+	fakeStorage.StorageDescription = (char*) fakeMtpStorageName;
+	fakeStorage.MaxCapacity = fakeStorageCapacity;
+	fakeStorage.FreeSpaceInBytes = fakeStorageCapacity / 2;
+	memset(&fakeDevice, 0, sizeof(fakeDevice));
+	fakeDevice.storage = &fakeStorage;
+	return &fakeDevice;
+}
+
+void LIBMTP_Release_Device(LIBMTP_mtpdevice_t*)
+{
+}
+
+char* LIBMTP_Get_Modelname(LIBMTP_mtpdevice_t*)
+{
+	return strdup("Fake device");
+}
+
+char* LIBMTP_Get_Serialnumber(LIBMTP_mtpdevice_t*)
+{
+	return strdup("FAKE0001");
+}
+
+LIBMTP_error_t* LIBMTP_Get_Errorstack(LIBMTP_mtpdevice_t*)
+{
+	return fakeErrorPending ? &fakeError : 0;
+}
+
+void LIBMTP_Clear_Errorstack(LIBMTP_mtpdevice_t*)
+{
+	fakeErrorPending = false;
+}
+
+int LIBMTP_Check_Capability(LIBMTP_mtpdevice_t*, LIBMTP_devicecap_t capability)
+{
+	if (capability == LIBMTP_DEVICECAP_GetPartialObject)
+		return fakePartialReads;
+	return capability == LIBMTP_DEVICECAP_EditObjects;
+}
+
+int LIBMTP_Get_Storage(LIBMTP_mtpdevice_t*, int const)
+{
+	return 0;
+}
+
+LIBMTP_file_t* LIBMTP_new_file_t(void)
+{
+	LIBMTP_file_t* info = (LIBMTP_file_t*) calloc(1, sizeof(LIBMTP_file_t));
+	info->filetype = LIBMTP_FILETYPE_UNKNOWN;
+	return info;
+}
+
+void LIBMTP_destroy_file_t(LIBMTP_file_t* info)
+{
+	if (info)
+	{
+		free(info->filename);
+		free(info);
+	}
+}
+
+LIBMTP_file_t* LIBMTP_Get_Files_And_Folders(LIBMTP_mtpdevice_t*, uint32_t const storage, uint32_t const parent)
+{
+	uint32_t parentId = (parent == 0xFFFFFFFF) ? 0 : parent;
+	LIBMTP_file_t* head = 0;
+	LIBMTP_file_t** tail = &head;
+	for(FakeObjects::iterator i = fakeObjects.begin(); i != fakeObjects.end(); i++)
+	{
+		if ((storage == fakeStorageId) && (i->second.parent == parentId))
+		{
+			*tail = fileInfo(i->first, i->second);
+			tail = &((*tail)->next);
+		}
+	}
+	return head;
+}
+
+LIBMTP_file_t* LIBMTP_Get_Filemetadata(LIBMTP_mtpdevice_t*, uint32_t const id)
+{
+	FakeObject* object = findObject(id);
+	return object ? fileInfo(id, *object) : 0;
+}
+
+int LIBMTP_Get_File_To_File_Descriptor(LIBMTP_mtpdevice_t*, uint32_t const id, int const fd,
+		LIBMTP_progressfunc_t const, void const* const)
+{
+	FakeObject* object = findObject(id);
+	if (!object)
+		return -1;
+	fakeTransfers++;
+	std::vector<unsigned char> data(object->data);
+	int result = 0;
+	for(size_t pos = 0; pos < data.size(); pos += fakeTransferChunk)
+	{
+		size_t size = std::min(fakeTransferChunk, data.size() - pos);
+		transferDelay(size, data.size());
+		if (write(fd, &data[pos], size) != (ssize_t) size)
+		{
+			result = fail();
+			break;
+		}
+	}
+	fakeTransfers--;
+	return result;
+}
+
+int LIBMTP_Get_File_To_Handler(LIBMTP_mtpdevice_t*, uint32_t const id, MTPDataPutFunc put, void* priv,
+		LIBMTP_progressfunc_t const, void const* const)
+{
+	FakeObject* object = findObject(id);
+	if (!object)
+		return -1;
+	fakeTransfers++;
+	std::vector<unsigned char> data(object->data);
+	int result = 0;
+	for(size_t pos = 0; pos < data.size(); pos += fakeTransferChunk)
+	{
+		uint32_t size = std::min(fakeTransferChunk, data.size() - pos);
+		uint32_t putSize = 0;
+		transferDelay(size, data.size());
+		if ((put(0, priv, size, &data[pos], &putSize) != LIBMTP_HANDLER_RETURN_OK) || (putSize != size))
+		{
+			result = fail();
+			break;
+		}
+	}
+	fakeTransfers--;
+	return result;
+}
+
+int LIBMTP_GetPartialObject(LIBMTP_mtpdevice_t*, uint32_t const id, uint64_t offset, uint32_t maxbytes,
+		unsigned char** data, unsigned int* size)
+{
+	FakeObject* object = findObject(id);
+	if (!object)
+		return -1;
+	uint64_t available = (offset < object->data.size()) ? object->data.size() - offset : 0;
+	*size = std::min((uint64_t) maxbytes, available);
+	*data = (unsigned char*) malloc(*size ? *size : 1);
+	if (*size)
+		memcpy(*data, &object->data[offset], *size);
+	transferDelay(*size, object->data.size());
+	return 0;
+}
+
+int LIBMTP_Send_File_From_File_Descriptor(LIBMTP_mtpdevice_t*, int const fd, LIBMTP_file_t* const info,
+		LIBMTP_progressfunc_t const, void const* const)
+{
+	std::vector<unsigned char> data(info->filesize);
+	if (info->filesize && (read(fd, &data[0], info->filesize) != (ssize_t) info->filesize))
+		return fail();
+	sendFile(info, data);
+	return 0;
+}
+
+int LIBMTP_Send_File_From_Handler(LIBMTP_mtpdevice_t*, MTPDataGetFunc get, void* priv,
+		LIBMTP_file_t* const info, LIBMTP_progressfunc_t const, void const* const)
+{
+	std::vector<unsigned char> data(info->filesize);
+	for(size_t pos = 0; pos < data.size(); )
+	{
+		uint32_t gotSize = 0;
+		if (get(0, priv, std::min(fakeTransferChunk, data.size() - pos), &data[pos], &gotSize) !=
+				LIBMTP_HANDLER_RETURN_OK)
+			return fail();
+		pos += gotSize;
+	}
+	sendFile(info, data);
+	return 0;
+}
+
+int LIBMTP_SendPartialObject(LIBMTP_mtpdevice_t*, uint32_t const id, uint64_t offset, unsigned char* data,
+		unsigned int size)
+{
+	FakeObject* object = findObject(id);
+	if (!object)
+		return -1;
+	if (object->data.size() < offset + size)
+		object->data.resize(offset + size);
+	memcpy(&object->data[offset], data, size);
+	return 0;
+}
+
+int LIBMTP_BeginEditObject(LIBMTP_mtpdevice_t*, uint32_t const id)
+{
+	return findObject(id) ? 0 : -1;
+}
+
+int LIBMTP_EndEditObject(LIBMTP_mtpdevice_t*, uint32_t const id)
+{
+	FakeObject* object = findObject(id);
+	if (!object)
+		return -1;
+	object->modified = time(0);
+	return 0;
+}
+
+int LIBMTP_TruncateObject(LIBMTP_mtpdevice_t*, uint32_t const id, uint64_t offset)
+{
+	FakeObject* object = findObject(id);
+	if (!object)
+		return -1;
+	object->data.resize(offset);
+	return 0;
+}
+
+uint32_t LIBMTP_Create_Folder(LIBMTP_mtpdevice_t*, char* name, uint32_t parent, uint32_t)
+{
+	return fakeMtpAddFolder(parent, name);
+}
+
+int LIBMTP_Delete_Object(LIBMTP_mtpdevice_t*, uint32_t id)
+{
+	if (!fakeObjects.erase(id))
+		return fail();
+	return 0;
+}
+
+int LIBMTP_Set_File_Name(LIBMTP_mtpdevice_t*, LIBMTP_file_t* info, const char* name)
+{
+	FakeObject* object = findObject(info->item_id);
+	if (!object)
+		return -1;
+	object->name = name;
+	return 0;
+}
+
+int LIBMTP_Set_Object_String(LIBMTP_mtpdevice_t*, uint32_t const id, LIBMTP_property_t const, char const* const)
+{
+	return findObject(id) ? 0 : -1;
+}
+
+#ifdef HAVE_LIBMTP_READ_EVENT_ASYNC
+// The fake device doesn't report events, so the cache relies on its timeout.
+int LIBMTP_Read_Event_Async(LIBMTP_mtpdevice_t*, LIBMTP_event_cb_fn, void*)
+{
+	return -1;
+}
+
+int LIBMTP_Handle_Events_Timeout_Completed(struct timeval*, int*)
+{
+	return -1;
+}
+#endif
+
+}
@@ -0,0 +1,67 @@
+/*
+ * fake_libmtp.h
+ *
+ *      Author: Jason Ferrara
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+
+/*
+ * Tests that link fake_libmtp.cpp instead of libmtp get a device that keeps
+ * its files in memory, so the filesystem can be run in-process without a
+ * real device. It has a single storage, named fakeMtpStorageName.
+ *
+ * Add the files before opening the device. The device's calls are
+ * serialized by MtpLibLock like libmtp's, so nothing else locks them.
+ */
+
+#ifndef FAKE_LIBMTP_H_
+#define FAKE_LIBMTP_H_
+
+#include "MtpDevice.h"
+
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+extern const char* const fakeMtpStorageName;
+
+/*
+ * Add a folder or file to the storage and return its id. parent is 0 for
+ * the top of the storage.
+ */
+uint32_t fakeMtpAddFolder(uint32_t parent, const std::string& name);
+uint32_t fakeMtpAddFile(uint32_t parent, const std::string& name, const std::vector<unsigned char>& data);
+
+/*
+ * Make copying a whole file from the device take about milliseconds,
+ * spread evenly over the file's data, like a slow usb connection.
+ */
+void fakeMtpSetGetFileTime(int milliseconds);
+
+/*
+ * Whether the device says it can read part of a file. Without it, reads
+ * copy the whole file in the background.
+ */
+void fakeMtpSetPartialReads(bool partialReads);
+
+// How many whole file copies from the device are under way.
+int fakeMtpTransfersInProgress();
+
+std::unique_ptr<MtpDevice> fakeMtpOpenDevice();
+
+#endif /* FAKE_LIBMTP_H_ */
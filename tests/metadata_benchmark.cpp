@@ -0,0 +1,162 @@
+/*
+ * metadata_benchmark.cpp
+ *
+ *      Author: Jason Ferrara
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+
+
+/*
+ * Times answering for a folder of many files from MtpMetadataCache: what
+ * stat of the folder, looking up and stat'ing a file in it, and listing it
+ * take once the folder is cached. The listing is made up in memory and
+ * handed to the cache by a filler that counts how often it is asked, so no
+ * device is needed. The first argument is the number of files, 20000 by
+ * default.
+ */
+
+#include "MtpMetadataCache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <string>
+
+static const int rounds = 20;
+static const uint32_t storageId = 0x10001;
+static const uint32_t folderId = 1;
+
+static double now()
+{
+	struct timeval t;
+	gettimeofday(&t, 0);
+	return t.tv_sec + t.tv_usec / 1e6;
+}
+
+static std::string fileName(int i)
+{
+	char name[20];
+	snprintf(name, sizeof(name), "f%06d", i);
+	return name;
+}
+
+/*
+ * Hands out a copy of metadata, as fetching it from the device would.
+ */
+class BenchmarkFiller : public MtpMetadataCacheFiller
+{
+public:
+	BenchmarkFiller(const MtpNodeMetadata& metadata) : m_metadata(metadata), m_fetches(0) {}
+
+	MtpNodeMetadata getMetadata()
+	{
+		m_fetches++;
+		return m_metadata;
+	}
+
+	int fetches() const
+	{
+		return m_fetches;
+	}
+
+private:
+	const MtpNodeMetadata&	m_metadata;
+	int						m_fetches;
+};
+
+int main(int argc, char** argv)
+{
+	int files = argc > 1 ? atoi(argv[1]) : 20000;
+
+	MtpNodeMetadata folder;
+	folder.self = MtpFileInfo(folderId, 0, storageId, "metadata_benchmark", LIBMTP_FILETYPE_FOLDER, 0);
+	for(int i = 0; i < files; i++)
+		folder.children.add(MtpFileInfo(folderId + 1 + i, folderId, storageId, fileName(i),
+				LIBMTP_FILETYPE_UNKNOWN, 1000 + i));
+	folder.children.finish();
+	// Files in a cached listing are answered from it, so this should never be asked.
+	MtpNodeMetadata file;
+	BenchmarkFiller folderFiller(folder);
+	BenchmarkFiller fileFiller(file);
+
+	MtpMetadataCache cache;
+	cache.setTimeout(3600);
+	double start = now();
+	cache.getItem(folderId, folderFiller);
+	double firstFetch = now() - start;
+
+	double folderStat = 0, fileStat = 0, listing = 0;
+	for(int r = 0; r < rounds; r++)
+	{
+		start = now();
+		std::shared_ptr<const MtpNodeMetadata> md = cache.getItem(folderId, folderFiller);
+		size_t folders = md->children.count(LIBMTP_FILETYPE_FOLDER);
+		folderStat += now() - start;
+		if (folders != 0)
+		{
+			fprintf(stderr, "the folder lists %zu folders, expected none\n", folders);
+			return 1;
+		}
+
+		// A different file each round, so the lookups don't all hit the same entry.
+		std::string name = fileName(r * files / rounds);
+		start = now();
+		md = cache.getItem(folderId, folderFiller);
+		size_t child = md->children.find(name);
+		if (child == MtpFolderContents::npos)
+		{
+			fprintf(stderr, "%s isn't listed\n", name.c_str());
+			return 1;
+		}
+		std::shared_ptr<const MtpNodeMetadata> fileMd = cache.getItem(md->children.id(child), fileFiller);
+		fileStat += now() - start;
+		if (fileMd->self.filesize != md->children.filesize(child))
+		{
+			fprintf(stderr, "%s has the wrong size\n", name.c_str());
+			return 1;
+		}
+
+		start = now();
+		md = cache.getItem(folderId, folderFiller);
+		size_t nameBytes = 0;
+		uint64_t totalSize = 0;
+		for(size_t i = 0; i < md->children.size(); i++)
+		{
+			nameBytes += strlen(md->children.name(i));
+			totalSize += md->children.filesize(i);
+		}
+		listing += now() - start;
+		if ((nameBytes != (size_t) files * name.size()) || (totalSize < (uint64_t) files * 1000))
+		{
+			fprintf(stderr, "the folder lists the wrong files\n");
+			return 1;
+		}
+	}
+	printf("%d files, average of %d rounds:\n", files, rounds);
+	printf("  caching the folder  %10.1f us\n", firstFetch * 1e6);
+	printf("  stat of the folder  %10.1f us\n", folderStat / rounds * 1e6);
+	printf("  stat of a file      %10.1f us\n", fileStat / rounds * 1e6);
+	printf("  listing the folder  %10.1f us\n", listing / rounds * 1e6);
+	if ((folderFiller.fetches() != 1) || (fileFiller.fetches() != 0))
+	{
+		fprintf(stderr, "fetched the folder %d times and files %d times, expected once and never\n",
+				folderFiller.fetches(), fileFiller.fetches());
+		return 1;
+	}
+	return 0;
+}